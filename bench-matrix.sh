@@ -0,0 +1,41 @@
+#!/bin/sh
+set -e
+
+# Run the same benchmarks with each of the benchmark binaries received as
+# arguments (see the `bench-matrix' target of the Makefile), and print the
+# time of each one in a table. Each column is named after the directory of the
+# binary, or "debug" for the default build.
+
+NMEMB=1000000
+SIZE=64
+BENCHMARKS="libpool malloc interleaved pipeline-mutex pipeline-ring layout-packed
+layout-line list-libpool list-malloc map-libpool map-malloc queue-libpool
+queue-malloc"
+
+if [ $# -eq 0 ]; then
+    echo "Usage: $0 BENCHMARK-BINARY..." 1>&2
+    exit 1
+fi
+
+variant_name() {
+    case "$1" in
+        */*) basename "$(dirname "$1")" ;;
+        *)   echo "debug" ;;
+    esac
+}
+
+echo "Benchmarking ${NMEMB} elements of ${SIZE} bytes with each build variant."
+
+printf "%-16s" "benchmark"
+for bin in "$@"; do
+    printf "%14s" "$(variant_name "$bin")"
+done
+printf "\n"
+
+for bench in $BENCHMARKS; do
+    printf "%-16s" "$bench"
+    for bin in "$@"; do
+        printf "%14s" "$(env BENCH_TIME=1 "./$bin" "$bench" $NMEMB $SIZE 2>&1)"
+    done
+    printf "\n"
+done
@@ -11,12 +11,46 @@ subtract_flt() {
 
 echo "Benchmarking ${NMEMB} allocations of ${SIZE} bytes. Ignoring first ${IGNORE} calls."
 
-malloc_time1=$(env time -f "%e" ./benchmark.out "malloc" $NMEMB $SIZE 2>&1)
-malloc_time2=$(env time -f "%e" ./benchmark.out "malloc" $IGNORE $SIZE 2>&1)
+malloc_time1=$(env BENCH_TIME=1 ./benchmark.out "malloc" $NMEMB $SIZE 2>&1)
+malloc_time2=$(env BENCH_TIME=1 ./benchmark.out "malloc" $IGNORE $SIZE 2>&1)
 malloc_time=$(subtract_flt "$malloc_time1" "$malloc_time2")
-libpool_time1=$(env time -f "%e" ./benchmark.out "libpool" $NMEMB $SIZE 2>&1)
-libpool_time2=$(env time -f "%e" ./benchmark.out "libpool" $IGNORE $SIZE 2>&1)
+libpool_time1=$(env BENCH_TIME=1 ./benchmark.out "libpool" $NMEMB $SIZE 2>&1)
+libpool_time2=$(env BENCH_TIME=1 ./benchmark.out "libpool" $IGNORE $SIZE 2>&1)
 libpool_time=$(subtract_flt "$libpool_time1" "$libpool_time2")
 
 echo "Time when using 'malloc'....: ${malloc_time1} - ${malloc_time2} = ${malloc_time} seconds"
 echo "Time when using 'libpool'...: ${libpool_time1} - ${libpool_time2} = ${libpool_time} seconds"
+
+interleaved_time=$(env BENCH_TIME=1 ./benchmark.out "interleaved" $NMEMB $SIZE 2>&1)
+
+echo "Time when using 64 pools in turns: ${interleaved_time} seconds"
+
+echo "Benchmarking ${NMEMB} allocations of ${SIZE} bytes, freed by a second thread."
+
+mutex_time=$(env BENCH_TIME=1 ./benchmark.out "pipeline-mutex" $NMEMB $SIZE 2>&1)
+ring_time=$(env BENCH_TIME=1 ./benchmark.out "pipeline-ring" $NMEMB $SIZE 2>&1)
+
+echo "Time when using a mutex.....: ${mutex_time} seconds"
+echo "Time when using a ring......: ${ring_time} seconds"
+
+echo "Benchmarking random writes to ${NMEMB} objects, with packed and cache line strides."
+
+for size in 24 40 48 56; do
+    packed_time=$(env BENCH_TIME=1 ./benchmark.out "layout-packed" $NMEMB $size 2>&1)
+    line_time=$(env BENCH_TIME=1 ./benchmark.out "layout-line" $NMEMB $size 2>&1)
+    echo "Size ${size}: packed ${packed_time} seconds, cache line ${line_time} seconds"
+done
+
+echo "Benchmarking containers with ${NMEMB} elements, with nodes from pools and from malloc."
+
+for container in list map queue; do
+    libpool_time=$(env BENCH_TIME=1 ./benchmark.out "${container}-libpool" $NMEMB 32 2>&1)
+    malloc_time=$(env BENCH_TIME=1 ./benchmark.out "${container}-malloc" $NMEMB 32 2>&1)
+    echo "Container ${container}: libpool ${libpool_time} seconds, malloc ${malloc_time} seconds"
+done
+
+echo "Benchmarking a new list of objects on top of ${NMEMB} live objects, before and after aging."
+
+for allocator in libpool malloc; do
+    echo "Aging with ${allocator}: $(./benchmark.out "aging-${allocator}" $NMEMB 64)"
+done
@@ -0,0 +1,60 @@
+#!/bin/sh
+set -e
+
+# Recommend initial pool sizes from the statistics written by libpool when the
+# LIBPOOL_STATS environment variable is set. Pools with the same name are
+# grouped, and the recommendation covers the highest peak of the group, plus
+# some headroom.
+
+HEADROOM=10
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 STATS-FILE" 1>&2
+    exit 1
+fi
+
+awk -v headroom="$HEADROOM" '
+function field(name,    re, s) {
+    re = "\"" name "\":(\"([^\"\\\\]|\\\\.)*\"|[^,}]*)"
+    if (!match($0, re))
+        return ""
+    s = substr($0, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+    gsub(/^"|"$/, "", s)
+    return s
+}
+
+{
+    name = field("name")
+    if (name == "null")
+        name = "(unnamed)"
+    key = name ":" field("chunk_sz")
+
+    if (!(key in count)) {
+        order[n++] = key
+        names[key] = name
+        chunk[key] = field("chunk_sz")
+    }
+    count[key]++
+
+    if (field("pool_sz") + 0 > initial[key])
+        initial[key] = field("pool_sz") + 0
+    if (field("peak_live") + 0 > peak[key])
+        peak[key] = field("peak_live") + 0
+    if (field("expansions") + 0 > expansions[key])
+        expansions[key] = field("expansions") + 0
+    exhaustions[key] += field("exhaustions")
+}
+
+END {
+    printf "%-24s %10s %6s %10s %10s %10s %12s %12s\n", "NAME", "CHUNK_SZ",
+           "POOLS", "POOL_SZ", "PEAK", "MAX_EXP", "EXHAUSTIONS", "RECOMMENDED"
+    for (i = 0; i < n; i++) {
+        key = order[i]
+        rec = int(peak[key] * (100 + headroom) / 100)
+        if (rec < peak[key] + 1)
+            rec = peak[key] + 1
+        printf "%-24s %10d %6d %10d %10d %10d %12d %12d\n", names[key],
+               chunk[key], count[key], initial[key], peak[key],
+               expansions[key], exhaustions[key], rec
+    }
+}' "$1"
@@ -1,17 +1,49 @@
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stddef.h>
+#include <stdbool.h>
 #include <assert.h>
 #include <inttypes.h> /* strtoumax */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include "libpool.h"
+#include "libpool-thread.h"
+#include "libpool-containers.h"
 
 #define BUFFERED_PTRS 1000
 
+/*
+ * Size of the queue used for sending the allocated chunks to the second thread
+ * of the pipeline benchmarks, and size of the batches of the return ring.
+ */
+#define QUEUE_SZ   4096
+#define RING_BATCH 64
+
+/* Number of writes to each object in the layout benchmarks, on average */
+#define LAYOUT_PASSES 8
+
+/* Number of elements in each batch of the container benchmarks */
+#define CONTAINER_BATCH 64
+
+/* Number of pools used in turns by the interleaved benchmark */
+#define INTERLEAVED_POOLS 64
+
 static void* ptrs[BUFFERED_PTRS];
 static size_t ptrs_pos = 0;
 
+/* Monotonic time in seconds, used for timing the benchmarks from inside */
+static double bench_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static void benchmark_libpool(size_t nmemb, size_t size) {
     Pool* pool = pool_new(nmemb, size);
     assert(pool != NULL);
@@ -40,11 +72,726 @@ static void benchmark_malloc(size_t nmemb, size_t size) {
         free(ptrs[--ptrs_pos]);
 }
 
+/*
+ * Same as `benchmark_libpool', but each allocation is from a different pool
+ * than the previous one, like in a program with many object types. This way,
+ * the headers of all the pools are used at the same time.
+ */
+static void benchmark_interleaved(size_t nmemb, size_t size) {
+    Pool* pools[INTERLEAVED_POOLS];
+    size_t i;
+
+    for (i = 0; i < INTERLEAVED_POOLS; i++) {
+        pools[i] = pool_new(BUFFERED_PTRS / INTERLEAVED_POOLS + 1, size);
+        assert(pools[i] != NULL);
+    }
+
+    while (nmemb-- > 0) {
+        ptrs[ptrs_pos] = pool_alloc(pools[ptrs_pos % INTERLEAVED_POOLS]);
+        if (++ptrs_pos >= BUFFERED_PTRS) {
+            while (ptrs_pos > 0) {
+                ptrs_pos--;
+                pool_free(pools[ptrs_pos % INTERLEAVED_POOLS], ptrs[ptrs_pos]);
+            }
+        }
+    }
+
+    while (ptrs_pos > 0) {
+        ptrs_pos--;
+        pool_free(pools[ptrs_pos % INTERLEAVED_POOLS], ptrs[ptrs_pos]);
+    }
+
+    for (i = 0; i < INTERLEAVED_POOLS; i++)
+        pool_close(pools[i]);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The pipeline benchmarks have two threads: the main thread allocates chunks
+ * and sends them through a single-producer/single-consumer queue to the second
+ * thread, which frees them. Only the way the chunks are returned to the pool
+ * changes between benchmarks.
+ */
+static void* queue[QUEUE_SZ];
+static size_t queue_head = 0;
+static size_t queue_tail = 0;
+
+static Pool* pipeline_pool;
+static PoolRing* pipeline_ring;
+static pthread_mutex_t pipeline_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void queue_push(void* ptr) {
+    while (queue_tail - __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE) >=
+           QUEUE_SZ)
+        sched_yield();
+
+    queue[queue_tail % QUEUE_SZ] = ptr;
+    __atomic_store_n(&queue_tail, queue_tail + 1, __ATOMIC_RELEASE);
+}
+
+static void* queue_pop(void) {
+    void* result;
+
+    while (queue_head == __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    result = queue[queue_head % QUEUE_SZ];
+    __atomic_store_n(&queue_head, queue_head + 1, __ATOMIC_RELEASE);
+    return result;
+}
+
+static void* pipeline_mutex_writer(void* unused) {
+    void* ptr;
+
+    (void)unused;
+    while ((ptr = queue_pop()) != NULL) {
+        pthread_mutex_lock(&pipeline_mutex);
+        pool_free(pipeline_pool, ptr);
+        pthread_mutex_unlock(&pipeline_mutex);
+    }
+
+    return NULL;
+}
+
+static void* pipeline_ring_writer(void* unused) {
+    void* ptr;
+
+    (void)unused;
+    while ((ptr = queue_pop()) != NULL)
+        pool_ring_free(pipeline_ring, ptr);
+
+    return NULL;
+}
+
+static void benchmark_pipeline(size_t nmemb, size_t size, bool use_ring) {
+    pthread_t writer;
+    void* ptr;
+    bool expanded;
+    int err;
+
+    pipeline_pool = pool_new(QUEUE_SZ, size);
+    assert(pipeline_pool != NULL);
+
+    if (use_ring) {
+        pipeline_ring = pool_ring_new(pipeline_pool, QUEUE_SZ / RING_BATCH,
+                                      RING_BATCH);
+        assert(pipeline_ring != NULL);
+    }
+
+    err = pthread_create(&writer, NULL,
+                         use_ring ? pipeline_ring_writer
+                                  : pipeline_mutex_writer,
+                         NULL);
+    assert(err == 0);
+
+    /* The pool is only expanded if the writer falls behind */
+    while (nmemb-- > 0) {
+        if (use_ring) {
+            ptr = pool_ring_alloc(pipeline_ring);
+        } else {
+            pthread_mutex_lock(&pipeline_mutex);
+            ptr = pool_alloc(pipeline_pool);
+            pthread_mutex_unlock(&pipeline_mutex);
+        }
+
+        if (ptr == NULL) {
+            pthread_mutex_lock(&pipeline_mutex);
+            expanded = pool_expand(pipeline_pool, QUEUE_SZ);
+            assert(expanded);
+            ptr = pool_alloc(pipeline_pool);
+            pthread_mutex_unlock(&pipeline_mutex);
+        }
+
+        queue_push(ptr);
+    }
+
+    queue_push(NULL);
+    pthread_join(writer, NULL);
+
+    if (use_ring)
+        pool_ring_close(pipeline_ring);
+    pool_close(pipeline_pool);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Allocate `nmemb' objects of `size' bytes from a pool with the specified
+ * layout, and write to them in a random order, so each access touches as many
+ * cache lines as the object straddles.
+ */
+static void benchmark_layout(size_t nmemb, size_t size, int kind) {
+    PoolLayout layout;
+    Pool* pool;
+    char** objs;
+    size_t i;
+    unsigned long seed;
+
+    pool = pool_new_for(nmemb, size, 0, kind, &layout);
+    assert(pool != NULL);
+
+    objs = malloc(nmemb * sizeof(char*));
+    assert(objs != NULL);
+    for (i = 0; i < nmemb; i++)
+        objs[i] = pool_alloc(pool);
+
+    seed = 1;
+    for (i = 0; i < LAYOUT_PASSES * nmemb; i++) {
+        seed = seed * 1103515245 + 12345;
+        memset(objs[(seed >> 8) % nmemb], (int)i, size);
+    }
+
+    free(objs);
+    pool_close(pool);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The container benchmarks compare the containers of `libpool-containers' with
+ * the same containers, allocating each node with `malloc'. The data of every
+ * element is written once, so the nodes are actually used.
+ */
+typedef struct MallocNode {
+    struct MallocNode* next;
+    size_t key;
+    void* value;
+} MallocNode;
+
+static void benchmark_list_libpool(size_t nmemb, size_t size) {
+    void* batch[CONTAINER_BATCH];
+    PoolList* list;
+    size_t i, j, n;
+
+    list = pool_list_new(CONTAINER_BATCH, size);
+    assert(list != NULL);
+
+    for (i = 0; i < nmemb; i += n) {
+        n = (nmemb - i < CONTAINER_BATCH) ? nmemb - i : CONTAINER_BATCH;
+        n = pool_list_push_n(list, batch, n);
+        assert(n > 0);
+        for (j = 0; j < n; j++)
+            memset(batch[j], (int)j, size);
+    }
+
+    while (pool_list_pop_n(list, CONTAINER_BATCH) > 0)
+        continue;
+    pool_list_close(list);
+}
+
+static void benchmark_list_malloc(size_t nmemb, size_t size) {
+    MallocNode* first;
+    MallocNode* node;
+    size_t i;
+
+    first = NULL;
+    for (i = 0; i < nmemb; i++) {
+        node = malloc(sizeof(MallocNode) + size);
+        assert(node != NULL);
+        memset(node + 1, (int)i, size);
+        node->next = first;
+        first      = node;
+    }
+
+    while (first != NULL) {
+        node  = first;
+        first = node->next;
+        free(node);
+    }
+}
+
+/*
+ * The map of the `malloc' version has the same number of buckets, and it uses
+ * the same hash function, but its buckets only store pointers to the chained
+ * nodes.
+ */
+#define BENCHMARK_KEY(I) ((size_t)(I) * 2654435761u)
+
+static size_t hash_key(size_t key) {
+    key ^= key >> (sizeof(size_t) * 4);
+    key *= (size_t)0x45d9f3b;
+    key ^= key >> 16;
+    return key;
+}
+
+static void benchmark_map_libpool(size_t nmemb) {
+    size_t keys[CONTAINER_BATCH];
+    void* values[CONTAINER_BATCH];
+    PoolMap* map;
+    size_t i, j, n;
+
+    map = pool_map_new(nmemb);
+    assert(map != NULL);
+
+    for (i = 0; i < nmemb; i++)
+        if (!pool_map_put(map, BENCHMARK_KEY(i), map))
+            abort();
+
+    for (i = 0; i < nmemb; i += n) {
+        n = (nmemb - i < CONTAINER_BATCH) ? nmemb - i : CONTAINER_BATCH;
+        for (j = 0; j < n; j++)
+            keys[j] = BENCHMARK_KEY(i + j);
+        pool_map_get_n(map, keys, values, n);
+        for (j = 0; j < n; j++)
+            assert(values[j] == map);
+    }
+
+    for (i = 0; i < nmemb; i++)
+        pool_map_remove(map, BENCHMARK_KEY(i));
+    pool_map_close(map);
+}
+
+static void benchmark_map_malloc(size_t nmemb) {
+    MallocNode** buckets;
+    MallocNode** link;
+    MallocNode* node;
+    size_t mask, i;
+
+    for (mask = 1; mask < nmemb; mask *= 2)
+        continue;
+    buckets = calloc(mask--, sizeof(MallocNode*));
+    assert(buckets != NULL);
+
+    for (i = 0; i < nmemb; i++) {
+        link = &buckets[hash_key(BENCHMARK_KEY(i)) & mask];
+        node = malloc(sizeof(MallocNode));
+        assert(node != NULL);
+        node->key   = BENCHMARK_KEY(i);
+        node->value = buckets;
+        node->next  = *link;
+        *link       = node;
+    }
+
+    for (i = 0; i < nmemb; i++) {
+        node = buckets[hash_key(BENCHMARK_KEY(i)) & mask];
+        while (node != NULL && node->key != BENCHMARK_KEY(i))
+            node = node->next;
+        assert(node != NULL && node->value == buckets);
+    }
+
+    for (i = 0; i < nmemb; i++) {
+        link = &buckets[hash_key(BENCHMARK_KEY(i)) & mask];
+        while ((*link)->key != BENCHMARK_KEY(i))
+            link = &(*link)->next;
+        node  = *link;
+        *link = node->next;
+        free(node);
+    }
+
+    free(buckets);
+}
+
+/*
+ * In the queue benchmarks, a second thread produces `nmemb' messages of `size'
+ * bytes in batches, and the main thread consumes them. The `malloc' version
+ * uses the same lock-free queue, but each message is allocated with `malloc'
+ * and freed by the consumer with `free'.
+ */
+static PoolQueue* bench_queue;
+static size_t bench_nmemb;
+static size_t bench_size;
+static bool bench_done;
+
+static MallocNode* malloc_queue_head;
+static MallocNode* malloc_queue_tail;
+static MallocNode malloc_queue_stub;
+
+static void malloc_queue_push(MallocNode* first, MallocNode* last) {
+    MallocNode* prev;
+
+    __atomic_store_n(&last->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&malloc_queue_head, last, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, first, __ATOMIC_RELEASE);
+}
+
+static MallocNode* malloc_queue_pop(void) {
+    MallocNode* tail;
+    MallocNode* next;
+
+    tail = malloc_queue_tail;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &malloc_queue_stub) {
+        if (next == NULL)
+            return NULL;
+        malloc_queue_tail = next;
+        tail              = next;
+        next              = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next == NULL) {
+        if (tail != __atomic_load_n(&malloc_queue_head, __ATOMIC_ACQUIRE))
+            return NULL;
+        malloc_queue_push(&malloc_queue_stub, &malloc_queue_stub);
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if (next == NULL)
+            return NULL;
+    }
+
+    malloc_queue_tail = next;
+    return tail;
+}
+
+static void* queue_producer_libpool(void* unused) {
+    PoolQueueProducer* producer;
+    void* batch[CONTAINER_BATCH];
+    size_t i, j, n;
+
+    (void)unused;
+    producer = pool_queue_producer_new(bench_queue, QUEUE_SZ);
+    assert(producer != NULL);
+
+    for (i = 0; i < bench_nmemb; i += n) {
+        n = (bench_nmemb - i < CONTAINER_BATCH) ? bench_nmemb - i
+                                                : CONTAINER_BATCH;
+        n = pool_queue_alloc_n(producer, batch, n);
+        assert(n > 0);
+        for (j = 0; j < n; j++)
+            memset(batch[j], (int)j, bench_size);
+        pool_queue_push_n(producer, batch, n);
+    }
+
+    /* The consumer must release every message before the pool is closed */
+    while (!__atomic_load_n(&bench_done, __ATOMIC_ACQUIRE))
+        sched_yield();
+    pool_queue_producer_close(producer);
+    return NULL;
+}
+
+static void* queue_producer_malloc(void* unused) {
+    MallocNode* first;
+    MallocNode* last;
+    MallocNode* node;
+    size_t i, j, n;
+
+    (void)unused;
+    for (i = 0; i < bench_nmemb; i += n) {
+        n = (bench_nmemb - i < CONTAINER_BATCH) ? bench_nmemb - i
+                                                : CONTAINER_BATCH;
+        first = last = NULL;
+        for (j = 0; j < n; j++) {
+            node = malloc(sizeof(MallocNode) + bench_size);
+            assert(node != NULL);
+            memset(node + 1, (int)j, bench_size);
+            if (last != NULL)
+                last->next = node;
+            else
+                first = node;
+            last = node;
+        }
+        malloc_queue_push(first, last);
+    }
+
+    return NULL;
+}
+
+static void benchmark_queue(size_t nmemb, size_t size, bool use_pool) {
+    void* batch[CONTAINER_BATCH];
+    MallocNode* node;
+    pthread_t producer;
+    size_t i, j, n;
+    int err;
+
+    bench_nmemb = nmemb;
+    bench_size  = size;
+    bench_done  = false;
+
+    if (use_pool) {
+        bench_queue = pool_queue_new(size);
+        assert(bench_queue != NULL);
+    } else {
+        malloc_queue_head = &malloc_queue_stub;
+        malloc_queue_tail = &malloc_queue_stub;
+    }
+
+    err = pthread_create(&producer, NULL,
+                         use_pool ? queue_producer_libpool
+                                  : queue_producer_malloc,
+                         NULL);
+    assert(err == 0);
+
+    for (i = 0; i < nmemb; i += n) {
+        if (use_pool) {
+            n = pool_queue_pop_n(bench_queue, batch, CONTAINER_BATCH);
+            for (j = 0; j < n; j++)
+                pool_queue_release(bench_queue, batch[j]);
+        } else {
+            for (n = 0; n < CONTAINER_BATCH; n++) {
+                node = malloc_queue_pop();
+                if (node == NULL)
+                    break;
+                free(node);
+            }
+        }
+
+        if (n == 0)
+            sched_yield();
+    }
+
+    if (use_pool)
+        pool_queue_flush(bench_queue);
+    __atomic_store_n(&bench_done, true, __ATOMIC_RELEASE);
+    pthread_join(producer, NULL);
+
+    if (use_pool)
+        pool_queue_close(bench_queue);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The aging benchmarks simulate a long-running program before measuring the
+ * allocator. Every object gets a random lifetime, in steps, and it's stored in
+ * the slot of a timing wheel where it expires. On each step, the expired
+ * objects are freed, and the same number of objects are allocated, so there
+ * are always `nmemb' live objects, but they end up scattered in memory.
+ *
+ * The random numbers are generated with a fixed seed, so every run (and every
+ * allocator) goes through the same sequence. The allocation of a new list of
+ * objects, and its traversal, are measured before and after aging (see
+ * `aging_measure').
+ *
+ * The following environment variables change the workload:
+ *
+ *   - BENCH_SEED: Seed of the random number generator, 1 by default.
+ *   - BENCH_AGING: Number of objects allocated while aging, as a multiple of
+ *     `nmemb', 16 by default.
+ *   - BENCH_LIFETIME: Distribution of the lifetimes: "uniform", "log" (as many
+ *     objects live 1-2 steps as 512-1023 steps) or "bimodal" (90% live up to
+ *     16 steps, and the rest at least 512 steps), which is the default.
+ */
+#define AGING_WHEEL_SZ 1024
+
+enum AgingLifetime {
+    LIFETIME_UNIFORM,
+    LIFETIME_LOG,
+    LIFETIME_BIMODAL
+};
+
+static void* aging_wheel[AGING_WHEEL_SZ];
+static Pool* aging_pool;
+static size_t aging_size;
+static unsigned long aging_seed;
+static enum AgingLifetime aging_dist;
+
+/*
+ * Xorshift generator with 32 bits of state, so the sequence doesn't depend on
+ * the size of `long'.
+ */
+static unsigned long aging_rand(void) {
+    aging_seed ^= (aging_seed << 13) & 0xffffffffUL;
+    aging_seed ^= aging_seed >> 17;
+    aging_seed ^= (aging_seed << 5) & 0xffffffffUL;
+    return aging_seed;
+}
+
+static size_t aging_lifetime(void) {
+    unsigned long r, shift;
+
+    r = aging_rand();
+    switch (aging_dist) {
+        case LIFETIME_UNIFORM:
+            return 1 + r % (AGING_WHEEL_SZ - 1);
+
+        case LIFETIME_LOG:
+            shift = r % 10;
+            return ((size_t)1 << shift) + (r >> 4) % ((size_t)1 << shift);
+
+        case LIFETIME_BIMODAL:
+        default:
+            return (r % 10 != 0) ? 1 + (r >> 4) % 16 : 512 + (r >> 4) % 511;
+    }
+}
+
+/*
+ * Allocate an object that expires `lifetime' steps after `now'. The first word
+ * links the objects of the same slot, and the second one is written by the
+ * traversal.
+ */
+static void aging_alloc(size_t now) {
+    void* obj;
+    size_t slot;
+
+    obj = (aging_pool != NULL) ? pool_alloc(aging_pool) : malloc(aging_size);
+    assert(obj != NULL);
+
+    slot              = (now + aging_lifetime()) % AGING_WHEEL_SZ;
+    ((size_t*)obj)[1] = 0;
+    *(void**)obj      = aging_wheel[slot];
+    aging_wheel[slot] = obj;
+}
+
+/*
+ * Free a list of objects, returning its length.
+ */
+static size_t aging_free_list(void* obj) {
+    void* next;
+    size_t n;
+
+    for (n = 0; obj != NULL; n++) {
+        next = *(void**)obj;
+        if (aging_pool != NULL)
+            pool_free(aging_pool, obj);
+        else
+            free(obj);
+        obj = next;
+    }
+
+    return n;
+}
+
+/*
+ * Replace the objects that expire at `now' with the same number of new ones,
+ * returning that number. The new objects are allocated before freeing the
+ * expired ones, otherwise the pool would just reuse the same chunks.
+ */
+static size_t aging_step(size_t now) {
+    void* expired;
+    void* obj;
+    size_t slot;
+
+    slot              = now % AGING_WHEEL_SZ;
+    expired           = aging_wheel[slot];
+    aging_wheel[slot] = NULL;
+
+    for (obj = expired; obj != NULL; obj = *(void**)obj)
+        aging_alloc(now);
+
+    return aging_free_list(expired);
+}
+
+/*
+ * Allocate `n' objects on top of the live objects, linking them in the order
+ * they were allocated, like a program that builds a new list. Then, traverse
+ * the list `LAYOUT_PASSES' times, and free it. The time of the allocations and
+ * frees is stored in `churn', and the time of the traversal in `traversal'.
+ *
+ * In a fresh pool, the objects of the list are contiguous, but in an aged one,
+ * they come from the free chunks left by the expired objects.
+ */
+static void aging_measure(size_t n, double* churn, double* traversal) {
+    void* list;
+    void* obj;
+    size_t i;
+    double start, end;
+
+    start = bench_clock();
+    list  = NULL;
+    for (i = 0; i < n; i++) {
+        obj = (aging_pool != NULL) ? pool_alloc(aging_pool)
+                                   : malloc(aging_size);
+        assert(obj != NULL);
+        ((size_t*)obj)[1] = 0;
+        *(void**)obj      = list;
+        list              = obj;
+    }
+    end    = bench_clock();
+    *churn = end - start;
+
+    for (i = 0; i < LAYOUT_PASSES; i++)
+        for (obj = list; obj != NULL; obj = *(void**)obj)
+            ((size_t*)obj)[1]++;
+    start      = bench_clock();
+    *traversal = start - end;
+
+    while (list != NULL) {
+        obj  = list;
+        list = *(void**)obj;
+        if (aging_pool != NULL)
+            pool_free(aging_pool, obj);
+        else
+            free(obj);
+    }
+    *churn += bench_clock() - start;
+}
+
+/*
+ * Exhaustion handler of the pool, in case a step needs more chunks than the
+ * ones left for the measured list.
+ */
+static void aging_grow(Pool* pool, void* ctx) {
+    pool_expand(pool, *(size_t*)ctx);
+}
+
+static unsigned long aging_env(const char* name, unsigned long fallback) {
+    const char* value;
+
+    value = getenv(name);
+    return (value != NULL && *value != '\0') ? strtoul(value, NULL, 10)
+                                             : fallback;
+}
+
+static void benchmark_aging(size_t nmemb, size_t size, bool use_pool) {
+    const char* dist;
+    double fresh_churn, fresh_traversal, aged_churn, aged_traversal;
+    size_t i, now, allocated, aging, list_len;
+
+    aging_seed = aging_env("BENCH_SEED", 1) & 0xffffffffUL;
+    if (aging_seed == 0)
+        aging_seed = 1;
+    aging = aging_env("BENCH_AGING", 16);
+
+    dist = getenv("BENCH_LIFETIME");
+    if (dist == NULL || !strcmp(dist, "bimodal"))
+        aging_dist = LIFETIME_BIMODAL;
+    else if (!strcmp(dist, "uniform"))
+        aging_dist = LIFETIME_UNIFORM;
+    else if (!strcmp(dist, "log"))
+        aging_dist = LIFETIME_LOG;
+    else
+        abort();
+
+    /* Room for the links, and for the measured list on top of the objects */
+    aging_size = (size < 2 * sizeof(size_t)) ? 2 * sizeof(size_t) : size;
+    list_len   = (nmemb + 3) / 4;
+    aging_pool = NULL;
+    if (use_pool) {
+        aging_pool = pool_new(nmemb + list_len, aging_size);
+        assert(aging_pool != NULL);
+        pool_set_exhausted_handler(aging_pool, aging_grow, &list_len);
+    }
+
+    for (i = 0; i < nmemb; i++)
+        aging_alloc(0);
+
+    aging_measure(list_len, &fresh_churn, &fresh_traversal);
+
+    for (now = 1, allocated = 0; allocated / nmemb < aging; now++)
+        allocated += aging_step(now);
+
+    aging_measure(list_len, &aged_churn, &aged_traversal);
+
+    printf("fresh: churn %.3f, traversal %.3f; aged %lu steps: churn %.3f, "
+           "traversal %.3f seconds\n",
+           fresh_churn,
+           fresh_traversal,
+           (unsigned long)now,
+           aged_churn,
+           aged_traversal);
+
+    for (i = 0; i < AGING_WHEEL_SZ; i++)
+        aging_free_list(aging_wheel[i]);
+    pool_close(aging_pool);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * If the `BENCH_TIME' environment variable is set, the wall time of the
+ * benchmark is printed to `stderr', in seconds. This is used by the scripts
+ * instead of depending on an external `time' command.
+ */
 int main(int argc, char** argv) {
     size_t nmemb, size;
+    double start;
 
     if (argc != 4) {
-        fprintf(stderr, "Usage: %s <libpool|malloc> NMEMB SIZE\n", argv[0]);
+        fprintf(stderr,
+                "Usage: %s <libpool|malloc|interleaved|pipeline-mutex|"
+                "pipeline-ring|layout-packed|layout-line|list-libpool|"
+                "list-malloc|map-libpool|map-malloc|queue-libpool|"
+                "queue-malloc|aging-libpool|aging-malloc> NMEMB SIZE\n",
+                argv[0]);
         return 1;
     }
 
@@ -56,14 +803,44 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    start = bench_clock();
     if (!strcmp(argv[1], "libpool")) {
         benchmark_libpool(nmemb, size);
     } else if (!strcmp(argv[1], "malloc")) {
         benchmark_malloc(nmemb, size);
+    } else if (!strcmp(argv[1], "interleaved")) {
+        benchmark_interleaved(nmemb, size);
+    } else if (!strcmp(argv[1], "pipeline-mutex")) {
+        benchmark_pipeline(nmemb, size, false);
+    } else if (!strcmp(argv[1], "pipeline-ring")) {
+        benchmark_pipeline(nmemb, size, true);
+    } else if (!strcmp(argv[1], "layout-packed")) {
+        benchmark_layout(nmemb, size, POOL_LAYOUT_PACKED);
+    } else if (!strcmp(argv[1], "layout-line")) {
+        benchmark_layout(nmemb, size, POOL_LAYOUT_CACHE_LINE);
+    } else if (!strcmp(argv[1], "list-libpool")) {
+        benchmark_list_libpool(nmemb, size);
+    } else if (!strcmp(argv[1], "list-malloc")) {
+        benchmark_list_malloc(nmemb, size);
+    } else if (!strcmp(argv[1], "map-libpool")) {
+        benchmark_map_libpool(nmemb);
+    } else if (!strcmp(argv[1], "map-malloc")) {
+        benchmark_map_malloc(nmemb);
+    } else if (!strcmp(argv[1], "queue-libpool")) {
+        benchmark_queue(nmemb, size, true);
+    } else if (!strcmp(argv[1], "queue-malloc")) {
+        benchmark_queue(nmemb, size, false);
+    } else if (!strcmp(argv[1], "aging-libpool")) {
+        benchmark_aging(nmemb, size, true);
+    } else if (!strcmp(argv[1], "aging-malloc")) {
+        benchmark_aging(nmemb, size, false);
     } else {
-        fprintf(stderr, "The first argument must be 'libpool' or 'malloc'.\n");
+        fprintf(stderr, "Invalid benchmark name.\n");
         return 1;
     }
 
+    if (getenv("BENCH_TIME") != NULL)
+        fprintf(stderr, "%.2f\n", bench_clock() - start);
+
     return 0;
 }
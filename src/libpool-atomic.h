@@ -0,0 +1,86 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is part of libpool, a tiny (ANSI) C library for pool allocation.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Atomic operations used by the concurrent modules, which are not part of the
+ * public interface. You don't need to include this header from your program.
+ *
+ * The core library is ANSI C, but the modules that share data between threads
+ * are compiled as C11 when possible, and use <stdatomic.h>. Otherwise, the GCC
+ * `__atomic' builtins are used, which have the same memory model.
+ *
+ * Every object that is accessed atomically must be declared with `ATOMIC',
+ * and should only be accessed with the macros below, since plain accesses of
+ * C11 atomic objects are sequentially consistent, and much slower on some
+ * architectures. The memory orders are the ones of C11, without the prefix.
+ */
+
+#ifndef POOL_ATOMIC_H_
+#define POOL_ATOMIC_H_ 1
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && \
+  !defined(__STDC_NO_ATOMICS__)
+
+#include <stdatomic.h>
+
+#define ATOMIC(TYPE) _Atomic(TYPE)
+
+#define ORDER_RELAXED memory_order_relaxed
+#define ORDER_ACQUIRE memory_order_acquire
+#define ORDER_RELEASE memory_order_release
+#define ORDER_ACQ_REL memory_order_acq_rel
+
+#define ATOMIC_LOAD(PTR, ORDER) atomic_load_explicit(PTR, ORDER)
+#define ATOMIC_STORE(PTR, VAL, ORDER) atomic_store_explicit(PTR, VAL, ORDER)
+#define ATOMIC_EXCHANGE(PTR, VAL, ORDER) \
+    atomic_exchange_explicit(PTR, VAL, ORDER)
+
+/*
+ * Compare the object pointed to by `PTR' with the one pointed to by `EXP', and
+ * replace it with `VAL' if they are equal. Otherwise, the current value is
+ * written to `EXP'. The weak version can fail spuriously, so it should only be
+ * used in loops.
+ */
+#define ATOMIC_CAS_WEAK(PTR, EXP, VAL, SUCCESS, FAILURE) \
+    atomic_compare_exchange_weak_explicit(PTR, EXP, VAL, SUCCESS, FAILURE)
+#define ATOMIC_CAS_STRONG(PTR, EXP, VAL, SUCCESS, FAILURE) \
+    atomic_compare_exchange_strong_explicit(PTR, EXP, VAL, SUCCESS, FAILURE)
+
+#elif defined(__GNUC__)
+
+#define ATOMIC(TYPE) TYPE
+
+#define ORDER_RELAXED __ATOMIC_RELAXED
+#define ORDER_ACQUIRE __ATOMIC_ACQUIRE
+#define ORDER_RELEASE __ATOMIC_RELEASE
+#define ORDER_ACQ_REL __ATOMIC_ACQ_REL
+
+#define ATOMIC_LOAD(PTR, ORDER) __atomic_load_n(PTR, ORDER)
+#define ATOMIC_STORE(PTR, VAL, ORDER) __atomic_store_n(PTR, VAL, ORDER)
+#define ATOMIC_EXCHANGE(PTR, VAL, ORDER) __atomic_exchange_n(PTR, VAL, ORDER)
+
+#define ATOMIC_CAS_WEAK(PTR, EXP, VAL, SUCCESS, FAILURE) \
+    __atomic_compare_exchange_n(PTR, EXP, VAL, true, SUCCESS, FAILURE)
+#define ATOMIC_CAS_STRONG(PTR, EXP, VAL, SUCCESS, FAILURE) \
+    __atomic_compare_exchange_n(PTR, EXP, VAL, false, SUCCESS, FAILURE)
+
+#else
+#error "The concurrent modules of libpool need C11 atomics or GCC builtins."
+#endif
+
+#endif /* POOL_ATOMIC_H_ */
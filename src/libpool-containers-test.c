@@ -0,0 +1,227 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "libpool.h"
+#include "libpool-containers.h"
+
+#define LIST_LEN 1000
+#define MAP_KEYS 10000
+
+#define NUM_PRODUCERS 4
+#define PRODUCER_MSGS 100000
+#define PRODUCER_POOL 64
+#define PUSH_BATCH    16
+
+typedef struct {
+    size_t producer;
+    size_t seq;
+} Message;
+
+/*
+ * Push many elements to a list, one by one and in batches, and pop them back.
+ */
+static void test_list(void) {
+    PoolList* list;
+    void* batch[LIST_LEN / 2];
+    size_t* data;
+    size_t i, sum;
+
+    list = pool_list_new(16, sizeof(size_t));
+    if (list == NULL) {
+        fprintf(stderr, "Could not create a new list.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < LIST_LEN / 2; i++) {
+        data = pool_list_push(list);
+        if (data == NULL) {
+            fprintf(stderr, "Could not push to the list.\n");
+            exit(1);
+        }
+        *data = i;
+    }
+
+    if (pool_list_push_n(list, batch, LIST_LEN / 2) != LIST_LEN / 2) {
+        fprintf(stderr, "Could not push a batch to the list.\n");
+        exit(1);
+    }
+    for (i = 0; i < LIST_LEN / 2; i++)
+        *(size_t*)batch[i] = LIST_LEN / 2 + i;
+
+    sum = 0;
+    data = pool_list_first(list);
+    for (; data != NULL; data = pool_list_next(data))
+        sum += *data;
+
+    pool_list_pop(list);
+    pool_list_pop_n(list, LIST_LEN);
+    printf("Pushed %lu elements to a list (sum %lu), %lu left after popping.\n",
+           (unsigned long)LIST_LEN,
+           (unsigned long)sum,
+           (unsigned long)pool_list_len(list));
+
+    pool_list_close(list);
+}
+
+/*
+ * Fill a small map, so it's resized a few times, and look up every key.
+ */
+static void test_map(void) {
+    PoolMap* map;
+    size_t keys[MAP_KEYS];
+    void* values[MAP_KEYS];
+    size_t i, found;
+
+    map = pool_map_new(16);
+    if (map == NULL) {
+        fprintf(stderr, "Could not create a new map.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < MAP_KEYS; i++) {
+        keys[i]   = i * 7919;
+        values[i] = &keys[i];
+    }
+
+    if (pool_map_put_n(map, keys, values, MAP_KEYS) != MAP_KEYS) {
+        fprintf(stderr, "Could not add the keys to the map.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < MAP_KEYS; i += 2)
+        pool_map_remove(map, keys[i]);
+
+    pool_map_get_n(map, keys, values, MAP_KEYS);
+    found = 0;
+    for (i = 0; i < MAP_KEYS; i++) {
+        if ((values[i] != NULL) != (i % 2 == 1) ||
+            (values[i] != NULL && values[i] != &keys[i])) {
+            fprintf(stderr, "Wrong value for key %lu.\n", (unsigned long)i);
+            exit(1);
+        }
+        if (values[i] != NULL)
+            found++;
+    }
+
+    printf("Added %d keys to a map, found %lu of %lu after removing half.\n",
+           MAP_KEYS,
+           (unsigned long)found,
+           (unsigned long)pool_map_len(map));
+
+    pool_map_close(map);
+}
+
+/*
+ * Each producer pushes its messages in order, some of them in batches, and the
+ * consumer checks that the messages of each producer arrive in that order.
+ * The producers only close once the consumer has released everything.
+ */
+static PoolQueue* queue;
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond   = PTHREAD_COND_INITIALIZER;
+static bool consumer_done         = false;
+
+static void* producer_thread(void* arg) {
+    PoolQueueProducer* producer;
+    void* batch[PUSH_BATCH];
+    Message* msg;
+    size_t id, seq, n, i;
+
+    id       = (size_t)arg;
+    producer = pool_queue_producer_new(queue, PRODUCER_POOL);
+    if (producer == NULL) {
+        fprintf(stderr, "Could not create a new producer.\n");
+        exit(1);
+    }
+
+    for (seq = 0; seq < PRODUCER_MSGS; seq += n) {
+        n = (seq % 3 == 0) ? 1 : PUSH_BATCH;
+        if (n > PRODUCER_MSGS - seq)
+            n = PRODUCER_MSGS - seq;
+
+        if (pool_queue_alloc_n(producer, batch, n) != n) {
+            fprintf(stderr, "Could not allocate the messages.\n");
+            exit(1);
+        }
+
+        for (i = 0; i < n; i++) {
+            msg           = batch[i];
+            msg->producer = id;
+            msg->seq      = seq + i;
+        }
+
+        if (n == 1)
+            pool_queue_push(producer, batch[0]);
+        else
+            pool_queue_push_n(producer, batch, n);
+    }
+
+    pthread_mutex_lock(&done_mutex);
+    while (!consumer_done)
+        pthread_cond_wait(&done_cond, &done_mutex);
+    pthread_mutex_unlock(&done_mutex);
+
+    pool_queue_producer_close(producer);
+    return NULL;
+}
+
+static void test_queue(void) {
+    pthread_t threads[NUM_PRODUCERS];
+    size_t next_seq[NUM_PRODUCERS];
+    void* popped[PUSH_BATCH];
+    Message* msg;
+    size_t total, n, i;
+
+    queue = pool_queue_new(sizeof(Message));
+    if (queue == NULL) {
+        fprintf(stderr, "Could not create a new queue.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < NUM_PRODUCERS; i++) {
+        next_seq[i] = 0;
+        if (pthread_create(&threads[i], NULL, producer_thread, (void*)i) != 0) {
+            fprintf(stderr, "Could not create a thread.\n");
+            exit(1);
+        }
+    }
+
+    for (total = 0; total < NUM_PRODUCERS * PRODUCER_MSGS; total += n) {
+        n = pool_queue_pop_n(queue, popped, PUSH_BATCH);
+        for (i = 0; i < n; i++) {
+            msg = popped[i];
+            if (msg->seq != next_seq[msg->producer]++) {
+                fprintf(stderr, "Message out of order.\n");
+                exit(1);
+            }
+            pool_queue_release(queue, msg);
+        }
+    }
+    pool_queue_flush(queue);
+
+    pthread_mutex_lock(&done_mutex);
+    consumer_done = true;
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&done_mutex);
+
+    for (i = 0; i < NUM_PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+
+    pool_queue_close(queue);
+    printf("Received %d messages from %d producers, in order.\n",
+           NUM_PRODUCERS * PRODUCER_MSGS,
+           NUM_PRODUCERS);
+}
+
+int main(void) {
+    test_list();
+    test_map();
+    test_queue();
+    return 0;
+}
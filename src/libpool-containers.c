@@ -0,0 +1,830 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is part of libpool, a tiny (ANSI) C library for pool allocation.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/* NOTE: Remember to change these paths if you move the headers */
+#include "libpool.h"
+#include "libpool-internal.h"
+#include "libpool-atomic.h"
+#include "libpool-thread.h"
+#include "libpool-containers.h"
+
+/*
+ * Size of the links stored before the data of each element of a list or queue.
+ * It's also the alignment of the data.
+ */
+#define NODE_HDR_SZ (2 * sizeof(void*))
+
+#define NODE_DATA(NODE) ((void*)((char*)(NODE) + NODE_HDR_SZ))
+#define DATA_NODE(DATA) ((void*)((char*)(DATA) - NODE_HDR_SZ))
+
+/*
+ * Number of chunks in each batch of the return ring of a queue producer, and
+ * number of batches in the ring.
+ */
+#define QUEUE_BATCH_SZ 32
+#define QUEUE_RING_SZ  64
+
+/*
+ * Maximum number of elements that are freed with a single call to
+ * `pool_free_n', and number of buckets that are hashed before they are read or
+ * written by `pool_map_get_n' and `pool_map_put_n'.
+ */
+#define FREE_BATCH_SZ 64
+#define MAP_BATCH_SZ  16
+
+#if defined(__GNUC__)
+#define PREFETCH(ADDR) __builtin_prefetch(ADDR)
+#else
+#define PREFETCH(ADDR) ((void)(ADDR))
+#endif
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Create a pool for elements with `data_sz' bytes of data, stored after the
+ * links, so the data is aligned to the size of the links.
+ */
+static Pool* node_pool_new(size_t pool_sz, size_t data_sz) {
+    if (data_sz > (size_t)-1 - NODE_HDR_SZ)
+        return NULL;
+
+    return pool_new_for(pool_sz, NODE_HDR_SZ + data_sz, NODE_HDR_SZ,
+                        POOL_LAYOUT_PACKED, NULL);
+}
+
+/*
+ * Expand a pool of a container, doubling its `capacity'. Returns false if the
+ * pool can't be expanded.
+ */
+static bool grow(Pool* pool, size_t* capacity) {
+    if (!pool_expand(pool, *capacity))
+        return false;
+
+    if (*capacity <= (size_t)-1 / 2)
+        *capacity *= 2;
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The list is just a linked list of chunks, where the `next' pointer of each
+ * element is stored at the start of its chunk, and its data after the links.
+ */
+typedef struct ListNode ListNode;
+struct ListNode {
+    ListNode* next;
+};
+
+struct PoolList {
+    Pool* pool;
+    ListNode* first;
+    size_t len;
+    size_t capacity;
+};
+
+PoolList* pool_list_new(size_t pool_sz, size_t data_sz) {
+    PoolList* list;
+
+    list = pool_ext_alloc(sizeof(PoolList));
+    if (list == NULL)
+        return NULL;
+
+    list->pool = node_pool_new(pool_sz, data_sz);
+    if (list->pool == NULL) {
+        pool_ext_free(list);
+        return NULL;
+    }
+
+    list->first    = NULL;
+    list->len      = 0;
+    list->capacity = pool_sz;
+    return list;
+}
+
+void pool_list_close(PoolList* list) {
+    if (list == NULL)
+        return;
+
+    pool_close(list->pool);
+    pool_ext_free(list);
+}
+
+void* pool_list_push(PoolList* list) {
+    ListNode* node;
+
+    node = pool_alloc(list->pool);
+    if (node == NULL && grow(list->pool, &list->capacity))
+        node = pool_alloc(list->pool);
+    if (node == NULL)
+        return NULL;
+
+    node->next  = list->first;
+    list->first = node;
+    list->len++;
+
+    return NODE_DATA(node);
+}
+
+/*
+ * The nodes are allocated with `pool_alloc_n', directly into the `data' array,
+ * and then they are linked and replaced with pointers to their data.
+ */
+size_t pool_list_push_n(PoolList* list, void** data, size_t n) {
+    ListNode* node;
+    size_t done, i;
+
+    done = 0;
+    while (done < n) {
+        done += pool_alloc_n(list->pool, data + done, n - done);
+        if (done < n && !grow(list->pool, &list->capacity))
+            break;
+    }
+
+    for (i = 0; i < done; i++) {
+        node        = data[i];
+        node->next  = list->first;
+        list->first = node;
+        data[i]     = NODE_DATA(node);
+    }
+    list->len += done;
+
+    return done;
+}
+
+bool pool_list_pop(PoolList* list) {
+    ListNode* node;
+
+    node = list->first;
+    if (node == NULL)
+        return false;
+
+    list->first = node->next;
+    list->len--;
+    pool_free(list->pool, node);
+
+    return true;
+}
+
+/*
+ * The nodes are unlinked first, and then freed in batches with `pool_free_n'.
+ */
+size_t pool_list_pop_n(PoolList* list, size_t n) {
+    void* batch[FREE_BATCH_SZ];
+    size_t nbatch, removed;
+
+    nbatch = 0;
+    for (removed = 0; removed < n && list->first != NULL; removed++) {
+        batch[nbatch++] = list->first;
+        list->first     = list->first->next;
+
+        if (nbatch == FREE_BATCH_SZ) {
+            pool_free_n(list->pool, batch, nbatch);
+            nbatch = 0;
+        }
+    }
+
+    pool_free_n(list->pool, batch, nbatch);
+    list->len -= removed;
+
+    return removed;
+}
+
+void* pool_list_first(PoolList* list) {
+    return (list->first == NULL) ? NULL : NODE_DATA(list->first);
+}
+
+void* pool_list_next(void* data) {
+    ListNode* node = DATA_NODE(data);
+    return (node->next == NULL) ? NULL : NODE_DATA(node->next);
+}
+
+size_t pool_list_len(PoolList* list) {
+    return list->len;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The queue is an intrusive multiple-producer, single-consumer linked list, as
+ * described by Dmitry Vyukov. Producers push a chain of nodes by swapping the
+ * `head' pointer with an atomic exchange, and then linking the previous head
+ * to the chain. The consumer pops the nodes from the `tail'. A `stub' node is
+ * always kept in the queue, so the consumer never has to pop the last node
+ * while a producer is linking a new one after it.
+ *
+ * Each node also stores its producer, so the consumer can release it to the
+ * return ring of that producer.
+ */
+typedef struct QueueNode QueueNode;
+struct QueueNode {
+    ATOMIC(QueueNode*) next;
+    PoolQueueProducer* producer;
+};
+
+struct PoolQueue {
+    /* Written by the producers */
+    ATOMIC(QueueNode*) head;
+    char padding1[LIBPOOL_CACHE_LINE_SZ];
+
+    /* Only used by the consumer */
+    QueueNode* tail;
+    QueueNode stub;
+    char padding2[LIBPOOL_CACHE_LINE_SZ];
+
+    /* List of producers, protected by the mutex */
+    pthread_mutex_t mutex;
+    PoolQueueProducer* producers;
+
+    size_t data_sz;
+};
+
+struct PoolQueueProducer {
+    PoolQueue* queue;
+    Pool* pool;
+    PoolRing* ring;
+    size_t capacity;
+
+    PoolQueueProducer* next;
+    PoolQueueProducer* prev;
+};
+
+/*
+ * Add a chain of nodes, from `first' to `last', to the back of the queue.
+ * Until the previous head is linked, the consumer sees the queue as empty
+ * after that node.
+ */
+static void queue_push_chain(PoolQueue* queue, QueueNode* first,
+                             QueueNode* last) {
+    QueueNode* prev;
+
+    ATOMIC_STORE(&last->next, NULL, ORDER_RELAXED);
+    prev = ATOMIC_EXCHANGE(&queue->head, last, ORDER_ACQ_REL);
+    ATOMIC_STORE(&prev->next, first, ORDER_RELEASE);
+}
+
+PoolQueue* pool_queue_new(size_t data_sz) {
+    PoolQueue* queue;
+
+    /* The producers create their pools from different threads */
+    pool_thread_init();
+
+    queue = pool_ext_alloc(sizeof(PoolQueue));
+    if (queue == NULL)
+        return NULL;
+
+    if (pthread_mutex_init(&queue->mutex, NULL) != 0) {
+        pool_ext_free(queue);
+        return NULL;
+    }
+
+    queue->stub.producer = NULL;
+    queue->tail          = &queue->stub;
+    queue->producers     = NULL;
+    queue->data_sz       = data_sz;
+    ATOMIC_STORE(&queue->stub.next, NULL, ORDER_RELAXED);
+    ATOMIC_STORE(&queue->head, &queue->stub, ORDER_RELAXED);
+    return queue;
+}
+
+void pool_queue_close(PoolQueue* queue) {
+    if (queue == NULL)
+        return;
+
+    pthread_mutex_destroy(&queue->mutex);
+    pool_ext_free(queue);
+}
+
+PoolQueueProducer* pool_queue_producer_new(PoolQueue* queue, size_t pool_sz) {
+    PoolQueueProducer* producer;
+
+    producer = pool_ext_alloc(sizeof(PoolQueueProducer));
+    if (producer == NULL)
+        return NULL;
+
+    producer->pool = node_pool_new(pool_sz, queue->data_sz);
+    if (producer->pool == NULL) {
+        pool_ext_free(producer);
+        return NULL;
+    }
+
+    producer->ring = pool_ring_new(producer->pool, QUEUE_RING_SZ,
+                                   QUEUE_BATCH_SZ);
+    if (producer->ring == NULL) {
+        pool_close(producer->pool);
+        pool_ext_free(producer);
+        return NULL;
+    }
+
+    producer->queue    = queue;
+    producer->capacity = pool_sz;
+
+    pthread_mutex_lock(&queue->mutex);
+    producer->prev = NULL;
+    producer->next = queue->producers;
+    if (queue->producers != NULL)
+        queue->producers->prev = producer;
+    queue->producers = producer;
+    pthread_mutex_unlock(&queue->mutex);
+
+    return producer;
+}
+
+void pool_queue_producer_close(PoolQueueProducer* producer) {
+    PoolQueue* queue;
+
+    if (producer == NULL)
+        return;
+
+    queue = producer->queue;
+    pthread_mutex_lock(&queue->mutex);
+    if (producer->prev != NULL)
+        producer->prev->next = producer->next;
+    else
+        queue->producers = producer->next;
+    if (producer->next != NULL)
+        producer->next->prev = producer->prev;
+    pthread_mutex_unlock(&queue->mutex);
+
+    pool_ring_close(producer->ring);
+    pool_close(producer->pool);
+    pool_ext_free(producer);
+}
+
+void* pool_queue_alloc(PoolQueueProducer* producer) {
+    QueueNode* node;
+
+    node = pool_ring_alloc(producer->ring);
+    if (node == NULL && grow(producer->pool, &producer->capacity))
+        node = pool_alloc(producer->pool);
+    if (node == NULL)
+        return NULL;
+
+    node->producer = producer;
+    return NODE_DATA(node);
+}
+
+/*
+ * The elements released by the consumer are only reclaimed from the ring when
+ * the pool runs out of free chunks, before expanding it. Running out of free
+ * chunks is expected here, so the exhaustion handler is only called once the
+ * ring is empty and the pool can't be expanded.
+ */
+size_t pool_queue_alloc_n(PoolQueueProducer* producer, void** data, size_t n) {
+    QueueNode* node;
+    size_t done, i;
+
+    done = 0;
+    while (done < n) {
+        done += pool_try_alloc_n(producer->pool, data + done, n - done);
+        if (done < n && pool_ring_drain(producer->ring) == 0 &&
+            !grow(producer->pool, &producer->capacity))
+            break;
+    }
+
+    if (done < n)
+        done += pool_alloc_n(producer->pool, data + done, n - done);
+
+    for (i = 0; i < done; i++) {
+        node           = data[i];
+        node->producer = producer;
+        data[i]        = NODE_DATA(node);
+    }
+
+    return done;
+}
+
+void pool_queue_push(PoolQueueProducer* producer, void* data) {
+    QueueNode* node = DATA_NODE(data);
+    queue_push_chain(producer->queue, node, node);
+}
+
+void pool_queue_push_n(PoolQueueProducer* producer, void** data, size_t n) {
+    QueueNode* node;
+    size_t i;
+
+    if (n == 0)
+        return;
+
+    /* The links are published by the release store in `queue_push_chain' */
+    for (i = 0; i + 1 < n; i++) {
+        node = DATA_NODE(data[i]);
+        ATOMIC_STORE(&node->next, DATA_NODE(data[i + 1]), ORDER_RELAXED);
+    }
+
+    queue_push_chain(producer->queue,
+                     DATA_NODE(data[0]),
+                     DATA_NODE(data[n - 1]));
+}
+
+/*
+ * When the `tail' is the last node, it can only be popped after pushing the
+ * `stub' node behind it. If a producer has swapped the `head' but not linked
+ * its chain yet, the queue is treated as empty.
+ */
+void* pool_queue_pop(PoolQueue* queue) {
+    QueueNode* tail;
+    QueueNode* next;
+
+    tail = queue->tail;
+    next = ATOMIC_LOAD(&tail->next, ORDER_ACQUIRE);
+    if (tail == &queue->stub) {
+        if (next == NULL)
+            return NULL;
+
+        queue->tail = next;
+        tail        = next;
+        next        = ATOMIC_LOAD(&tail->next, ORDER_ACQUIRE);
+    }
+
+    if (next == NULL) {
+        if (tail != ATOMIC_LOAD(&queue->head, ORDER_ACQUIRE))
+            return NULL;
+
+        queue_push_chain(queue, &queue->stub, &queue->stub);
+        next = ATOMIC_LOAD(&tail->next, ORDER_ACQUIRE);
+        if (next == NULL)
+            return NULL;
+    }
+
+    queue->tail = next;
+    return NODE_DATA(tail);
+}
+
+/*
+ * The nodes that are followed by another one are popped by just walking the
+ * chain, since only the consumer reads the `tail', and the `tail' is only
+ * stored once at the end. The `stub' node and the last node need the checks of
+ * `pool_queue_pop', which is only called for them.
+ */
+size_t pool_queue_pop_n(PoolQueue* queue, void** data, size_t n) {
+    QueueNode* tail;
+    QueueNode* next;
+    size_t i;
+
+    tail = queue->tail;
+    for (i = 0; i < n; i++) {
+        next = ATOMIC_LOAD(&tail->next, ORDER_ACQUIRE);
+        if (tail == &queue->stub || next == NULL) {
+            queue->tail = tail;
+            data[i]     = pool_queue_pop(queue);
+            if (data[i] == NULL)
+                return i;
+
+            tail = queue->tail;
+            continue;
+        }
+
+        data[i] = NODE_DATA(tail);
+        tail    = next;
+    }
+
+    queue->tail = tail;
+    return i;
+}
+
+void pool_queue_release(PoolQueue* queue, void* data) {
+    QueueNode* node = DATA_NODE(data);
+
+#if defined(LIBPOOL_DEBUG)
+    /* The element was not popped from this queue */
+    if (node->producer == NULL || node->producer->queue != queue)
+        abort();
+#else
+    (void)queue;
+#endif
+
+    pool_ring_free(node->producer->ring, node);
+}
+
+void pool_queue_flush(PoolQueue* queue) {
+    PoolQueueProducer* producer;
+
+    pthread_mutex_lock(&queue->mutex);
+    for (producer = queue->producers; producer != NULL;
+         producer = producer->next)
+        pool_ring_flush(producer->ring);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The first entry of each bucket is stored in the array of buckets itself, and
+ * the rest of the entries of the bucket are chained after it, in chunks of the
+ * pool of the map. The `next' pointer of an unused bucket points to the
+ * `empty_bucket' marker.
+ */
+typedef struct MapEntry MapEntry;
+struct MapEntry {
+    MapEntry* next;
+    size_t key;
+    void* value;
+};
+
+struct PoolMap {
+    MapEntry* buckets;
+    size_t mask;
+    size_t len;
+
+    /* Pool of the chained entries */
+    Pool* pool;
+    size_t capacity;
+};
+
+static MapEntry empty_bucket;
+
+#define BUCKET_EMPTY(BUCKET) ((BUCKET)->next == &empty_bucket)
+
+/*
+ * Mix the bits of the key, so the lowest bits of the result depend on all of
+ * them.
+ */
+static size_t hash_key(size_t key) {
+    key ^= key >> (sizeof(size_t) * 4);
+    key *= (size_t)0x45d9f3b;
+    key ^= key >> 16;
+    return key;
+}
+
+static MapEntry* alloc_buckets(size_t nbuckets) {
+    MapEntry* buckets;
+    size_t i;
+
+    if (nbuckets > (size_t)-1 / sizeof(MapEntry))
+        return NULL;
+
+    buckets = pool_ext_alloc(nbuckets * sizeof(MapEntry));
+    if (buckets == NULL)
+        return NULL;
+
+    for (i = 0; i < nbuckets; i++)
+        buckets[i].next = &empty_bucket;
+
+    return buckets;
+}
+
+static void* bucket_get(MapEntry* bucket, size_t key) {
+    if (BUCKET_EMPTY(bucket))
+        return NULL;
+
+    for (; bucket != NULL; bucket = bucket->next)
+        if (bucket->key == key)
+            return bucket->value;
+
+    return NULL;
+}
+
+/*
+ * Double the number of buckets. The entries of an old bucket can only move to
+ * two new buckets, so at most one of them needs an entry that was stored
+ * inline, and the chained entries can be reused for the rest. This way,
+ * resizing never needs to allocate entries.
+ */
+static void resize(PoolMap* map) {
+    MapEntry* old_buckets;
+    MapEntry* bucket;
+    MapEntry* entry;
+    MapEntry* next;
+    size_t old_sz, i;
+
+    old_sz = map->mask + 1;
+    if (old_sz > (size_t)-1 / 2)
+        return;
+
+    old_buckets = map->buckets;
+    map->buckets = alloc_buckets(old_sz * 2);
+    if (map->buckets == NULL) {
+        map->buckets = old_buckets;
+        return;
+    }
+    map->mask = old_sz * 2 - 1;
+
+    for (i = 0; i < old_sz; i++) {
+        if (BUCKET_EMPTY(&old_buckets[i]))
+            continue;
+
+        /* Both new buckets are still empty, so this entry is stored inline */
+        bucket        = &map->buckets[hash_key(old_buckets[i].key) & map->mask];
+        bucket->key   = old_buckets[i].key;
+        bucket->value = old_buckets[i].value;
+        bucket->next  = NULL;
+
+        for (entry = old_buckets[i].next; entry != NULL; entry = next) {
+            next   = entry->next;
+            bucket = &map->buckets[hash_key(entry->key) & map->mask];
+            if (BUCKET_EMPTY(bucket)) {
+                bucket->key   = entry->key;
+                bucket->value = entry->value;
+                bucket->next  = NULL;
+                pool_free(map->pool, entry);
+            } else {
+                entry->next  = bucket->next;
+                bucket->next = entry;
+            }
+        }
+    }
+
+    pool_ext_free(old_buckets);
+}
+
+PoolMap* pool_map_new(size_t nbuckets) {
+    PoolMap* map;
+    size_t sz;
+
+    for (sz = 1; sz < nbuckets; sz *= 2)
+        if (sz > (size_t)-1 / 2)
+            return NULL;
+
+    map = pool_ext_alloc(sizeof(PoolMap));
+    if (map == NULL)
+        return NULL;
+
+    map->buckets = alloc_buckets(sz);
+    if (map->buckets == NULL) {
+        pool_ext_free(map);
+        return NULL;
+    }
+
+    /* Most entries are stored inline, so the pool starts small */
+    map->capacity = sz / 4 + 1;
+    map->pool     = pool_new(map->capacity, sizeof(MapEntry));
+    if (map->pool == NULL) {
+        pool_ext_free(map->buckets);
+        pool_ext_free(map);
+        return NULL;
+    }
+
+    map->mask = sz - 1;
+    map->len  = 0;
+    return map;
+}
+
+void pool_map_close(PoolMap* map) {
+    if (map == NULL)
+        return;
+
+    pool_close(map->pool);
+    pool_ext_free(map->buckets);
+    pool_ext_free(map);
+}
+
+/*
+ * Set the value of `key', whose hash is `hash', adding a new entry if needed.
+ * The bucket is looked up here, since the previous entry might have resized the
+ * array of buckets.
+ */
+static bool put_hashed(PoolMap* map, size_t hash, size_t key, void* value) {
+    MapEntry* bucket;
+    MapEntry* entry;
+
+    bucket = &map->buckets[hash & map->mask];
+    if (BUCKET_EMPTY(bucket)) {
+        bucket->key   = key;
+        bucket->value = value;
+        bucket->next  = NULL;
+    } else {
+        for (entry = bucket; entry != NULL; entry = entry->next) {
+            if (entry->key == key) {
+                entry->value = value;
+                return true;
+            }
+        }
+
+        entry = pool_alloc(map->pool);
+        if (entry == NULL && grow(map->pool, &map->capacity))
+            entry = pool_alloc(map->pool);
+        if (entry == NULL)
+            return false;
+
+        entry->key   = key;
+        entry->value = value;
+        entry->next  = bucket->next;
+        bucket->next = entry;
+    }
+
+    /* If the buckets can't be doubled, the chains just get longer */
+    if (++map->len / 2 > map->mask)
+        resize(map);
+
+    return true;
+}
+
+bool pool_map_put(PoolMap* map, size_t key, void* value) {
+    return put_hashed(map, hash_key(key), key, value);
+}
+
+/*
+ * Just like in `pool_map_get_n', the keys of each batch are hashed and their
+ * buckets are prefetched before any of them is written. If a put resizes the
+ * map, the remaining buckets of the batch are not in the cache, but they are
+ * still correct, since only the hashes are kept.
+ */
+size_t pool_map_put_n(PoolMap* map, const size_t* keys, void* const* values,
+                      size_t n) {
+    size_t hashes[MAP_BATCH_SZ];
+    size_t i, j, batch_sz;
+
+    for (i = 0; i < n; i += batch_sz) {
+        batch_sz = (n - i < MAP_BATCH_SZ) ? n - i : MAP_BATCH_SZ;
+
+        for (j = 0; j < batch_sz; j++) {
+            hashes[j] = hash_key(keys[i + j]);
+            PREFETCH(&map->buckets[hashes[j] & map->mask]);
+        }
+
+        for (j = 0; j < batch_sz; j++)
+            if (!put_hashed(map, hashes[j], keys[i + j], values[i + j]))
+                return i + j;
+    }
+
+    return n;
+}
+
+void* pool_map_get(PoolMap* map, size_t key) {
+    return bucket_get(&map->buckets[hash_key(key) & map->mask], key);
+}
+
+void pool_map_get_n(PoolMap* map, const size_t* keys, void** values,
+                    size_t n) {
+    MapEntry* buckets[MAP_BATCH_SZ];
+    size_t i, j, batch_sz;
+
+    for (i = 0; i < n; i += batch_sz) {
+        batch_sz = (n - i < MAP_BATCH_SZ) ? n - i : MAP_BATCH_SZ;
+
+        for (j = 0; j < batch_sz; j++) {
+            buckets[j] = &map->buckets[hash_key(keys[i + j]) & map->mask];
+            PREFETCH(buckets[j]);
+        }
+
+        for (j = 0; j < batch_sz; j++)
+            values[i + j] = bucket_get(buckets[j], keys[i + j]);
+    }
+}
+
+/*
+ * When removing the entry stored inline, the next entry of the bucket (if any)
+ * is moved into the array of buckets.
+ */
+bool pool_map_remove(PoolMap* map, size_t key) {
+    MapEntry* bucket;
+    MapEntry* entry;
+    MapEntry** link;
+
+    bucket = &map->buckets[hash_key(key) & map->mask];
+    if (BUCKET_EMPTY(bucket))
+        return false;
+
+    if (bucket->key == key) {
+        entry = bucket->next;
+        if (entry == NULL) {
+            bucket->next = &empty_bucket;
+        } else {
+            *bucket = *entry;
+            pool_free(map->pool, entry);
+        }
+
+        map->len--;
+        return true;
+    }
+
+    for (link = &bucket->next; *link != NULL; link = &(*link)->next) {
+        if ((*link)->key == key) {
+            entry = *link;
+            *link = entry->next;
+            pool_free(map->pool, entry);
+
+            map->len--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+size_t pool_map_len(PoolMap* map) {
+    return map->len;
+}
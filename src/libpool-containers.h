@@ -0,0 +1,283 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is part of libpool, a tiny (ANSI) C library for pool allocation.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef POOL_CONTAINERS_H_
+#define POOL_CONTAINERS_H_ 1
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libpool.h"
+#include "libpool-thread.h"
+
+/*
+ * Optional module of libpool with node-based containers, whose nodes are
+ * allocated from pools. It depends on the `libpool-thread' module, and it must
+ * be compiled and linked along with `libpool-thread.c' and `libpool.c'.
+ *
+ * The elements of the list and the queue are stored in the same chunk as their
+ * links, so adding an element only needs one allocation. The functions receive
+ * and return pointers to the data of the elements, which is aligned to twice
+ * the size of a pointer.
+ *
+ * Only the queue can be used from different threads at the same time.
+ */
+
+/*
+ * Singly linked list, see `pool_list_new'.
+ */
+typedef struct PoolList PoolList;
+
+/*
+ * Multiple-producer, single-consumer queue, and each of the threads that push
+ * elements to it. See `pool_queue_new'.
+ */
+typedef struct PoolQueue PoolQueue;
+typedef struct PoolQueueProducer PoolQueueProducer;
+
+/*
+ * Hash map from `size_t' keys to pointers, see `pool_map_new'.
+ */
+typedef struct PoolMap PoolMap;
+
+/*
+ * Create a new, empty list of elements with `data_sz' bytes of data each. The
+ * pool of the list starts with room for `pool_sz' elements, and it's expanded
+ * as needed.
+ *
+ * Notes:
+ *   - If the initialization fails, NULL is returned.
+ *   - The caller must free the returned pointer using `pool_list_close'.
+ */
+PoolList* pool_list_new(size_t pool_sz, size_t data_sz);
+
+/*
+ * Free the specified `list', along with all of its elements. Allows NULL as
+ * the `list' parameter.
+ */
+void pool_list_close(PoolList* list);
+
+/*
+ * Add a new element to the front of the specified `list', and return a pointer
+ * to its (uninitialized) data. If the pool can't be expanded, NULL is returned.
+ */
+void* pool_list_push(PoolList* list);
+
+/*
+ * Add `n' new elements to the front of the specified `list', storing pointers
+ * to their data in the `data' array. The last element of the array becomes the
+ * first element of the list. Returns the number of elements that were added,
+ * which is only lower than `n' if the pool can't be expanded.
+ */
+size_t pool_list_push_n(PoolList* list, void** data, size_t n);
+
+/*
+ * Remove the first element of the specified `list'. Returns false if the list
+ * is empty.
+ */
+bool pool_list_pop(PoolList* list);
+
+/*
+ * Remove up to `n' elements from the front of the specified `list'. Returns the
+ * number of elements that were removed.
+ */
+size_t pool_list_pop_n(PoolList* list, size_t n);
+
+/*
+ * Return the data of the first element of the specified `list', or NULL if
+ * the list is empty.
+ */
+void* pool_list_first(PoolList* list);
+
+/*
+ * Return the data of the element after the one with the specified `data', or
+ * NULL if it was the last one.
+ */
+void* pool_list_next(void* data);
+
+/*
+ * Return the number of elements in the specified `list'.
+ */
+size_t pool_list_len(PoolList* list);
+
+/*
+ * Create a new, empty queue of elements with `data_sz' bytes of data each.
+ *
+ * Each producer thread gets its own pool with `pool_queue_producer_new', and
+ * allocates the elements from it. The consumer thread pops the elements, and
+ * returns them to the pool of their producer with `pool_queue_release',
+ * through a return ring (see `pool_ring_new'). Pushing is lock-free, popping
+ * and releasing are wait-free.
+ *
+ * Notes:
+ *   - If the initialization fails, NULL is returned.
+ *   - The caller must free the returned pointer using `pool_queue_close', once
+ *     all the producers are closed.
+ *   - The `pool_ext_alloc' and `pool_ext_free' functions must be thread-safe.
+ *   - It calls `pool_thread_init', since the producers create their pools from
+ *     different threads.
+ */
+PoolQueue* pool_queue_new(size_t data_sz);
+
+/*
+ * Free the specified `queue'. All its producers must be closed before. Allows
+ * NULL as the `queue' parameter.
+ */
+void pool_queue_close(PoolQueue* queue);
+
+/*
+ * Register the calling thread as a producer of the specified `queue', with a
+ * pool that starts with room for `pool_sz' elements, and is expanded as needed.
+ *
+ * Notes:
+ *   - If the initialization fails, NULL is returned.
+ *   - The caller must free the returned pointer using
+ *     `pool_queue_producer_close'.
+ *   - The producer must only be used by the thread that created it.
+ */
+PoolQueueProducer* pool_queue_producer_new(PoolQueue* queue, size_t pool_sz);
+
+/*
+ * Close the specified `producer', along with its pool. It must be called by
+ * the thread that created it, once the consumer has released all of its
+ * elements and called `pool_queue_flush'. Allows NULL as the `producer'
+ * parameter.
+ */
+void pool_queue_producer_close(PoolQueueProducer* producer);
+
+/*
+ * Allocate a new element from the pool of the specified `producer', and return
+ * a pointer to its data. The element is not part of the queue until it's
+ * pushed. If the pool can't be expanded, NULL is returned.
+ */
+void* pool_queue_alloc(PoolQueueProducer* producer);
+
+/*
+ * Allocate up to `n' elements from the pool of the specified `producer',
+ * storing pointers to their data in the `data' array. Returns the number of
+ * elements that were allocated.
+ */
+size_t pool_queue_alloc_n(PoolQueueProducer* producer, void** data, size_t n);
+
+/*
+ * Add the element with the specified `data', allocated by `producer', to the
+ * back of its queue.
+ */
+void pool_queue_push(PoolQueueProducer* producer, void* data);
+
+/*
+ * Add the `n' elements in the `data' array, allocated by `producer', to the
+ * back of its queue, in order. The whole batch is added with a single atomic
+ * operation.
+ */
+void pool_queue_push_n(PoolQueueProducer* producer, void** data, size_t n);
+
+/*
+ * Remove the element at the front of the specified `queue', and return a
+ * pointer to its data. If the queue is empty, or if the next element is still
+ * being pushed, NULL is returned.
+ *
+ * The data stays valid until the element is released with
+ * `pool_queue_release'. Must only be called by the consumer thread.
+ */
+void* pool_queue_pop(PoolQueue* queue);
+
+/*
+ * Remove up to `n' elements from the front of the specified `queue', storing
+ * pointers to their data in the `data' array. Returns the number of elements
+ * that were removed. The elements that are followed by another one are popped
+ * without the checks of `pool_queue_pop'. Must only be called by the consumer
+ * thread.
+ */
+size_t pool_queue_pop_n(PoolQueue* queue, void** data, size_t n);
+
+/*
+ * Return an element that was popped from the specified `queue' to the pool of
+ * its producer. The elements are sent back in batches. Must only be called by
+ * the consumer thread. If the module is compiled with `LIBPOOL_DEBUG' defined,
+ * the program is aborted if the element was not allocated by a producer of
+ * `queue'.
+ */
+void pool_queue_release(PoolQueue* queue, void* data);
+
+/*
+ * Send the released elements that are still in an incomplete batch back to
+ * their producers. Must only be called by the consumer thread.
+ */
+void pool_queue_flush(PoolQueue* queue);
+
+/*
+ * Create a new, empty hash map with room for `nbuckets' entries, which is
+ * rounded up to a power of two. The first entry of each bucket is stored
+ * inline, in the array of buckets, and the rest are allocated from a pool.
+ * The array of buckets is doubled when the map has twice as many entries as
+ * buckets.
+ *
+ * Notes:
+ *   - If the initialization fails, NULL is returned.
+ *   - The caller must free the returned pointer using `pool_map_close'.
+ */
+PoolMap* pool_map_new(size_t nbuckets);
+
+/*
+ * Free the specified `map', along with all of its entries. Allows NULL as the
+ * `map' parameter.
+ */
+void pool_map_close(PoolMap* map);
+
+/*
+ * Set the value of the specified `key' in a `map', adding a new entry if
+ * needed. Returns false if the entry couldn't be allocated.
+ */
+bool pool_map_put(PoolMap* map, size_t key, void* value);
+
+/*
+ * Set the values of the `n' keys in the `keys' array to the values in the
+ * `values' array. Returns the number of entries that were set, which is only
+ * lower than `n' if an entry couldn't be allocated. The buckets of each batch
+ * are hashed before any of them is written, like in `pool_map_get_n'.
+ */
+size_t pool_map_put_n(PoolMap* map, const size_t* keys, void* const* values,
+                      size_t n);
+
+/*
+ * Return the value of the specified `key' in a `map', or NULL if it has no
+ * entry.
+ */
+void* pool_map_get(PoolMap* map, size_t key);
+
+/*
+ * Look up the `n' keys in the `keys' array, storing their values (or NULL) in
+ * the `values' array. The buckets of each batch are hashed before any of them
+ * is read, so the cache misses overlap.
+ */
+void pool_map_get_n(PoolMap* map, const size_t* keys, void** values, size_t n);
+
+/*
+ * Remove the entry of the specified `key' from a `map'. Returns false if the
+ * key had no entry.
+ */
+bool pool_map_remove(PoolMap* map, size_t key);
+
+/*
+ * Return the number of entries in the specified `map'.
+ */
+size_t pool_map_len(PoolMap* map);
+
+#endif /* POOL_CONTAINERS_H_ */
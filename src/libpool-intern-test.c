@@ -0,0 +1,81 @@
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libpool.h"
+#include "libpool-intern.h"
+
+#define NUM_IDENTS   100000
+#define DISTINCT     20000
+#define LONG_STR_LEN 1000
+
+/*
+ * Build an identifier from a number, with lengths between 1 and 40 bytes, so
+ * the strings use many size classes.
+ */
+static size_t make_ident(char* buf, size_t n) {
+    size_t len, i;
+
+    len = 1 + n % 40;
+    for (i = 0; i < len; i++)
+        buf[i] = 'a' + (char)((n / (i + 1) + i) % 26);
+
+    return len;
+}
+
+int main(void) {
+    PoolInterner* interner;
+    const char* first[DISTINCT];
+    const char* str;
+    char buf[LONG_STR_LEN];
+    size_t len, i, distinct;
+    uint32_t id;
+
+    interner = pool_intern_new(16);
+    if (interner == NULL) {
+        fprintf(stderr, "Could not create a new interner.\n");
+        exit(1);
+    }
+
+    /*
+     * Intern each identifier several times. The interned copy is always the
+     * same, and it's null-terminated.
+     */
+    for (i = 0; i < NUM_IDENTS; i++) {
+        len = make_ident(buf, i % DISTINCT);
+        str = pool_intern(interner, buf, len);
+        if (str == NULL || memcmp(str, buf, len) != 0 || str[len] != '\0') {
+            fprintf(stderr, "Could not intern an identifier.\n");
+            exit(1);
+        }
+
+        if (i < DISTINCT)
+            first[i] = str;
+        else if (first[i % DISTINCT] != str) {
+            fprintf(stderr, "The interned copy moved.\n");
+            exit(1);
+        }
+    }
+
+    /* Strings longer than the biggest size class also work */
+    memset(buf, 'x', LONG_STR_LEN);
+    id = pool_intern_id(interner, buf, LONG_STR_LEN);
+    if (id == POOL_INTERN_NONE ||
+        pool_intern_find(interner, buf, LONG_STR_LEN) != id ||
+        pool_intern_str(interner, id, &len) == NULL || len != LONG_STR_LEN) {
+        fprintf(stderr, "Could not intern a long string.\n");
+        exit(1);
+    }
+
+    distinct = pool_intern_count(interner);
+    printf("Interned %d identifiers, %lu distinct strings, %lu bytes.\n",
+           NUM_IDENTS,
+           (unsigned long)distinct,
+           (unsigned long)pool_intern_bytes(interner));
+
+    pool_intern_close(interner);
+    return 0;
+}
@@ -0,0 +1,398 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is part of libpool, a tiny (ANSI) C library for pool allocation.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* NOTE: Remember to change these paths if you move the headers */
+#include "libpool.h"
+#include "libpool-intern.h"
+
+/*
+ * Strings that are at least 16 bytes long are compared with SSE2 instructions,
+ * 16 bytes at a time.
+ */
+#if defined(__SSE2__)
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/*
+ * Chunk sizes of the pools of each size class. Each string is stored in the
+ * smallest class that fits it, along with its null terminator. Longer strings
+ * are allocated with `pool_ext_alloc'.
+ */
+static const size_t class_sizes[] = {
+    8, 16, 24, 32, 48, 64, 96, 128, 192, 256
+};
+
+#define NUM_CLASSES  (sizeof(class_sizes) / sizeof(class_sizes[0]))
+#define MAX_CLASS_SZ 256
+
+/*
+ * Number of chunks of the first array of each size class. The pools are
+ * created once they are needed, and doubled when they are full.
+ */
+#define CLASS_POOL_SZ 256
+
+/* Minimum number of slots in the index, and of strings in the table */
+#define MIN_INDEX_SZ 16
+#define MIN_TABLE_SZ 16
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Slot of the index, which is an open-addressed hash table with linear
+ * probing. It only stores the hash of the string, and its ID plus one, so the
+ * strings are only compared when the hashes match. A zero `id' means that the
+ * slot is empty.
+ *
+ * The index is doubled when it's half full, so there is always an empty slot
+ * that ends the probing.
+ */
+typedef struct IndexSlot {
+    uint32_t hash;
+    uint32_t id;
+} IndexSlot;
+
+struct PoolInterner {
+    Pool* classes[NUM_CLASSES];
+    size_t class_capacity[NUM_CLASSES];
+
+    IndexSlot* index;
+    size_t mask;
+
+    /* Table of strings and their lengths, indexed by their ID */
+    const char** strings;
+    uint32_t* lens;
+    size_t count;
+    size_t table_sz;
+
+    /* Total size of the strings allocated with `pool_ext_alloc' */
+    size_t long_bytes;
+};
+
+/*
+ * 32-bit FNV-1a hash.
+ */
+static uint32_t hash_bytes(const char* str, size_t len) {
+    uint32_t hash = 2166136261u;
+
+    while (len-- > 0) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static bool bytes_equal(const char* a, const char* b, size_t len) {
+#if defined(HAVE_SSE2)
+    __m128i va, vb;
+
+    while (len >= 16) {
+        va = _mm_loadu_si128((const __m128i*)a);
+        vb = _mm_loadu_si128((const __m128i*)b);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF)
+            return false;
+
+        a += 16;
+        b += 16;
+        len -= 16;
+    }
+#endif /* HAVE_SSE2 */
+
+    return memcmp(a, b, len) == 0;
+}
+
+/*
+ * Return the slot of the index that contains the specified string, or the
+ * empty slot where it should be added.
+ */
+static IndexSlot* find_slot(PoolInterner* interner, const char* str,
+                            size_t len, uint32_t hash) {
+    IndexSlot* slot;
+    size_t i;
+
+    for (i = hash & interner->mask;; i = (i + 1) & interner->mask) {
+        slot = &interner->index[i];
+        if (slot->id == 0)
+            return slot;
+
+        if (slot->hash == hash && interner->lens[slot->id - 1] == len &&
+            bytes_equal(interner->strings[slot->id - 1], str, len))
+            return slot;
+    }
+}
+
+/*
+ * Double the size of the index. The strings don't need to be hashed again,
+ * since the slots store their hashes.
+ */
+static bool grow_index(PoolInterner* interner) {
+    IndexSlot* old_index;
+    size_t old_sz, i, j;
+
+    old_sz = interner->mask + 1;
+    if (old_sz > (size_t)-1 / 2 / sizeof(IndexSlot))
+        return false;
+
+    old_index       = interner->index;
+    interner->index = pool_ext_alloc(old_sz * 2 * sizeof(IndexSlot));
+    if (interner->index == NULL) {
+        interner->index = old_index;
+        return false;
+    }
+    memset(interner->index, 0, old_sz * 2 * sizeof(IndexSlot));
+    interner->mask = old_sz * 2 - 1;
+
+    for (i = 0; i < old_sz; i++) {
+        if (old_index[i].id == 0)
+            continue;
+
+        j = old_index[i].hash & interner->mask;
+        while (interner->index[j].id != 0)
+            j = (j + 1) & interner->mask;
+        interner->index[j] = old_index[i];
+    }
+
+    pool_ext_free(old_index);
+    return true;
+}
+
+/*
+ * Double the size of the table of strings and lengths.
+ */
+static bool grow_table(PoolInterner* interner) {
+    const char** strings;
+    uint32_t* lens;
+    size_t new_sz;
+
+    new_sz = interner->table_sz * 2;
+    if (new_sz > (size_t)-1 / sizeof(const char*))
+        return false;
+
+    strings = pool_ext_alloc(new_sz * sizeof(const char*));
+    lens    = pool_ext_alloc(new_sz * sizeof(uint32_t));
+    if (strings == NULL || lens == NULL) {
+        pool_ext_free(strings);
+        pool_ext_free(lens);
+        return false;
+    }
+
+    memcpy(strings, interner->strings, interner->count * sizeof(const char*));
+    memcpy(lens, interner->lens, interner->count * sizeof(uint32_t));
+    pool_ext_free(interner->strings);
+    pool_ext_free(interner->lens);
+
+    interner->strings  = strings;
+    interner->lens     = lens;
+    interner->table_sz = new_sz;
+    return true;
+}
+
+/*
+ * Allocate a null-terminated copy of a string, from the pool of its size class.
+ */
+static char* store_string(PoolInterner* interner, const char* str,
+                          size_t len) {
+    Pool** pool;
+    char* copy;
+    size_t c;
+
+    if (len + 1 > MAX_CLASS_SZ) {
+        copy = pool_ext_alloc(len + 1);
+        if (copy != NULL)
+            interner->long_bytes += len + 1;
+    } else {
+        for (c = 0; class_sizes[c] < len + 1; c++)
+            continue;
+
+        pool = &interner->classes[c];
+        if (*pool == NULL) {
+            *pool = pool_new(CLASS_POOL_SZ, class_sizes[c]);
+            interner->class_capacity[c] = CLASS_POOL_SZ;
+        }
+        if (*pool == NULL)
+            return NULL;
+
+        copy = pool_alloc(*pool);
+        if (copy == NULL &&
+            pool_expand(*pool, interner->class_capacity[c])) {
+            interner->class_capacity[c] *= 2;
+            copy = pool_alloc(*pool);
+        }
+    }
+
+    if (copy == NULL)
+        return NULL;
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/*----------------------------------------------------------------------------*/
+
+PoolInterner* pool_intern_new(size_t nstrings) {
+    PoolInterner* interner;
+    size_t index_sz, table_sz, c;
+
+    table_sz = (nstrings > MIN_TABLE_SZ) ? nstrings : MIN_TABLE_SZ;
+    if (table_sz > (size_t)-1 / 2 / sizeof(IndexSlot))
+        return NULL;
+    for (index_sz = MIN_INDEX_SZ; index_sz < table_sz * 2; index_sz *= 2)
+        continue;
+
+    interner = pool_ext_alloc(sizeof(PoolInterner));
+    if (interner == NULL)
+        return NULL;
+
+    interner->index   = pool_ext_alloc(index_sz * sizeof(IndexSlot));
+    interner->strings = pool_ext_alloc(table_sz * sizeof(const char*));
+    interner->lens    = pool_ext_alloc(table_sz * sizeof(uint32_t));
+    if (interner->index == NULL || interner->strings == NULL ||
+        interner->lens == NULL) {
+        pool_ext_free(interner->index);
+        pool_ext_free(interner->strings);
+        pool_ext_free(interner->lens);
+        pool_ext_free(interner);
+        return NULL;
+    }
+    memset(interner->index, 0, index_sz * sizeof(IndexSlot));
+
+    for (c = 0; c < NUM_CLASSES; c++) {
+        interner->classes[c]        = NULL;
+        interner->class_capacity[c] = 0;
+    }
+
+    interner->mask       = index_sz - 1;
+    interner->count      = 0;
+    interner->table_sz   = table_sz;
+    interner->long_bytes = 0;
+    return interner;
+}
+
+void pool_intern_close(PoolInterner* interner) {
+    size_t i;
+
+    if (interner == NULL)
+        return;
+
+    /* The short strings are freed along with their pools */
+    for (i = 0; i < interner->count; i++)
+        if (interner->lens[i] + 1 > MAX_CLASS_SZ)
+            pool_ext_free((char*)interner->strings[i]);
+    for (i = 0; i < NUM_CLASSES; i++)
+        pool_close(interner->classes[i]);
+
+    pool_ext_free(interner->index);
+    pool_ext_free(interner->strings);
+    pool_ext_free(interner->lens);
+    pool_ext_free(interner);
+}
+
+/*
+ * A new string is only added if the index will still have an empty slot after
+ * adding it, even if the index can't grow.
+ */
+uint32_t pool_intern_id(PoolInterner* interner, const char* str, size_t len) {
+    IndexSlot* slot;
+    char* copy;
+    uint32_t hash, id;
+
+    if (len >= POOL_INTERN_NONE)
+        return POOL_INTERN_NONE;
+
+    hash = hash_bytes(str, len);
+    slot = find_slot(interner, str, len, hash);
+    if (slot->id != 0)
+        return slot->id - 1;
+
+    if (interner->count + 1 >= POOL_INTERN_NONE ||
+        interner->count + 1 > interner->mask)
+        return POOL_INTERN_NONE;
+    if (interner->count == interner->table_sz && !grow_table(interner))
+        return POOL_INTERN_NONE;
+
+    copy = store_string(interner, str, len);
+    if (copy == NULL)
+        return POOL_INTERN_NONE;
+
+    id                     = (uint32_t)interner->count++;
+    interner->strings[id] = copy;
+    interner->lens[id]    = (uint32_t)len;
+    slot->hash            = hash;
+    slot->id              = id + 1;
+
+    /* If the index can't grow, it just gets slower */
+    if (interner->count * 2 > interner->mask + 1)
+        grow_index(interner);
+
+    return id;
+}
+
+const char* pool_intern(PoolInterner* interner, const char* str, size_t len) {
+    uint32_t id;
+
+    id = pool_intern_id(interner, str, len);
+    return (id == POOL_INTERN_NONE) ? NULL : interner->strings[id];
+}
+
+uint32_t pool_intern_find(PoolInterner* interner, const char* str,
+                          size_t len) {
+    IndexSlot* slot;
+
+    if (len >= POOL_INTERN_NONE)
+        return POOL_INTERN_NONE;
+
+    slot = find_slot(interner, str, len, hash_bytes(str, len));
+    return (slot->id == 0) ? POOL_INTERN_NONE : slot->id - 1;
+}
+
+const char* pool_intern_str(PoolInterner* interner, uint32_t id, size_t* len) {
+    if (len != NULL)
+        *len = interner->lens[id];
+
+    return interner->strings[id];
+}
+
+size_t pool_intern_count(PoolInterner* interner) {
+    return interner->count;
+}
+
+size_t pool_intern_bytes(PoolInterner* interner) {
+    PoolStats stats;
+    size_t result, c;
+
+    result = interner->long_bytes;
+    result += (interner->mask + 1) * sizeof(IndexSlot);
+    result += interner->table_sz * (sizeof(const char*) + sizeof(uint32_t));
+
+    for (c = 0; c < NUM_CLASSES; c++) {
+        if (interner->classes[c] == NULL)
+            continue;
+
+        pool_get_stats(interner->classes[c], &stats);
+        result += stats.array_bytes;
+    }
+
+    return result;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is part of libpool, a tiny (ANSI) C library for pool allocation.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef POOL_INTERN_H_
+#define POOL_INTERN_H_ 1
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libpool.h"
+
+/*
+ * Optional module of libpool for interning strings, i.e. storing a single copy
+ * of each distinct string. It must be compiled and linked along with
+ * `libpool.c', and it depends on the standard library.
+ *
+ * The strings are stored in pools of fixed-size chunks, one for each size
+ * class, so they never move: the pointers returned by `pool_intern' are stable
+ * until the interner is closed. Each string also gets a 32-bit ID, assigned in
+ * order from zero.
+ *
+ * An interner must only be used by one thread at a time.
+ */
+typedef struct PoolInterner PoolInterner;
+
+/*
+ * Value returned by `pool_intern_id' and `pool_intern_find' on failure.
+ */
+#define POOL_INTERN_NONE ((uint32_t)-1)
+
+/*
+ * Create a new, empty interner, with room for `nstrings' strings before its
+ * index needs to grow.
+ *
+ * Notes:
+ *   - If the initialization fails, NULL is returned.
+ *   - The caller must free the returned pointer using `pool_intern_close'.
+ */
+PoolInterner* pool_intern_new(size_t nstrings);
+
+/*
+ * Free the specified `interner', along with all of its strings. Allows NULL as
+ * the `interner' parameter.
+ */
+void pool_intern_close(PoolInterner* interner);
+
+/*
+ * Return the interned copy of the `len' bytes at `str', adding it to the
+ * `interner' if needed. The copy is always null-terminated, but `str' doesn't
+ * need to be, and it can contain null bytes. If the string can't be added,
+ * NULL is returned.
+ */
+const char* pool_intern(PoolInterner* interner, const char* str, size_t len);
+
+/*
+ * Same as `pool_intern', but return the ID of the interned string, or
+ * `POOL_INTERN_NONE' if it can't be added.
+ */
+uint32_t pool_intern_id(PoolInterner* interner, const char* str, size_t len);
+
+/*
+ * Return the ID of the `len' bytes at `str' if they were already interned, or
+ * `POOL_INTERN_NONE' otherwise. The string is never added.
+ */
+uint32_t pool_intern_find(PoolInterner* interner, const char* str, size_t len);
+
+/*
+ * Return the interned string with the specified `id', and store its length in
+ * `len', if it's not NULL. The `id' must have been returned by the same
+ * interner.
+ */
+const char* pool_intern_str(PoolInterner* interner, uint32_t id, size_t* len);
+
+/*
+ * Return the number of strings in the specified `interner'.
+ */
+size_t pool_intern_count(PoolInterner* interner);
+
+/*
+ * Return the total number of bytes used by the specified `interner': the
+ * arrays of its pools, its index, and the table of strings.
+ */
+size_t pool_intern_bytes(PoolInterner* interner);
+
+#endif /* POOL_INTERN_H_ */
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is part of libpool, a tiny (ANSI) C library for pool allocation.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Functions shared by the different libpool modules, which are not part of the
+ * public interface. You don't need to include this header from your program.
+ */
+
+#ifndef POOL_INTERNAL_H_
+#define POOL_INTERNAL_H_ 1
+
+#include <stddef.h>
+
+#include "libpool.h"
+
+/*
+ * Size of a cache line, used by `pool_new_for' and for keeping the data that is
+ * shared between threads away from the rest.
+ */
+#if !defined(LIBPOOL_CACHE_LINE_SZ)
+#define LIBPOOL_CACHE_LINE_SZ 64
+#endif
+
+/*
+ * Linked list of chunk arrays, defined in `libpool.c'.
+ */
+typedef struct ArrayStart ArrayStart;
+
+/*
+ * Detach the specified `pool', freeing the `Pool' structure and removing it
+ * from the global statistics and its group, and return the list of its chunk
+ * arrays. The pool can't be used after this call, and the returned arrays must
+ * be freed with `pool_free_arrays'. Until then, they are still charged to the
+ * budgets.
+ */
+ArrayStart* pool_detach(Pool* pool);
+
+/*
+ * Free up to `max' chunk arrays from the specified list, returning the rest of
+ * the list, or NULL if all of them were freed. Their bytes are returned to the
+ * global budget and to the budget of their group.
+ */
+ArrayStart* pool_free_arrays(ArrayStart* arrays, size_t max);
+
+/*
+ * Detach all the pools of the specified `group', and close the group itself,
+ * which is freed along with the last of its arrays. Returns the list of the
+ * chunk arrays of all the pools, which must be freed with `pool_free_arrays'.
+ */
+ArrayStart* pool_group_detach(PoolGroup* group);
+
+/*
+ * Allocate a chunk from the specified `pool', just like `pool_alloc', but if
+ * the pool has no chunks left, NULL is returned without calling the exhaustion
+ * handler, and without counting an exhaustion. Used by the modules that have
+ * other places to look for chunks before the pool is really exhausted.
+ */
+void* pool_try_alloc(Pool* pool);
+
+/*
+ * Allocate up to `n' chunks from the specified `pool', just like
+ * `pool_alloc_n', but without calling the exhaustion handler or counting an
+ * exhaustion, like `pool_try_alloc'. Returns the number of allocated chunks.
+ */
+size_t pool_try_alloc_n(Pool* pool, void** ptrs, size_t n);
+
+/*
+ * Take all the free chunks of the specified `pool', including the ones that
+ * were never used, linked through their first bytes. Returns the first chunk,
+ * or NULL if there are no free chunks, and stores the last one in `last'. The
+ * chunks are counted as allocated, and the exhaustion handler is not called.
+ */
+void* pool_take_free(Pool* pool, void** last);
+
+/*
+ * Append the `src' list of chunk arrays to the end of the `dst' list, and
+ * return the resulting list.
+ */
+ArrayStart* pool_concat_arrays(ArrayStart* dst, ArrayStart* src);
+
+#endif /* POOL_INTERNAL_H_ */
@@ -1,11 +1,35 @@
 
+#define _POSIX_C_SOURCE 200809L /* fileno */
+
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
 
 #include "libpool.h"
 
+#define SCAVENGE_SZ       64
+#define SCAVENGE_CHUNK_SZ 4096
+
+#define CALLOC_SZ       16
+#define CALLOC_CHUNK_SZ 256
+
+#define LARGE_SZ       4
+#define LARGE_CHUNK_SZ 65537
+
+#define GRANULAR_SZ       10
+#define GRANULAR_CHUNK_SZ 64
+#define GRANULARITY       4096
+
+#define FIFO_SZ 8
+
+#define LAYOUT_SZ    100
+#define LAYOUT_OBJ   24
+#define LAYOUT_ALIGN 128
+
 /*
  * We just have to make sure the items we store in the returned pointer are
  * small enough to fit in a chunk. In this case, smaller than CHUNK_SZ bytes,
@@ -66,9 +90,386 @@ static void test_pool(Pool* pool) {
            i);
 }
 
+/*
+ * Exhaustion handler used in `main'. Instead of checking the result of every
+ * `pool_alloc' call, the pool is expanded by the number of chunks in `ctx' when
+ * it runs out of them.
+ */
+static void grow_pool(Pool* pool, void* ctx) {
+    pool_expand(pool, *(size_t*)ctx);
+}
+
+/*
+ * Print the usage statistics of a pool. If the `LIBPOOL_STATS' environment
+ * variable is set, these are also written to that file when the pool is closed.
+ */
+static void print_stats(Pool* pool) {
+    PoolStats stats;
+
+    pool_get_stats(pool, &stats);
+    printf("Stats of '%s': capacity %lu, live %lu, peak %lu, expansions %lu, "
+           "allocs %lu, frees %lu, exhaustions %lu\n",
+           stats.name,
+           (unsigned long)stats.capacity,
+           (unsigned long)stats.live,
+           (unsigned long)stats.peak_live,
+           (unsigned long)stats.expansions,
+           (unsigned long)stats.allocs,
+           (unsigned long)stats.frees,
+           (unsigned long)stats.exhaustions);
+}
+
+/*
+ * The memory of free chunks that are not being reused can be returned to the
+ * system with `pool_scavenge'. The first call only marks the free chunks as
+ * cold, so the second one releases them. The released chunks are still part
+ * of the pool, and they are reused like any other free chunk.
+ */
+static void test_scavenge(void) {
+    void* chunks[SCAVENGE_SZ];
+    Pool* pool;
+    size_t first, second, i;
+
+    pool = pool_new(SCAVENGE_SZ, SCAVENGE_CHUNK_SZ);
+    if (pool == NULL) {
+        fprintf(stderr, "Could not create a new pool.\n");
+        exit(1);
+    }
+    pool_set_name(pool, "scavenged");
+
+    pool_alloc_n(pool, chunks, SCAVENGE_SZ);
+    for (i = 0; i < SCAVENGE_SZ; i++)
+        memset(chunks[i], 'A', SCAVENGE_CHUNK_SZ);
+    pool_free_n(pool, chunks, SCAVENGE_SZ);
+
+    first  = pool_scavenge(pool, (size_t)-1);
+    second = pool_scavenge(pool, (size_t)-1);
+    printf("\nScavenged 'scavenged' twice: %lu and %lu bytes released\n",
+           (unsigned long)first,
+           (unsigned long)second);
+
+    for (i = 0; i < SCAVENGE_SZ; i++) {
+        chunks[i] = pool_alloc(pool);
+        if (chunks[i] == NULL) {
+            fprintf(stderr, "Could not reuse a scavenged chunk.\n");
+            exit(1);
+        }
+        memset(chunks[i], 'B', SCAVENGE_CHUNK_SZ);
+    }
+    print_stats(pool);
+
+    pool_close(pool);
+}
+
+/*
+ * Fill every chunk of `pool' with garbage, free them, and check that the
+ * chunks returned by `pool_calloc' are zeroed anyway.
+ */
+static bool calloc_after_free(Pool* pool) {
+    unsigned char* chunks[CALLOC_SZ];
+    size_t i, j;
+
+    for (i = 0; i < CALLOC_SZ; i++) {
+        chunks[i] = pool_alloc(pool);
+        if (chunks[i] == NULL) {
+            fprintf(stderr, "Could not allocate a new chunk from pool.\n");
+            exit(1);
+        }
+        memset(chunks[i], 0xAA, CALLOC_CHUNK_SZ);
+    }
+
+    for (i = 0; i < CALLOC_SZ; i++)
+        pool_free(pool, chunks[i]);
+
+    for (i = 0; i < CALLOC_SZ; i++) {
+        chunks[i] = pool_calloc(pool);
+        if (chunks[i] == NULL) {
+            fprintf(stderr, "Could not allocate a new chunk from pool.\n");
+            exit(1);
+        }
+
+        for (j = 0; j < CALLOC_CHUNK_SZ; j++)
+            if (chunks[i][j] != 0)
+                return false;
+    }
+
+    for (i = 0; i < CALLOC_SZ; i++)
+        pool_free(pool, chunks[i]);
+
+    return true;
+}
+
+/*
+ * The chunks returned by `pool_calloc' are always zeroed, either by
+ * `pool_calloc' itself, or by `pool_free' if the pool has the
+ * `POOL_ZERO_ON_FREE' flag.
+ */
+static void test_calloc(void) {
+    Pool* pool;
+    bool zeroed;
+
+    pool = pool_new(CALLOC_SZ, CALLOC_CHUNK_SZ);
+    if (pool == NULL) {
+        fprintf(stderr, "Could not create a new pool.\n");
+        exit(1);
+    }
+
+    zeroed = calloc_after_free(pool);
+    printf("\nCalloc'd chunks are zeroed after being reused: %s\n",
+           zeroed ? "yes" : "no");
+    if (!zeroed)
+        exit(1);
+
+    pool_set_flags(pool, POOL_ZERO_ON_FREE);
+    zeroed = calloc_after_free(pool);
+    printf("Calloc'd chunks are zeroed with POOL_ZERO_ON_FREE: %s\n",
+           zeroed ? "yes" : "no");
+    if (!zeroed)
+        exit(1);
+
+    pool_close(pool);
+}
+
+/*
+ * Pools with large chunks round the chunk size up to a multiple of the page
+ * size, and each chunk starts at a page boundary. With `POOL_RELEASE_ON_FREE',
+ * the memory of each freed chunk is given back to the system, except for its
+ * first page, and the chunk can still be reused.
+ */
+static void test_large_chunks(void) {
+    unsigned char* chunks[LARGE_SZ];
+    PoolStats stats;
+    Pool* pool;
+    size_t page_sz, i;
+    bool aligned;
+
+    pool = pool_new(LARGE_SZ, LARGE_CHUNK_SZ);
+    if (pool == NULL) {
+        fprintf(stderr, "Could not create a new pool.\n");
+        exit(1);
+    }
+    pool_set_name(pool, "large");
+    pool_set_flags(pool, POOL_RELEASE_ON_FREE);
+
+    page_sz = (size_t)sysconf(_SC_PAGESIZE);
+    pool_get_stats(pool, &stats);
+    printf("\nChunks of %d bytes in 'large' use %lu bytes (%lu pages), "
+           "array bytes %lu\n",
+           LARGE_CHUNK_SZ,
+           (unsigned long)stats.chunk_sz,
+           (unsigned long)(stats.chunk_sz / page_sz),
+           (unsigned long)stats.array_bytes);
+    if (stats.chunk_sz % page_sz != 0 ||
+        stats.array_bytes != LARGE_SZ * stats.chunk_sz) {
+        fprintf(stderr, "The large chunks were not rounded to pages.\n");
+        exit(1);
+    }
+
+    aligned = true;
+    for (i = 0; i < LARGE_SZ; i++) {
+        chunks[i] = pool_alloc(pool);
+        if (chunks[i] == NULL) {
+            fprintf(stderr, "Could not allocate a new chunk from pool.\n");
+            exit(1);
+        }
+        if ((uintptr_t)chunks[i] % page_sz != 0)
+            aligned = false;
+        memset(chunks[i], 'A', stats.chunk_sz);
+    }
+    printf("Large chunks are page-aligned: %s\n", aligned ? "yes" : "no");
+    if (!aligned)
+        exit(1);
+
+    /* The freed chunks are released, but they are reused normally */
+    for (i = 0; i < LARGE_SZ; i++)
+        pool_free(pool, chunks[i]);
+    for (i = 0; i < LARGE_SZ; i++) {
+        chunks[i] = pool_alloc(pool);
+        if (chunks[i] == NULL) {
+            fprintf(stderr, "Could not reuse a released chunk.\n");
+            exit(1);
+        }
+        memset(chunks[i], 'B', stats.chunk_sz);
+    }
+    print_stats(pool);
+
+    pool_close(pool);
+}
+
+/*
+ * With a granularity, the arrays added by `pool_expand' are rounded up and
+ * aligned to it, and the extra chunks are reported as slack. The first array
+ * is not rounded.
+ */
+static void test_granularity(void) {
+    PoolStats stats;
+    Pool* pool;
+    void* chunk;
+    size_t i;
+
+    pool = pool_new(GRANULAR_SZ, GRANULAR_CHUNK_SZ);
+    if (pool == NULL) {
+        fprintf(stderr, "Could not create a new pool.\n");
+        exit(1);
+    }
+    pool_set_name(pool, "granular");
+    pool_set_granularity(pool, GRANULARITY);
+
+    /* Use the first array, so the next chunk comes from the new one */
+    for (i = 0; i < GRANULAR_SZ; i++)
+        pool_alloc(pool);
+
+    if (!pool_expand(pool, GRANULAR_SZ)) {
+        fprintf(stderr, "Could not expand the pool.\n");
+        exit(1);
+    }
+    chunk = pool_alloc(pool);
+
+    pool_get_stats(pool, &stats);
+    printf("\nExpanded 'granular' by %d chunks: capacity %lu, slack %lu, "
+           "array bytes %lu, new array aligned: %s\n",
+           GRANULAR_SZ,
+           (unsigned long)stats.capacity,
+           (unsigned long)stats.slack,
+           (unsigned long)stats.array_bytes,
+           ((uintptr_t)chunk % GRANULARITY == 0) ? "yes" : "no");
+    if (stats.capacity != GRANULAR_SZ + GRANULARITY / GRANULAR_CHUNK_SZ ||
+        stats.slack != GRANULARITY / GRANULAR_CHUNK_SZ - GRANULAR_SZ ||
+        stats.array_bytes != (GRANULAR_SZ * GRANULAR_CHUNK_SZ) + GRANULARITY ||
+        (uintptr_t)chunk % GRANULARITY != 0) {
+        fprintf(stderr, "The new array was not rounded to the granularity.\n");
+        exit(1);
+    }
+
+    pool_close(pool);
+}
+
+/*
+ * In `POOL_FIFO' pools, the free chunks are reused in the same order they were
+ * freed, both with `pool_free' and `pool_free_n'.
+ */
+static void test_fifo(void) {
+    void* chunks[FIFO_SZ];
+    void* freed[FIFO_SZ];
+    Pool* pool;
+    size_t i;
+    bool in_order;
+
+    pool = pool_new(FIFO_SZ, sizeof(MyObject));
+    if (pool == NULL) {
+        fprintf(stderr, "Could not create a new pool.\n");
+        exit(1);
+    }
+    pool_set_flags(pool, POOL_FIFO);
+
+    if (pool_alloc_n(pool, chunks, FIFO_SZ) != FIFO_SZ) {
+        fprintf(stderr, "Could not allocate a new chunk from pool.\n");
+        exit(1);
+    }
+
+    /* Free the odd chunks one by one, and then the even ones at once */
+    for (i = 0; i < FIFO_SZ / 2; i++) {
+        freed[i] = chunks[i * 2 + 1];
+        pool_free(pool, freed[i]);
+    }
+    for (i = 0; i < FIFO_SZ / 2; i++)
+        freed[FIFO_SZ / 2 + i] = chunks[i * 2];
+    pool_free_n(pool, freed + FIFO_SZ / 2, FIFO_SZ / 2);
+
+    in_order = true;
+    for (i = 0; i < FIFO_SZ; i++)
+        if (pool_alloc(pool) != freed[i])
+            in_order = false;
+
+    printf("\nChunks of a FIFO pool are reused in the order they were freed: "
+           "%s\n",
+           in_order ? "yes" : "no");
+    if (!in_order)
+        exit(1);
+
+    pool_close(pool);
+}
+
+/*
+ * Instead of choosing the chunk size by hand, `pool_layout' computes the stride
+ * and the alignment of the chunks for a given object size, and `pool_new_for'
+ * creates a pool with that layout.
+ */
+static void test_layout(void) {
+    static const char* names[] = { "auto", "packed", "cache line", "pow2" };
+    PoolLayout layout;
+    PoolStats stats;
+    Pool* pool;
+    void* chunk;
+    size_t i;
+    int kind;
+    bool aligned;
+
+    printf("\n");
+    for (kind = POOL_LAYOUT_PACKED; kind <= POOL_LAYOUT_POW2; kind++) {
+        if (!pool_layout(LAYOUT_SZ, LAYOUT_OBJ, 0, kind, &layout)) {
+            fprintf(stderr, "Could not compute a layout.\n");
+            exit(1);
+        }
+        printf("Layout '%s' for %d objects of %d bytes: stride %lu, "
+               "align %lu, %lu chunks, waste %lu\n",
+               names[kind],
+               LAYOUT_SZ,
+               LAYOUT_OBJ,
+               (unsigned long)layout.stride,
+               (unsigned long)layout.align,
+               (unsigned long)layout.pool_sz,
+               (unsigned long)layout.waste);
+    }
+
+    /* The alignment must be a power of two */
+    if (pool_layout(LAYOUT_SZ, LAYOUT_OBJ, 3, POOL_LAYOUT_AUTO, &layout)) {
+        fprintf(stderr, "Accepted an alignment of 3 bytes.\n");
+        exit(1);
+    }
+
+    pool = pool_new_for(LAYOUT_SZ, LAYOUT_OBJ, LAYOUT_ALIGN, POOL_LAYOUT_AUTO,
+                        &layout);
+    if (pool == NULL) {
+        fprintf(stderr, "Could not create a new pool.\n");
+        exit(1);
+    }
+
+    pool_get_stats(pool, &stats);
+    if (stats.chunk_sz != layout.stride || stats.capacity != layout.pool_sz) {
+        fprintf(stderr, "The pool doesn't match its layout.\n");
+        exit(1);
+    }
+
+    aligned = true;
+    for (i = 0; i < layout.pool_sz; i++) {
+        chunk = pool_alloc(pool);
+        if (chunk == NULL) {
+            fprintf(stderr, "Could not allocate a new chunk from pool.\n");
+            exit(1);
+        }
+        if ((uintptr_t)chunk % LAYOUT_ALIGN != 0)
+            aligned = false;
+    }
+
+    printf("All %lu chunks of a pool aligned to %d bytes are aligned: %s\n",
+           (unsigned long)layout.pool_sz,
+           LAYOUT_ALIGN,
+           aligned ? "yes" : "no");
+    if (!aligned)
+        exit(1);
+
+    pool_close(pool);
+}
+
 int main(void) {
-    Pool *pool1, *pool2;
-    size_t pool1_sz, pool2_sz, pool1_chunksz, pool2_chunksz;
+    Pool *pool1, *pool2, *pool3, *restored;
+    PoolArray* batch;
+    void* last;
+    PoolGroup* group;
+    FILE* snapshot_file;
+    PoolStats stats;
+    size_t pool1_sz, pool2_sz, pool1_chunksz, pool2_chunksz, grow_sz, i;
 
     /*
      * Initialize the pool once. The user doesn't even need to understand how
@@ -94,6 +495,13 @@ int main(void) {
         exit(1);
     }
 
+    /*
+     * Optionally, give a name to each pool. It's used when reporting the pool
+     * statistics (see `print_stats' below).
+     */
+    pool_set_name(pool1, "pool1");
+    pool_set_name(pool2, "pool2");
+
     /*
      * Do do some tests on each pool.
      */
@@ -107,13 +515,106 @@ int main(void) {
     pool_expand(pool1, 10);
     test_pool(pool1);
 
+    /*
+     * Limit the memory used by the chunk arrays of the second pool. Since it's
+     * already using all of its budget, it can't be expanded.
+     */
+    pool_set_budget(pool2, pool2_sz * pool2_chunksz);
+    printf("\nExpanding second pool over its budget: %s\n",
+           pool_expand(pool2, 10) ? "succeeded" : "failed");
+
+    printf("\n");
+    print_stats(pool1);
+    print_stats(pool2);
+
+    /*
+     * A pool can be saved to a file and restored later, possibly by another
+     * process. The restored pool has the same chunks, with the same contents,
+     * but at different addresses.
+     */
+    snapshot_file = tmpfile();
+    if (snapshot_file != NULL && pool_snapshot(pool1, fileno(snapshot_file))) {
+        rewind(snapshot_file);
+        restored = pool_restore(fileno(snapshot_file));
+        if (restored != NULL) {
+            pool_get_stats(restored, &stats);
+            printf("\nRestored a snapshot of 'pool1': capacity %lu, live %lu\n",
+                   (unsigned long)stats.capacity,
+                   (unsigned long)stats.live);
+            pool_close(restored);
+        }
+    }
+    if (snapshot_file != NULL)
+        fclose(snapshot_file);
+
+    /*
+     * Instead of handling failed allocations everywhere, a pool can have an
+     * exhaustion handler, which is called before `pool_alloc' gives up.
+     */
+    grow_sz = 16;
+    pool3   = pool_new(grow_sz, sizeof(MyObject));
+    if (pool3 != NULL) {
+        pool_set_name(pool3, "pool3");
+        pool_set_exhausted_handler(pool3, grow_pool, &grow_sz);
+        for (i = 0; i < 100; i++)
+            if (pool_alloc(pool3) == NULL)
+                break;
+
+        printf("\n");
+        print_stats(pool3);
+
+        /*
+         * Objects that die together can be allocated from their own array, and
+         * released at once, without freeing each of them.
+         */
+        batch = pool_expand_array(pool3, grow_sz);
+        last  = NULL;
+        for (i = 0; i < grow_sz; i++)
+            last = pool_alloc(pool3);
+        printf("Last chunk in 'pool3' before releasing the batch: %s\n",
+               pool_contains(pool3, last) ? "yes" : "no");
+        pool_release_array(pool3, batch);
+        printf("Last chunk in 'pool3' after releasing the batch: %s\n",
+               pool_contains(pool3, last) ? "yes" : "no");
+        print_stats(pool3);
+
+        pool_close(pool3);
+    }
+
+    test_scavenge();
+    test_calloc();
+    test_large_chunks();
+    test_granularity();
+    test_fifo();
+    test_layout();
+
+    /*
+     * Pools that belong to the same subsystem can be grouped, so they are
+     * measured and closed together.
+     */
+    group = pool_group_new();
+    if (group == NULL) {
+        fprintf(stderr, "Could not create a new group.\n");
+        exit(1);
+    }
+    pool_group_set_name(group, "group");
+    pool_group_add(group, pool1);
+    pool_group_add(group, pool2);
+
+    pool_group_get_stats(group, &stats);
+    printf("\nStats of '%s': capacity %lu, live %lu, array bytes %lu\n",
+           stats.name,
+           (unsigned long)stats.capacity,
+           (unsigned long)stats.live,
+           (unsigned long)stats.array_bytes);
+
     /*
      * When we are done, we "close" each pool. All previously allocated data
      * from the pool becomes unusable, and the necessary resources allocated by
-     * `pool_new' are freed.
+     * `pool_new' are freed. Here, both pools are closed along with their
+     * group.
      */
-    pool_close(pool2);
-    pool_close(pool1);
+    pool_group_close(group);
 
     return 0;
 }
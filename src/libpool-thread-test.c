@@ -0,0 +1,447 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libpool.h"
+#include "libpool-thread.h"
+
+#define NUM_POOLS  100
+#define POOL_SZ    64
+#define CHUNK_SZ   256
+#define EXPANSIONS 20
+
+#define NUM_THREADS   4
+#define STEAL_BATCH   32
+#define STEAL_POOL_SZ 256
+#define STEAL_OPS     100000
+#define STEAL_LIVE    512
+
+#define TPOOL_OBJS    1000
+#define TPOOL_GROW_SZ 2000
+
+#define SCAVENGE_CHUNKS   256
+#define SCAVENGE_CHUNK_SZ 4096
+#define SCAVENGE_INTERVAL 10
+
+/*
+ * Create many pools with multiple chunk arrays each, and close them without
+ * waiting for their memory to be freed. The background thread frees the arrays
+ * while we keep working.
+ */
+static void test_close_async(void) {
+    Pool* pool;
+    size_t i, j;
+
+    for (i = 0; i < NUM_POOLS; i++) {
+        pool = pool_new(POOL_SZ, CHUNK_SZ);
+        if (pool == NULL) {
+            fprintf(stderr, "Could not create a new pool.\n");
+            exit(1);
+        }
+
+        for (j = 0; j < EXPANSIONS; j++) {
+            if (!pool_expand(pool, POOL_SZ)) {
+                fprintf(stderr, "Could not expand the pool.\n");
+                exit(1);
+            }
+        }
+
+        pool_alloc(pool);
+        pool_close_async(pool);
+    }
+
+    /*
+     * Before exiting, wait until the background thread has freed everything.
+     */
+    pool_reclaim_flush();
+    printf("Closed %d pools asynchronously.\n", NUM_POOLS);
+}
+
+/*
+ * Each thread allocates and frees chunks randomly, and some of them are freed
+ * by another thread, after passing them through the `handoff' array. Each chunk
+ * stores the index of the thread that owns it, to check that a chunk is never
+ * returned to two threads at the same time.
+ */
+static PoolStealGroup* group;
+static pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t* handoff[NUM_THREADS];
+
+static void* steal_thread(void* arg) {
+    PoolStealMember* member;
+    size_t* live[STEAL_LIVE];
+    size_t* received;
+    size_t nlive, id, next, i, j;
+    unsigned long seed;
+
+    id     = (size_t)arg;
+    next   = (id + 1) % NUM_THREADS;
+    seed   = id + 1;
+    nlive  = 0;
+    member = pool_steal_join(group, STEAL_POOL_SZ);
+    if (member == NULL) {
+        fprintf(stderr, "Could not join the steal group.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < STEAL_OPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        j    = (seed >> 16) % STEAL_LIVE;
+
+        if (j >= nlive) {
+            if (nlive == STEAL_LIVE)
+                continue;
+
+            live[nlive] = pool_steal_alloc(member);
+            if (live[nlive] == NULL) {
+                fprintf(stderr, "Could not allocate from the steal group.\n");
+                exit(1);
+            }
+            *live[nlive++] = id;
+            continue;
+        }
+
+        if (*live[j] != id) {
+            fprintf(stderr, "Chunk owned by two threads.\n");
+            exit(1);
+        }
+
+        /* Give the chunk to the next thread, if it doesn't have one already */
+        pthread_mutex_lock(&handoff_mutex);
+        received    = handoff[id];
+        handoff[id] = NULL;
+        if (handoff[next] == NULL) {
+            *live[j]      = next;
+            handoff[next] = live[j];
+            live[j]       = NULL;
+        }
+        pthread_mutex_unlock(&handoff_mutex);
+
+        if (received != NULL && *received != id) {
+            fprintf(stderr, "Chunk owned by two threads.\n");
+            exit(1);
+        }
+
+        pool_steal_free(member, received);
+        pool_steal_free(member, live[j]);
+        live[j] = live[--nlive];
+    }
+
+    while (nlive > 0)
+        pool_steal_free(member, live[--nlive]);
+
+    pool_steal_leave(member);
+    return NULL;
+}
+
+/*
+ * Run the threads above, and check that the pools didn't grow much, even though
+ * the chunks are constantly moving from one thread to another.
+ */
+static void test_steal(void) {
+    pthread_t threads[NUM_THREADS];
+    PoolStealMember* member;
+    PoolStats stats;
+    size_t i;
+
+    group = pool_steal_group_new(sizeof(size_t), STEAL_BATCH);
+    if (group == NULL) {
+        fprintf(stderr, "Could not create the steal group.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, steal_thread, (void*)i) != 0) {
+            fprintf(stderr, "Could not create a thread.\n");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    /* Free the chunks that were never received, from one of the old members */
+    member = pool_steal_join(group, STEAL_POOL_SZ);
+    for (i = 0; i < NUM_THREADS; i++)
+        pool_steal_free(member, handoff[i]);
+
+    /* The pool can't hold more chunks than all threads had at the same time */
+    pool_get_stats(pool_steal_get_pool(member), &stats);
+    if (stats.capacity > NUM_THREADS * STEAL_LIVE) {
+        fprintf(stderr, "The pools grew too much.\n");
+        exit(1);
+    }
+
+    printf("Moved chunks between %d threads.\n", NUM_THREADS);
+
+    pool_steal_leave(member);
+    pool_steal_group_close(group);
+}
+
+/*
+ * Each thread allocates objects of different sizes with `tpool_alloc', and
+ * fills them with its index. The main thread checks and frees them, so all the
+ * chunks are freed by a thread that didn't allocate them.
+ */
+static unsigned char* tpool_objs[NUM_THREADS][TPOOL_OBJS];
+
+static size_t tpool_obj_size(size_t i) {
+    return 1 + (i * 37) % 1200;
+}
+
+static void* tpool_thread(void* arg) {
+    size_t id, i, size;
+
+    id = (size_t)arg;
+    for (i = 0; i < TPOOL_OBJS; i++) {
+        size              = tpool_obj_size(i);
+        tpool_objs[id][i] = tpool_alloc(size);
+        if (tpool_objs[id][i] == NULL) {
+            fprintf(stderr, "Could not allocate from the thread pools.\n");
+            exit(1);
+        }
+        memset(tpool_objs[id][i], (int)id, size);
+    }
+
+    return NULL;
+}
+
+static void test_tpool(void) {
+    pthread_t threads[NUM_THREADS];
+    unsigned char* buf;
+    size_t i, j, size;
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, tpool_thread, (void*)i) != 0) {
+            fprintf(stderr, "Could not create a thread.\n");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        for (j = 0; j < TPOOL_OBJS; j++) {
+            size = tpool_obj_size(j);
+            if (tpool_objs[i][j][0] != i || tpool_objs[i][j][size - 1] != i) {
+                fprintf(stderr, "Object of another thread overwritten.\n");
+                exit(1);
+            }
+            tpool_free(tpool_objs[i][j], size);
+        }
+    }
+
+    printf("Freed the objects of %d threads from the main thread.\n",
+           NUM_THREADS);
+
+    /* Grow a buffer one byte at a time, moving it through all the classes */
+    buf = NULL;
+    for (size = 1; size <= TPOOL_GROW_SZ; size++) {
+        buf = tpool_realloc(buf, size - 1, size);
+        if (buf == NULL) {
+            fprintf(stderr, "Could not grow the buffer.\n");
+            exit(1);
+        }
+        buf[size - 1] = (unsigned char)size;
+    }
+
+    for (size = 1; size <= TPOOL_GROW_SZ; size++) {
+        if (buf[size - 1] != (unsigned char)size) {
+            fprintf(stderr, "The buffer lost its contents.\n");
+            exit(1);
+        }
+    }
+
+    tpool_free(buf, TPOOL_GROW_SZ);
+    printf("Grew a buffer to %d bytes.\n", TPOOL_GROW_SZ);
+}
+
+/*
+ * Fill a pool and free all its chunks, and wait until the background thread
+ * has released some of them. The first scavenge only marks the chunks as cold,
+ * so it takes at least two intervals.
+ */
+static void test_scavenger(void) {
+    static void* chunks[SCAVENGE_CHUNKS];
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct timespec interval;
+    PoolScavenger* scavenger;
+    PoolStats stats;
+    Pool* pool;
+    size_t i;
+
+    pool = pool_new(SCAVENGE_CHUNKS, SCAVENGE_CHUNK_SZ);
+    if (pool == NULL) {
+        fprintf(stderr, "Could not create a new pool.\n");
+        exit(1);
+    }
+
+    pool_alloc_n(pool, chunks, SCAVENGE_CHUNKS);
+    for (i = 0; i < SCAVENGE_CHUNKS; i++)
+        memset(chunks[i], 'A', SCAVENGE_CHUNK_SZ);
+    pool_free_n(pool, chunks, SCAVENGE_CHUNKS);
+
+    scavenger = pool_scavenger_new(pool, &mutex, SCAVENGE_INTERVAL, (size_t)-1);
+    if (scavenger == NULL) {
+        fprintf(stderr, "Could not start the scavenger.\n");
+        exit(1);
+    }
+
+    interval.tv_sec  = 0;
+    interval.tv_nsec = SCAVENGE_INTERVAL * 1000000L;
+    for (i = 0; i < 200; i++) {
+        pthread_mutex_lock(&mutex);
+        pool_get_stats(pool, &stats);
+        pthread_mutex_unlock(&mutex);
+        if (stats.released > 0)
+            break;
+
+        nanosleep(&interval, NULL);
+    }
+
+    pool_scavenger_close(scavenger);
+
+    if (stats.released == 0) {
+        fprintf(stderr, "The scavenger didn't release any chunk.\n");
+        exit(1);
+    }
+
+    /* The released chunks are still usable */
+    for (i = 0; i < SCAVENGE_CHUNKS; i++) {
+        chunks[i] = pool_alloc(pool);
+        if (chunks[i] == NULL) {
+            fprintf(stderr, "Could not reuse the scavenged chunks.\n");
+            exit(1);
+        }
+    }
+
+    pool_close(pool);
+    pthread_mutex_destroy(&mutex);
+    printf("Scavenged %lu chunks in the background.\n",
+           (unsigned long)stats.released);
+}
+
+/*
+ * A helper thread fills its pool of a steal group, frees all the chunks, and
+ * stays idle while the main thread forks. In the child, the helper doesn't
+ * exist, but its chunks can be used without expanding any pool.
+ */
+static pthread_mutex_t helper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t helper_cond   = PTHREAD_COND_INITIALIZER;
+static bool helper_ready            = false;
+static bool helper_quit             = false;
+
+static void* fork_helper(void* unused) {
+    PoolStealMember* member;
+    void* chunks[STEAL_POOL_SZ];
+    size_t i;
+
+    (void)unused;
+    member = pool_steal_join(group, STEAL_POOL_SZ);
+    if (member == NULL) {
+        fprintf(stderr, "Could not join the steal group.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < STEAL_POOL_SZ; i++)
+        chunks[i] = pool_steal_alloc(member);
+    for (i = 0; i < STEAL_POOL_SZ; i++)
+        pool_steal_free(member, chunks[i]);
+
+    pthread_mutex_lock(&helper_mutex);
+    helper_ready = true;
+    pthread_cond_signal(&helper_cond);
+    while (!helper_quit)
+        pthread_cond_wait(&helper_cond, &helper_mutex);
+    pthread_mutex_unlock(&helper_mutex);
+
+    pool_steal_leave(member);
+    return NULL;
+}
+
+static void fork_child_main(void) {
+    PoolStealMember* member;
+    PoolStats stats;
+    size_t i;
+
+    /* The helper's member is still owned, so we get a new one */
+    member = pool_steal_join(group, 1);
+    if (member == NULL)
+        exit(1);
+
+    for (i = 0; i < STEAL_POOL_SZ; i++)
+        if (pool_steal_alloc(member) == NULL)
+            exit(1);
+
+    pool_get_stats(pool_steal_get_pool(member), &stats);
+    if (stats.expansions != 0)
+        exit(1);
+
+    /* The reclaimer is started again in the child */
+    pool_close_async(pool_new(POOL_SZ, CHUNK_SZ));
+    pool_reclaim_flush();
+    exit(0);
+}
+
+static void test_fork(void) {
+    pthread_t helper;
+    pid_t pid;
+    int status;
+
+    group = pool_steal_group_new(CHUNK_SZ, STEAL_BATCH);
+    if (group == NULL ||
+        pthread_create(&helper, NULL, fork_helper, NULL) != 0) {
+        fprintf(stderr, "Could not start the helper thread.\n");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&helper_mutex);
+    while (!helper_ready)
+        pthread_cond_wait(&helper_cond, &helper_mutex);
+    pthread_mutex_unlock(&helper_mutex);
+
+    /* Otherwise, the child would print the buffered output again */
+    fflush(stdout);
+
+    pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Could not fork.\n");
+        exit(1);
+    }
+    if (pid == 0)
+        fork_child_main();
+
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "The child process failed.\n");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&helper_mutex);
+    helper_quit = true;
+    pthread_cond_signal(&helper_cond);
+    pthread_mutex_unlock(&helper_mutex);
+
+    pthread_join(helper, NULL);
+    pool_steal_group_close(group);
+    printf("Used the chunks of another thread after forking.\n");
+}
+
+int main(void) {
+    test_close_async();
+    test_steal();
+    test_tpool();
+    test_scavenger();
+    test_fork();
+    return 0;
+}
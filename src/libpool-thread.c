@@ -0,0 +1,1169 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is part of libpool, a tiny (ANSI) C library for pool allocation.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* NOTE: Remember to change these paths if you move the headers */
+#include "libpool.h"
+#include "libpool-internal.h"
+#include "libpool-atomic.h"
+#include "libpool-thread.h"
+
+/*
+ * Maximum number of chunk arrays that the reclaimer frees before releasing the
+ * lock, so other threads can keep adding arrays in the meantime.
+ */
+#define RECLAIM_BATCH_SZ 64
+
+/*----------------------------------------------------------------------------*/
+
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+
+/*
+ * The lists of steal groups, return rings and scavengers of this module, which
+ * are only used after a `fork', are protected by a recursive mutex, initialized
+ * once by `pool_thread_init'. The global state of the core library has its own
+ * lock, which is always taken last. If the core doesn't have a default lock, it
+ * uses the `core_mutex'.
+ */
+static pthread_once_t global_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t global_mutex;
+static pthread_mutex_t core_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void global_lock(void) {
+    pthread_mutex_lock(&global_mutex);
+}
+
+static void global_unlock(void) {
+    pthread_mutex_unlock(&global_mutex);
+}
+
+static void core_lock(void) {
+    pthread_mutex_lock(&core_mutex);
+}
+
+static void core_unlock(void) {
+    pthread_mutex_unlock(&core_mutex);
+}
+
+static void global_mutex_init(void) {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&global_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void global_init(void) {
+    global_mutex_init();
+
+    if (pool_ext_lock == NULL || pool_ext_unlock == NULL) {
+        pool_ext_lock   = core_lock;
+        pool_ext_unlock = core_unlock;
+    }
+
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+void pool_thread_init(void) {
+    pthread_once(&global_once, global_init);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The reclaimer is a single background thread, started the first time a pool
+ * is closed with `pool_close_async'. The detached chunk arrays of all pools are
+ * concatenated into the `reclaim_pending' list, and the reclaimer sleeps
+ * until that list is not empty.
+ *
+ * The `reclaim_busy' variable is true while the reclaimer is freeing a batch
+ * that has already been removed from the list, so `pool_reclaim_flush' knows
+ * when all the arrays have actually been freed.
+ */
+static pthread_mutex_t reclaim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_work   = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reclaim_done   = PTHREAD_COND_INITIALIZER;
+static ArrayStart* reclaim_pending   = NULL;
+static bool reclaim_busy             = false;
+static bool reclaim_started          = false;
+static pthread_t reclaim_thread;
+
+static void* reclaimer_main(void* unused) {
+    ArrayStart* batch;
+    ArrayStart* rest;
+
+    (void)unused;
+
+    pthread_mutex_lock(&reclaim_mutex);
+    for (;;) {
+        while (reclaim_pending == NULL)
+            pthread_cond_wait(&reclaim_work, &reclaim_mutex);
+
+        /*
+         * Take the whole list, free one batch without holding the lock, and put
+         * the rest of the list back.
+         */
+        batch           = reclaim_pending;
+        reclaim_pending = NULL;
+        reclaim_busy    = true;
+        pthread_mutex_unlock(&reclaim_mutex);
+
+        rest = pool_free_arrays(batch, RECLAIM_BATCH_SZ);
+
+        /* Only the arrays added in the meantime are traversed */
+        pthread_mutex_lock(&reclaim_mutex);
+        reclaim_pending = pool_concat_arrays(reclaim_pending, rest);
+        reclaim_busy    = false;
+        pthread_cond_broadcast(&reclaim_done);
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Give the specified list of detached arrays to the reclaimer, starting it if
+ * needed.
+ */
+static void reclaim_arrays(ArrayStart* arrays) {
+    pthread_mutex_lock(&reclaim_mutex);
+
+    if (!reclaim_started) {
+        if (pthread_create(&reclaim_thread, NULL, reclaimer_main, NULL) != 0) {
+            pthread_mutex_unlock(&reclaim_mutex);
+            while (arrays != NULL)
+                arrays = pool_free_arrays(arrays, (size_t)-1);
+            return;
+        }
+
+        pthread_detach(reclaim_thread);
+        reclaim_started = true;
+    }
+
+    /* Only the new list is traversed, not the pending one */
+    reclaim_pending = pool_concat_arrays(arrays, reclaim_pending);
+    pthread_cond_signal(&reclaim_work);
+
+    pthread_mutex_unlock(&reclaim_mutex);
+}
+
+void pool_close_async(Pool* pool) {
+    if (pool == NULL)
+        return;
+
+    pool_thread_init();
+    reclaim_arrays(pool_detach(pool));
+}
+
+void pool_group_close_async(PoolGroup* group) {
+    if (group == NULL)
+        return;
+
+    pool_thread_init();
+    reclaim_arrays(pool_group_detach(group));
+}
+
+void pool_reclaim_flush(void) {
+    ArrayStart* arrays;
+
+    pthread_mutex_lock(&reclaim_mutex);
+
+    /* In a child process, the arrays can be pending without a reclaimer */
+    if (!reclaim_started) {
+        arrays          = reclaim_pending;
+        reclaim_pending = NULL;
+        pthread_mutex_unlock(&reclaim_mutex);
+
+        while (arrays != NULL)
+            arrays = pool_free_arrays(arrays, (size_t)-1);
+        return;
+    }
+
+    while (reclaim_pending != NULL || reclaim_busy)
+        pthread_cond_wait(&reclaim_done, &reclaim_mutex);
+    pthread_mutex_unlock(&reclaim_mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Each scavenger has its own thread, which sleeps on the `wake' condition for
+ * the specified interval, and then scavenges the pool if the mutex of the pool
+ * is not taken. Its own mutex is held while scavenging, so `fork_prepare' can
+ * wait for the scavenge to finish, and `pool_scavenger_close' can wake the
+ * thread up without waiting for the rest of the interval.
+ */
+struct PoolScavenger {
+    Pool* pool;
+    pthread_mutex_t* pool_mutex;
+    unsigned long interval_ms;
+    size_t max_bytes;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    bool stop;
+    bool running;
+    pthread_t thread;
+
+    /* List of open scavengers, see `fork_child' */
+    PoolScavenger* next;
+    PoolScavenger* prev;
+};
+
+static PoolScavenger* scavengers = NULL;
+
+/*
+ * Add `ms' milliseconds to the current time, for `pthread_cond_timedwait'.
+ */
+static void deadline_after(struct timespec* deadline, unsigned long ms) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += (time_t)(ms / 1000);
+    deadline->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * The mutex of the pool is only tried, since the thread that owns the pool
+ * could be waiting for the scavenger (e.g. in `fork_prepare'). If the pool is
+ * in use, it's simply scavenged in the next interval.
+ */
+static void* scavenger_main(void* arg) {
+    PoolScavenger* scavenger = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&scavenger->mutex);
+    while (!scavenger->stop) {
+        deadline_after(&deadline, scavenger->interval_ms);
+        while (!scavenger->stop &&
+               pthread_cond_timedwait(&scavenger->wake,
+                                      &scavenger->mutex,
+                                      &deadline) != ETIMEDOUT)
+            continue;
+
+        if (scavenger->stop ||
+            pthread_mutex_trylock(scavenger->pool_mutex) != 0)
+            continue;
+
+        pool_scavenge(scavenger->pool, scavenger->max_bytes);
+        pthread_mutex_unlock(scavenger->pool_mutex);
+    }
+    pthread_mutex_unlock(&scavenger->mutex);
+
+    return NULL;
+}
+
+PoolScavenger* pool_scavenger_new(Pool* pool, pthread_mutex_t* mutex,
+                                  unsigned long interval_ms,
+                                  size_t max_bytes) {
+    PoolScavenger* scavenger;
+
+    if (pool == NULL || mutex == NULL || interval_ms == 0)
+        return NULL;
+
+    scavenger = pool_ext_alloc(sizeof(PoolScavenger));
+    if (scavenger == NULL)
+        return NULL;
+
+    scavenger->pool        = pool;
+    scavenger->pool_mutex  = mutex;
+    scavenger->interval_ms = interval_ms;
+    scavenger->max_bytes   = max_bytes;
+    scavenger->stop        = false;
+    scavenger->running     = true;
+    pthread_mutex_init(&scavenger->mutex, NULL);
+    pthread_cond_init(&scavenger->wake, NULL);
+
+    pool_thread_init();
+    global_lock();
+    if (pthread_create(&scavenger->thread, NULL, scavenger_main, scavenger) !=
+        0) {
+        global_unlock();
+        pthread_cond_destroy(&scavenger->wake);
+        pthread_mutex_destroy(&scavenger->mutex);
+        pool_ext_free(scavenger);
+        return NULL;
+    }
+
+    scavenger->prev = NULL;
+    scavenger->next = scavengers;
+    if (scavengers != NULL)
+        scavengers->prev = scavenger;
+    scavengers = scavenger;
+    global_unlock();
+
+    return scavenger;
+}
+
+void pool_scavenger_close(PoolScavenger* scavenger) {
+    if (scavenger == NULL)
+        return;
+
+    global_lock();
+    if (scavenger->prev != NULL)
+        scavenger->prev->next = scavenger->next;
+    else
+        scavengers = scavenger->next;
+    if (scavenger->next != NULL)
+        scavenger->next->prev = scavenger->prev;
+    global_unlock();
+
+    pthread_mutex_lock(&scavenger->mutex);
+    scavenger->stop = true;
+    pthread_cond_signal(&scavenger->wake);
+    pthread_mutex_unlock(&scavenger->mutex);
+
+    /* In a child process, the thread of the scavenger doesn't exist */
+    if (scavenger->running)
+        pthread_join(scavenger->thread, NULL);
+
+    pthread_cond_destroy(&scavenger->wake);
+    pthread_mutex_destroy(&scavenger->mutex);
+    pool_ext_free(scavenger);
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Each member of a steal group has a private pool, and a private list of free
+ * chunks, which are linked through their first bytes, just like in the pool.
+ * The chunks freed with `pool_steal_free' go to this list, and not back to the
+ * pool, since they could belong to the pool of another member.
+ *
+ * When the list grows too much, a batch of chunks is pushed to the donation
+ * stack of the member, which is the only part of the structure that is used by
+ * other threads. Pushing is done with a compare-and-swap, and stealing takes
+ * the whole stack at once with an atomic exchange, so there is no ABA problem.
+ *
+ * Members are never removed from the group until it's closed, so the list of
+ * members can be traversed without locks. A member that left the group is
+ * reused by the next thread that joins it.
+ */
+struct PoolStealMember {
+    ATOMIC(void*) donated;
+    char padding[LIBPOOL_CACHE_LINE_SZ - sizeof(void*)];
+
+    PoolStealGroup* group;
+    PoolStealMember* next;
+    Pool* pool;
+    size_t expand_sz;
+    ATOMIC(bool) owned;
+    pthread_t owner;
+
+    void* local;
+    size_t nlocal;
+};
+
+struct PoolStealGroup {
+    ATOMIC(PoolStealMember*) members;
+    size_t chunk_sz;
+    size_t batch_sz;
+
+    /* List of open groups, see `fork_child' */
+    PoolStealGroup* next;
+};
+
+static PoolStealGroup* steal_groups = NULL;
+
+/*
+ * Push a chain of chunks, from `first' to `last', to the donation stack of the
+ * specified member.
+ */
+static void donate_chain(PoolStealMember* member, void* first, void* last) {
+    void* head;
+
+    head = ATOMIC_LOAD(&member->donated, ORDER_RELAXED);
+    do {
+        *(void**)last = head;
+    } while (!ATOMIC_CAS_WEAK(&member->donated, &head, first, ORDER_RELEASE,
+                              ORDER_RELAXED));
+}
+
+/*
+ * Donate the whole local list of the specified member.
+ */
+static void donate_local(PoolStealMember* member) {
+    void* last;
+
+    if (member->local == NULL)
+        return;
+
+    for (last = member->local; *(void**)last != NULL; last = *(void**)last)
+        ;
+
+    donate_chain(member, member->local, last);
+    member->local  = NULL;
+    member->nlocal = 0;
+}
+
+/*
+ * Move the whole donation stack of `victim' to the local list of `member'.
+ * Returns true if any chunk was stolen.
+ */
+static bool steal_from(PoolStealMember* member, PoolStealMember* victim) {
+    void* chain;
+    void* last;
+    size_t n;
+
+    /* Avoid the exchange, which always takes the cache line, if it's empty */
+    if (ATOMIC_LOAD(&victim->donated, ORDER_RELAXED) == NULL)
+        return false;
+
+    chain = ATOMIC_EXCHANGE(&victim->donated, NULL, ORDER_ACQUIRE);
+    if (chain == NULL)
+        return false;
+
+    for (last = chain, n = 1; *(void**)last != NULL; last = *(void**)last)
+        n++;
+
+    *(void**)last = member->local;
+    member->local = chain;
+    member->nlocal += n;
+    return true;
+}
+
+/*
+ * Try to refill the local list of `member', first with its own donations, and
+ * then with the donations of the rest of the group.
+ */
+static bool steal(PoolStealMember* member) {
+    PoolStealMember* victim;
+
+    if (steal_from(member, member))
+        return true;
+
+    victim = ATOMIC_LOAD(&member->group->members, ORDER_ACQUIRE);
+    for (; victim != NULL; victim = victim->next)
+        if (victim != member && steal_from(member, victim))
+            return true;
+
+    return false;
+}
+
+/*
+ * In debug builds, `tpool_free' searches the pools of other threads (see
+ * `group_contains'), so the pools of the members are only expanded while
+ * holding the global lock.
+ */
+static bool expand_member(PoolStealMember* member) {
+#if defined(LIBPOOL_DEBUG)
+    bool result;
+
+    global_lock();
+    result = pool_expand(member->pool, member->expand_sz);
+    global_unlock();
+    return result;
+#else
+    return pool_expand(member->pool, member->expand_sz);
+#endif
+}
+
+#if defined(LIBPOOL_DEBUG)
+/*
+ * Check if `ptr' is a chunk of the pool of any member of the specified `group'.
+ *
+ * Note that `pool_contains' reads the pools of other threads, making their
+ * `Pool' structures defined and then inaccessible again for Valgrind, which can
+ * hide or cause Valgrind errors while their owners are using them. It also
+ * accepts free chunks, so a double free is not detected.
+ */
+static bool group_contains(PoolStealGroup* group, const void* ptr) {
+    PoolStealMember* member;
+    bool result;
+
+    result = false;
+    global_lock();
+    member = ATOMIC_LOAD(&group->members, ORDER_ACQUIRE);
+    for (; member != NULL && !result; member = member->next)
+        result = pool_contains(member->pool, ptr);
+    global_unlock();
+
+    return result;
+}
+#endif
+
+/*----------------------------------------------------------------------------*/
+
+PoolStealGroup* pool_steal_group_new(size_t chunk_sz, size_t batch_sz) {
+    PoolStealGroup* group;
+
+    if (chunk_sz < sizeof(void*) || batch_sz == 0)
+        return NULL;
+
+    pool_thread_init();
+
+    group = pool_ext_alloc(sizeof(PoolStealGroup));
+    if (group == NULL)
+        return NULL;
+
+    ATOMIC_STORE(&group->members, NULL, ORDER_RELAXED);
+    group->chunk_sz = chunk_sz;
+    group->batch_sz = batch_sz;
+
+    global_lock();
+    group->next  = steal_groups;
+    steal_groups = group;
+    global_unlock();
+
+    return group;
+}
+
+void pool_steal_group_close(PoolStealGroup* group) {
+    PoolStealGroup** link;
+    PoolStealMember* member;
+    PoolStealMember* next;
+
+    if (group == NULL)
+        return;
+
+    global_lock();
+    for (link = &steal_groups; *link != group; link = &(*link)->next)
+        ;
+    *link = group->next;
+    global_unlock();
+
+    member = ATOMIC_LOAD(&group->members, ORDER_ACQUIRE);
+    while (member != NULL) {
+        next = member->next;
+        pool_close(member->pool);
+        pool_ext_free(member);
+        member = next;
+    }
+
+    pool_ext_free(group);
+}
+
+PoolStealMember* pool_steal_join(PoolStealGroup* group, size_t pool_sz) {
+    PoolStealMember* member;
+    bool owned;
+
+    /* Reuse the member of a thread that left the group, if any */
+    member = ATOMIC_LOAD(&group->members, ORDER_ACQUIRE);
+    for (; member != NULL; member = member->next) {
+        owned = false;
+        if (ATOMIC_CAS_STRONG(&member->owned, &owned, true, ORDER_ACQUIRE,
+                              ORDER_RELAXED)) {
+            member->expand_sz = pool_sz;
+            member->owner     = pthread_self();
+            return member;
+        }
+    }
+
+    member = pool_ext_alloc(sizeof(PoolStealMember));
+    if (member == NULL)
+        return NULL;
+
+    member->pool = pool_new(pool_sz, group->chunk_sz);
+    if (member->pool == NULL) {
+        pool_ext_free(member);
+        return NULL;
+    }
+
+    member->group     = group;
+    member->expand_sz = pool_sz;
+    member->owner     = pthread_self();
+    member->local     = NULL;
+    member->nlocal    = 0;
+    ATOMIC_STORE(&member->donated, NULL, ORDER_RELAXED);
+    ATOMIC_STORE(&member->owned, true, ORDER_RELAXED);
+
+    member->next = ATOMIC_LOAD(&group->members, ORDER_RELAXED);
+    while (!ATOMIC_CAS_WEAK(&group->members, &member->next, member,
+                            ORDER_RELEASE, ORDER_RELAXED))
+        ;
+
+    return member;
+}
+
+/*
+ * The free chunks that are still in the pool, including the untouched ones,
+ * are donated too, so the other members don't have to wait for a thread to
+ * reuse the pool before they can use them.
+ */
+void pool_steal_leave(PoolStealMember* member) {
+    void* first;
+    void* last;
+
+    donate_local(member);
+
+    first = pool_take_free(member->pool, &last);
+    if (first != NULL)
+        donate_chain(member, first, last);
+
+    ATOMIC_STORE(&member->owned, false, ORDER_RELEASE);
+}
+
+void* pool_steal_alloc(PoolStealMember* member) {
+    void* result;
+
+    /*
+     * The chunks of the pool are only used when the local list is empty, and
+     * the pool is only expanded when there is nothing to steal. The exhaustion
+     * handler of the pool is only called by `pool_alloc' if everything else
+     * failed.
+     */
+    if (member->local == NULL) {
+        result = pool_try_alloc(member->pool);
+        if (result != NULL)
+            return result;
+
+        if (!steal(member)) {
+            expand_member(member);
+            return pool_alloc(member->pool);
+        }
+    }
+
+    result        = member->local;
+    member->local = *(void**)result;
+    member->nlocal--;
+
+    return result;
+}
+
+void pool_steal_free(PoolStealMember* member, void* ptr) {
+    void* last;
+    void* rest;
+    size_t batch_sz;
+    size_t i;
+
+    if (ptr == NULL)
+        return;
+
+    *(void**)ptr  = member->local;
+    member->local = ptr;
+    member->nlocal++;
+
+    /*
+     * Keep at least a batch of chunks, so a thread that frees and allocates in
+     * turns doesn't donate its chunks and steal them back all the time.
+     */
+    batch_sz = member->group->batch_sz;
+    if (member->nlocal < 2 * batch_sz)
+        return;
+
+    last = member->local;
+    for (i = 1; i < batch_sz; i++)
+        last = *(void**)last;
+
+    rest = *(void**)last;
+    donate_chain(member, member->local, last);
+    member->local = rest;
+    member->nlocal -= batch_sz;
+}
+
+Pool* pool_steal_get_pool(PoolStealMember* member) {
+    return member->pool;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The size classes of `tpool_alloc' are 16 bytes apart up to 128 bytes, and
+ * then there are 4 classes for each power of two. Each class is served by a
+ * steal group, created the first time any thread needs a pool, so the chunks
+ * freed by a different thread are handled just like in `pool_steal_free'.
+ *
+ * The members of the calling thread are stored in thread-local storage, and
+ * each thread joins the group of a class the first time it uses it. The
+ * members are released by the destructor of `tpool_key' when the thread exits,
+ * so the next threads reuse their pools.
+ */
+#define TPOOL_NUM_CLASSES 20
+#define TPOOL_MAX_SZ      1024
+#define TPOOL_ARRAY_BYTES 16384
+#define TPOOL_BATCH_SZ    64
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define THREAD_LOCAL _Thread_local
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+static const size_t tpool_sizes[TPOOL_NUM_CLASSES] = {
+    16,  32,  48,  64,  80,  96,  112, 128, 160, 192,
+    224, 256, 320, 384, 448, 512, 640, 768, 896, 1024,
+};
+
+/* Class of each size, indexed by the size divided by 16, rounded up */
+static const unsigned char tpool_classes[TPOOL_MAX_SZ / 16 + 1] = {
+    0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  8,  9,  9,  10, 10, 11, 11,
+    12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15, 16,
+    16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17, 17, 18, 18,
+    18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19, 19,
+};
+
+static pthread_once_t tpool_once = PTHREAD_ONCE_INIT;
+static PoolStealGroup* tpool_groups[TPOOL_NUM_CLASSES];
+static pthread_key_t tpool_key;
+static bool tpool_key_valid = false;
+
+static THREAD_LOCAL PoolStealMember* tpool_members[TPOOL_NUM_CLASSES];
+
+static void tpool_leave_all(void* unused) {
+    size_t i;
+
+    (void)unused;
+
+    for (i = 0; i < TPOOL_NUM_CLASSES; i++) {
+        if (tpool_members[i] != NULL) {
+            pool_steal_leave(tpool_members[i]);
+            tpool_members[i] = NULL;
+        }
+    }
+}
+
+static void tpool_init(void) {
+    size_t i;
+
+    tpool_key_valid = (pthread_key_create(&tpool_key, tpool_leave_all) == 0);
+
+    /* If a group can't be created, its class always fails */
+    for (i = 0; i < TPOOL_NUM_CLASSES; i++)
+        tpool_groups[i] = pool_steal_group_new(tpool_sizes[i], TPOOL_BATCH_SZ);
+}
+
+/*
+ * Join the group of the specified class from the calling thread. This is the
+ * only part of `tpool_alloc' and `tpool_free' that can take a lock, and it's
+ * only called once per class and thread.
+ */
+static PoolStealMember* tpool_join(size_t cls) {
+    PoolStealMember* member;
+
+    pthread_once(&tpool_once, tpool_init);
+    if (tpool_groups[cls] == NULL)
+        return NULL;
+
+    member = pool_steal_join(tpool_groups[cls],
+                             TPOOL_ARRAY_BYTES / tpool_sizes[cls]);
+    if (member == NULL)
+        return NULL;
+
+    /* The destructor is only called if the value is not NULL */
+    if (tpool_key_valid)
+        pthread_setspecific(tpool_key, tpool_members);
+
+    tpool_members[cls] = member;
+    return member;
+}
+
+void* tpool_alloc(size_t size) {
+    PoolStealMember* member;
+    size_t cls;
+
+    if (size > TPOOL_MAX_SZ)
+        return pool_ext_alloc(size);
+
+    cls    = tpool_classes[(size + 15) / 16];
+    member = tpool_members[cls];
+    if (member == NULL) {
+        member = tpool_join(cls);
+        if (member == NULL)
+            return NULL;
+    }
+
+    return pool_steal_alloc(member);
+}
+
+void tpool_free(void* ptr, size_t size) {
+    PoolStealMember* member;
+    size_t cls;
+
+    if (ptr == NULL)
+        return;
+
+    if (size > TPOOL_MAX_SZ) {
+        pool_ext_free(ptr);
+        return;
+    }
+
+    /* A thread that only frees chunks also needs a member */
+    cls    = tpool_classes[(size + 15) / 16];
+    member = tpool_members[cls];
+    if (member == NULL)
+        member = tpool_join(cls);
+
+#if defined(LIBPOOL_DEBUG)
+    /*
+     * The chunk was allocated with a different size, or not by `tpool_alloc'.
+     * If the group of the class doesn't exist, nothing was ever allocated
+     * from it.
+     */
+    if (tpool_groups[cls] == NULL || !group_contains(tpool_groups[cls], ptr))
+        abort();
+#endif
+
+    if (member != NULL) {
+        pool_steal_free(member, ptr);
+        return;
+    }
+
+    /*
+     * If the thread can't join the group, the chunk is donated to the first
+     * member, which exists because the chunk was allocated by one of them.
+     * Members are never removed from the group, so it can't go away.
+     */
+    donate_chain(ATOMIC_LOAD(&tpool_groups[cls]->members, ORDER_ACQUIRE),
+                 ptr,
+                 ptr);
+}
+
+/*
+ * Number of bytes that can be copied from a chunk of `size' bytes: the size of
+ * its class, or the size itself if it's too big for the classes.
+ */
+static size_t tpool_usable(size_t size) {
+    if (size > TPOOL_MAX_SZ)
+        return size;
+
+    return tpool_sizes[tpool_classes[(size + 15) / 16]];
+}
+
+void* tpool_realloc(void* ptr, size_t old_size, size_t new_size) {
+    size_t old_usable, new_usable;
+    void* result;
+
+    if (ptr == NULL)
+        return tpool_alloc(new_size);
+
+    /*
+     * The chunk stays in place if both sizes belong to the same class, or if
+     * a chunk that is too big for the classes shrinks without fitting in them.
+     */
+    old_usable = tpool_usable(old_size);
+    new_usable = tpool_usable(new_size);
+    if (old_size <= TPOOL_MAX_SZ && new_size <= TPOOL_MAX_SZ &&
+        old_usable == new_usable)
+        return ptr;
+    if (new_size > TPOOL_MAX_SZ && new_size <= old_size)
+        return ptr;
+
+    result = tpool_alloc(new_size);
+    if (result == NULL)
+        return NULL;
+
+    memcpy(result, ptr, (old_usable < new_usable) ? old_usable : new_usable);
+    tpool_free(ptr, old_size);
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * A return ring is a circular array of batches, where each batch is a linked
+ * list of chunks, linked through their first bytes. The freeing thread (the
+ * producer) builds a batch, stores it in the `tail' slot and increments the
+ * `tail'; the owner of the pool (the consumer) frees the batches from the
+ * `head' to the `tail' and then increments the `head'.
+ *
+ * Each side only writes its own index, and keeps a copy of the other index,
+ * which is only read again when the ring seems full or empty. The data of each
+ * side is in a different cache line, so they don't slow each other down.
+ *
+ * If the ring is full, the producer keeps adding chunks to its current batch,
+ * so it never has to wait for the consumer.
+ */
+struct PoolRing {
+    /* Only written by the producer */
+    ATOMIC(size_t) tail;
+    size_t cached_head;
+    void* batch;
+    size_t batch_len;
+    char padding1[LIBPOOL_CACHE_LINE_SZ];
+
+    /* Only written by the consumer */
+    ATOMIC(size_t) head;
+    size_t cached_tail;
+    char padding2[LIBPOOL_CACHE_LINE_SZ];
+
+    /* Read-only after `pool_ring_new' */
+    Pool* pool;
+    void** slots;
+    size_t mask;
+    size_t batch_sz;
+    pthread_t owner;
+
+    /* List of open rings, see `fork_child' */
+    PoolRing* next;
+    PoolRing* prev;
+};
+
+static PoolRing* rings = NULL;
+
+/*
+ * Return a chain of chunks to the pool, reading each link before `pool_free'
+ * overwrites it. Returns the number of chunks.
+ */
+static size_t free_chain(Pool* pool, void* chunk) {
+    void* next;
+    size_t n;
+
+    for (n = 0; chunk != NULL; n++) {
+        next = *(void**)chunk;
+        pool_free(pool, chunk);
+        chunk = next;
+    }
+
+    return n;
+}
+
+PoolRing* pool_ring_new(Pool* pool, size_t ring_sz, size_t batch_sz) {
+    PoolRing* ring;
+    size_t slots_sz;
+
+    if (pool == NULL || ring_sz == 0 || batch_sz == 0)
+        return NULL;
+
+    for (slots_sz = 1; slots_sz < ring_sz; slots_sz *= 2)
+        if (slots_sz > (size_t)-1 / 2 / sizeof(void*))
+            return NULL;
+
+    ring = pool_ext_alloc(sizeof(PoolRing));
+    if (ring == NULL)
+        return NULL;
+
+    ring->slots = pool_ext_alloc(slots_sz * sizeof(void*));
+    if (ring->slots == NULL) {
+        pool_ext_free(ring);
+        return NULL;
+    }
+
+    ring->cached_head = 0;
+    ring->batch       = NULL;
+    ring->batch_len   = 0;
+    ring->cached_tail = 0;
+    ATOMIC_STORE(&ring->tail, 0, ORDER_RELAXED);
+    ATOMIC_STORE(&ring->head, 0, ORDER_RELAXED);
+    ring->pool        = pool;
+    ring->mask        = slots_sz - 1;
+    ring->batch_sz    = batch_sz;
+    ring->owner       = pthread_self();
+
+    pool_thread_init();
+    global_lock();
+    ring->prev = NULL;
+    ring->next = rings;
+    if (rings != NULL)
+        rings->prev = ring;
+    rings = ring;
+    global_unlock();
+
+    return ring;
+}
+
+void pool_ring_close(PoolRing* ring) {
+    if (ring == NULL)
+        return;
+
+    global_lock();
+    if (ring->prev != NULL)
+        ring->prev->next = ring->next;
+    else
+        rings = ring->next;
+    if (ring->next != NULL)
+        ring->next->prev = ring->prev;
+    global_unlock();
+
+    pool_ring_drain(ring);
+    free_chain(ring->pool, ring->batch);
+
+    pool_ext_free(ring->slots);
+    pool_ext_free(ring);
+}
+
+/*
+ * Running out of free chunks is the normal way of noticing that the ring has to
+ * be drained, so the pool only counts as exhausted if draining didn't help.
+ */
+void* pool_ring_alloc(PoolRing* ring) {
+    void* result;
+
+    result = pool_try_alloc(ring->pool);
+    if (result == NULL) {
+        pool_ring_drain(ring);
+        result = pool_alloc(ring->pool);
+    }
+
+    return result;
+}
+
+size_t pool_ring_drain(PoolRing* ring) {
+    size_t head;
+    size_t n;
+
+    head = ATOMIC_LOAD(&ring->head, ORDER_RELAXED);
+    if (head == ring->cached_tail) {
+        ring->cached_tail = ATOMIC_LOAD(&ring->tail, ORDER_ACQUIRE);
+        if (head == ring->cached_tail)
+            return 0;
+    }
+
+    for (n = 0; head != ring->cached_tail; head++)
+        n += free_chain(ring->pool, ring->slots[head & ring->mask]);
+
+    /* The slots can't be reused by the producer until the batches are freed */
+    ATOMIC_STORE(&ring->head, head, ORDER_RELEASE);
+
+    return n;
+}
+
+void pool_ring_free(PoolRing* ring, void* ptr) {
+    if (ptr == NULL)
+        return;
+
+    *(void**)ptr = ring->batch;
+    ring->batch  = ptr;
+
+    if (++ring->batch_len >= ring->batch_sz)
+        pool_ring_flush(ring);
+}
+
+bool pool_ring_flush(PoolRing* ring) {
+    size_t tail;
+
+    if (ring->batch == NULL)
+        return true;
+
+    tail = ATOMIC_LOAD(&ring->tail, ORDER_RELAXED);
+    if (tail - ring->cached_head > ring->mask) {
+        ring->cached_head = ATOMIC_LOAD(&ring->head, ORDER_ACQUIRE);
+        if (tail - ring->cached_head > ring->mask)
+            return false;
+    }
+
+    ring->slots[tail & ring->mask] = ring->batch;
+    ATOMIC_STORE(&ring->tail, tail + 1, ORDER_RELEASE);
+
+    ring->batch     = NULL;
+    ring->batch_len = 0;
+    return true;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Before forking, we make sure that no other thread is in the middle of
+ * changing the global state, freeing a batch of arrays in the reclaimer, or
+ * scavenging a pool, so the child gets a consistent copy of all of them.
+ *
+ * Only the thread that called `fork' exists in the child, so the reclaimer has
+ * to be started again when needed, and the free chunks cached by the members
+ * of other threads are donated, so the threads of the child can steal them
+ * when joining the groups. Similarly, if the calling thread owns a return
+ * ring, the chunks in it (including the batch that was never sent) are
+ * returned to its pool. The scavengers are not started again, since their
+ * pools belong to threads that might not exist in the child, but they still
+ * have to be closed. Note that the pools of the other threads must not be in
+ * use when forking, since there is no way of stopping them in the middle of an
+ * operation.
+ */
+static void fork_prepare(void) {
+    PoolScavenger* scavenger;
+
+    global_lock();
+
+    /* The reclaimer needs the lock of the core for freeing the batch */
+    pthread_mutex_lock(&reclaim_mutex);
+    while (reclaim_busy)
+        pthread_cond_wait(&reclaim_done, &reclaim_mutex);
+
+    /* The scavengers hold their own mutex while scavenging */
+    for (scavenger = scavengers; scavenger != NULL;
+         scavenger = scavenger->next)
+        pthread_mutex_lock(&scavenger->mutex);
+
+    pool_ext_lock();
+}
+
+static void fork_parent(void) {
+    PoolScavenger* scavenger;
+
+    pool_ext_unlock();
+    for (scavenger = scavengers; scavenger != NULL;
+         scavenger = scavenger->next)
+        pthread_mutex_unlock(&scavenger->mutex);
+    pthread_mutex_unlock(&reclaim_mutex);
+    global_unlock();
+}
+
+static void fork_child(void) {
+    PoolStealGroup* group;
+    PoolStealMember* member;
+    PoolRing* ring;
+    PoolScavenger* scavenger;
+
+    /*
+     * The mutexes are initialized again instead of unlocked, since the
+     * thread has a different ID in the child, and the condition variables
+     * could have waiters that don't exist anymore. The lock of the core, unless
+     * it's our own mutex, is simply released.
+     */
+    global_mutex_init();
+    if (pool_ext_unlock == core_unlock)
+        pthread_mutex_init(&core_mutex, NULL);
+    else
+        pool_ext_unlock();
+    pthread_mutex_init(&reclaim_mutex, NULL);
+    pthread_cond_init(&reclaim_work, NULL);
+    pthread_cond_init(&reclaim_done, NULL);
+    reclaim_started = false;
+
+    for (scavenger = scavengers; scavenger != NULL;
+         scavenger = scavenger->next) {
+        pthread_mutex_init(&scavenger->mutex, NULL);
+        pthread_cond_init(&scavenger->wake, NULL);
+        scavenger->running = false;
+    }
+
+    for (group = steal_groups; group != NULL; group = group->next) {
+        member = ATOMIC_LOAD(&group->members, ORDER_RELAXED);
+        for (; member != NULL; member = member->next) {
+            if (!ATOMIC_LOAD(&member->owned, ORDER_RELAXED) ||
+                pthread_equal(member->owner, pthread_self()))
+                continue;
+
+            donate_local(member);
+            ATOMIC_STORE(&member->owned, false, ORDER_RELAXED);
+        }
+    }
+
+    for (ring = rings; ring != NULL; ring = ring->next) {
+        if (!pthread_equal(ring->owner, pthread_self()))
+            continue;
+
+        pool_ring_drain(ring);
+        free_chain(ring->pool, ring->batch);
+        ring->batch     = NULL;
+        ring->batch_len = 0;
+    }
+}
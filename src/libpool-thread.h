@@ -0,0 +1,299 @@
+/*
+ * Copyright 2024 8dcc
+ *
+ * This program is part of libpool, a tiny (ANSI) C library for pool allocation.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef POOL_THREAD_H_
+#define POOL_THREAD_H_ 1
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "libpool.h"
+
+/*
+ * Optional module of libpool for multi-threaded programs. It depends on POSIX
+ * threads, and it must be compiled and linked along with `libpool.c'.
+ *
+ * Note that the pools themselves are still not thread-safe: each `Pool' must
+ * only be used by one thread at a time, unless stated otherwise.
+ */
+
+/*
+ * Group of per-thread pools that can steal free chunks from each other, and
+ * each of the threads that are part of it. See `pool_steal_group_new'.
+ */
+typedef struct PoolStealGroup PoolStealGroup;
+typedef struct PoolStealMember PoolStealMember;
+
+/*
+ * Channel for returning chunks to a pool from a single thread that doesn't own
+ * it. See `pool_ring_new'.
+ */
+typedef struct PoolRing PoolRing;
+
+/*
+ * Background thread that scavenges a pool periodically. See
+ * `pool_scavenger_new'.
+ */
+typedef struct PoolScavenger PoolScavenger;
+
+/*
+ * Prepare the library for programs with multiple threads. If `pool_ext_lock'
+ * and `pool_ext_unlock' are NULL (i.e. the core was not compiled with GCC or
+ * Clang), the global state of the library is protected with a mutex, so this
+ * function must be called before creating, expanding or closing pools from
+ * different threads at the same time. It's called automatically by
+ * `pool_close_async', `pool_steal_group_new' and `pool_ring_new'.
+ *
+ * It also installs `pthread_atfork' handlers, so the state of this module is
+ * still valid in the child after a `fork'. In the child, the free chunks cached
+ * by the steal group members of other threads are donated, so they can be
+ * stolen by the threads of the child, and the return rings owned by the
+ * calling thread are drained. The pools of other threads must not be in use
+ * while forking.
+ */
+void pool_thread_init(void);
+
+/*
+ * Close the specified `pool' without waiting for its memory to be freed.
+ *
+ * The pool is detached immediately, so it (and all data allocated from it)
+ * becomes unusable once this function returns, just like with `pool_close'.
+ * Its chunk arrays, however, are freed in batches by a background thread, so
+ * the caller doesn't have to wait for them.
+ *
+ * Notes:
+ *   - Allows NULL as the `pool' parameter.
+ *   - The `pool_ext_free' function must be thread-safe.
+ *   - If the background thread can't be started, the arrays are freed before
+ *     returning, just like with `pool_close'.
+ */
+void pool_close_async(Pool* pool);
+
+/*
+ * Close all the pools in the specified `group', along with the group itself,
+ * without waiting for their memory to be freed, just like `pool_close_async'.
+ * Allows NULL as the `group' parameter.
+ */
+void pool_group_close_async(PoolGroup* group);
+
+/*
+ * Wait until all the chunk arrays of the pools closed with `pool_close_async'
+ * or `pool_group_close_async' have been freed. Useful for an orderly shutdown.
+ */
+void pool_reclaim_flush(void);
+
+/*
+ * Start a background thread that calls `pool_scavenge' on the specified `pool'
+ * every `interval_ms' milliseconds, with the `max_bytes' argument, so the
+ * memory of the pool follows its load without changing the code that uses it.
+ *
+ * Since the pools are not thread-safe, the pool must be protected by the
+ * specified `mutex', which the thread takes while scavenging. If the mutex is
+ * already taken, that scavenge is skipped.
+ *
+ * Notes:
+ *   - If the thread can't be started, NULL is returned.
+ *   - The caller must free the returned pointer using `pool_scavenger_close',
+ *     before closing the pool or destroying the mutex.
+ *   - The `pool_ext_alloc' and `pool_ext_free' functions must be thread-safe.
+ *   - The thread is not started again in the child after a `fork', but the
+ *     scavenger must still be closed there.
+ */
+PoolScavenger* pool_scavenger_new(Pool* pool, pthread_mutex_t* mutex,
+                                  unsigned long interval_ms, size_t max_bytes);
+
+/*
+ * Stop the background thread of the specified `scavenger', waiting for the
+ * current scavenge to finish, and free the scavenger. Allows NULL as the
+ * `scavenger' parameter.
+ */
+void pool_scavenger_close(PoolScavenger* scavenger);
+
+/*
+ * Create a new group of per-thread pools, with chunks of `chunk_sz' bytes.
+ *
+ * Each thread joins the group with `pool_steal_join', which gives it a private
+ * pool. When a thread has many free chunks, it donates them in batches of
+ * `batch_sz' chunks to a lock-free stack, and when a thread runs out of free
+ * chunks, it steals the donations of the other threads before expanding its
+ * own pool. This way, the total memory stays bounded even if the chunks are
+ * allocated and freed by different threads.
+ *
+ * Notes:
+ *   - If the initialization fails, NULL is returned.
+ *   - The caller must free the returned pointer using `pool_steal_group_close'.
+ *   - The `pool_ext_alloc' and `pool_ext_free' functions must be thread-safe.
+ */
+PoolStealGroup* pool_steal_group_new(size_t chunk_sz, size_t batch_sz);
+
+/*
+ * Close all the pools of the specified `group', along with the group itself.
+ * All data allocated from the group becomes unusable, and no thread can be
+ * using it when this function is called. Allows NULL as the `group'
+ * parameter.
+ */
+void pool_steal_group_close(PoolStealGroup* group);
+
+/*
+ * Join the specified `group' from the calling thread. If another thread left
+ * the group, its pool is reused; otherwise, a new pool with `pool_sz' chunks is
+ * created. The pool is expanded by `pool_sz' chunks whenever there are no
+ * chunks left to steal. If the pool can't be created, NULL is returned.
+ *
+ * The returned member must only be used by the calling thread, until it calls
+ * `pool_steal_leave'.
+ */
+PoolStealMember* pool_steal_join(PoolStealGroup* group, size_t pool_sz);
+
+/*
+ * Leave the group of the specified `member', donating all its free chunks to
+ * the other members, including the ones of its pool that were never used. The
+ * member can't be used after this call, but its pool is not closed until the
+ * whole group is closed.
+ */
+void pool_steal_leave(PoolStealMember* member);
+
+/*
+ * Allocate a chunk from the specified `member'. If it has no free chunks left,
+ * it tries to steal them from the other members of its group, and then it
+ * expands its pool. If all of them fail, the exhaustion handler of the pool is
+ * called, just like in `pool_alloc' (see `pool_set_exhausted_handler').
+ */
+void* pool_steal_alloc(PoolStealMember* member);
+
+/*
+ * Free a chunk allocated by any member of the group of the specified `member'.
+ * Allows NULL as the `ptr' argument.
+ *
+ * Note that the flags of the pools (see `pool_set_flags') don't apply to the
+ * chunks freed with this function, since they stay in the member until they
+ * are allocated again or donated.
+ */
+void pool_steal_free(PoolStealMember* member, void* ptr);
+
+/*
+ * Return the pool of the specified `member', e.g. for setting its name or
+ * getting its statistics. It must not be used for allocating or freeing.
+ */
+Pool* pool_steal_get_pool(PoolStealMember* member);
+
+/*
+ * Allocate `size' bytes from the pool of the calling thread for that size,
+ * without any locks. Each thread has a pool for each size class, created the
+ * first time it allocates or frees a chunk of that class, and the pools of the
+ * same class steal free chunks from each other, just like the members of a
+ * steal group. If the allocation fails, NULL is returned.
+ *
+ * Notes:
+ *   - The returned pointer must be freed with `tpool_free', from any thread,
+ *     with the same `size'.
+ *   - Sizes larger than 1024 bytes are allocated with `pool_ext_alloc'.
+ *   - The pools of a thread are handed to the next threads when it exits, and
+ *     they are never closed.
+ */
+void* tpool_alloc(size_t size);
+
+/*
+ * Free a pointer returned by `tpool_alloc' with the same `size', which can be
+ * called from any thread. Allows NULL as the `ptr' argument.
+ *
+ * The `size' is only used for finding the class of the chunk, so nothing has to
+ * be looked up in the pools. If the module is compiled with `LIBPOOL_DEBUG'
+ * defined, the program is aborted if `ptr' is not a chunk of that class (see
+ * `pool_contains'), and the pools are expanded while holding a global lock.
+ * That check accepts chunks that are already free, so it doesn't detect double
+ * frees, and it changes the Valgrind state of the pools of other threads while
+ * it runs, so it's not meant to be combined with Valgrind.
+ */
+void tpool_free(void* ptr, size_t size);
+
+/*
+ * Resize the chunk at `ptr', which was allocated by `tpool_alloc' with
+ * `old_size' bytes, so it can hold `new_size' bytes. If both sizes belong to
+ * the same class, or if both are too big for the classes and the chunk
+ * shrinks, `ptr' is returned. Otherwise, a chunk of the new class is
+ * allocated, the contents are copied, and the old chunk is freed.
+ *
+ * Just like `realloc', if `ptr' is NULL this is equivalent to `tpool_alloc',
+ * and if the new chunk can't be allocated, NULL is returned and the old chunk
+ * is left untouched.
+ */
+void* tpool_realloc(void* ptr, size_t old_size, size_t new_size);
+
+/*
+ * Create a return ring for the specified `pool', with room for `ring_sz'
+ * batches of chunks, which is rounded up to a power of two.
+ *
+ * The ring connects two threads: the owner of the pool, which allocates the
+ * chunks with `pool_ring_alloc', and another thread that frees them with
+ * `pool_ring_free'. The freed chunks are sent back in batches of `batch_sz'
+ * chunks, and the owner reclaims them when the pool runs out of free chunks.
+ * Both sides are wait-free.
+ *
+ * Notes:
+ *   - If the initialization fails, NULL is returned.
+ *   - The caller must free the returned pointer using `pool_ring_close'.
+ *   - The pool is not closed along with the ring.
+ *   - It must be called by the owner of the pool.
+ */
+PoolRing* pool_ring_new(Pool* pool, size_t ring_sz, size_t batch_sz);
+
+/*
+ * Reclaim all the chunks in the specified `ring', including the batch that has
+ * not been sent yet, and free the ring itself. It must be called by the owner
+ * of the pool, once the other thread has stopped using the ring. Allows NULL
+ * as the `ring' parameter.
+ */
+void pool_ring_close(PoolRing* ring);
+
+/*
+ * Allocate a chunk from the pool of the specified `ring'. If the pool has no
+ * free chunks, the chunks in the ring are reclaimed first. If there are no
+ * chunks in the ring either, NULL is returned, and the pool counts as exhausted
+ * (see `PoolStats').
+ *
+ * Must only be called by the owner of the pool.
+ */
+void* pool_ring_alloc(PoolRing* ring);
+
+/*
+ * Return all the chunks in the specified `ring' to its pool, and return the
+ * number of reclaimed chunks. Must only be called by the owner of the pool.
+ */
+size_t pool_ring_drain(PoolRing* ring);
+
+/*
+ * Free a chunk allocated from the pool of the specified `ring'. The chunk is
+ * added to the current batch, which is sent to the owner when it's full. Allows
+ * NULL as the `ptr' argument.
+ *
+ * Must only be called by the thread on the other side of the ring.
+ */
+void pool_ring_free(PoolRing* ring, void* ptr);
+
+/*
+ * Send the current batch of the specified `ring' to the owner, even if it's not
+ * full. Returns false if the ring is full, in which case the batch is kept,
+ * and sent along with the following chunks.
+ *
+ * Must only be called by the thread on the other side of the ring.
+ */
+bool pool_ring_flush(PoolRing* ring);
+
+#endif /* POOL_THREAD_H_ */
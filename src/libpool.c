@@ -16,22 +16,187 @@
  * this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
+/*
+ * Mapping memory directly from the system (see `pool_ext_map') and releasing
+ * the memory of free chunks (see `pool_scavenge') is only supported on
+ * Unix-like systems, and only if the standard library is available.
+ */
+#if !defined(LIBPOOL_NO_STDLIB) && defined(__unix__)
+#define HAVE_MMAN 1
+#if !defined(LIBPOOL_NO_MADVISE)
+#define HAVE_MADVISE 1
+#endif
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE 1
+#endif
+#endif
+
+/*
+ * Non-temporal stores are used for zeroing big chunks in `pool_calloc', so they
+ * don't evict the rest of the data from the cache.
+ */
+#if !defined(LIBPOOL_NO_STDLIB) && defined(__SSE2__)
+#define HAVE_SSE2 1
+#endif
+
+/*
+ * Chunk arrays of at least this many bytes are allocated with `pool_ext_map',
+ * if it's not NULL.
+ */
+#if !defined(LIBPOOL_MAP_THRESHOLD)
+#define LIBPOOL_MAP_THRESHOLD (128 * 1024)
+#endif
+
+/*
+ * Chunks of at least this many bytes are zeroed with non-temporal stores.
+ */
+#if !defined(LIBPOOL_NT_ZERO_SZ)
+#define LIBPOOL_NT_ZERO_SZ (64 * 1024)
+#endif
+
+/*
+ * Pools with chunks of at least this many bytes use page-aligned chunks, in
+ * arrays mapped with `pool_ext_map'. See `pool_new'.
+ */
+#if !defined(LIBPOOL_LARGE_CHUNK_SZ)
+#define LIBPOOL_LARGE_CHUNK_SZ (64 * 1024)
+#endif
+
+/*
+ * Alignment of the memory returned by `pool_ext_alloc'. Small arrays that need
+ * a bigger alignment (up to a page) are over-allocated and aligned. See
+ * `pool_new_for'.
+ */
+#if !defined(LIBPOOL_ALLOC_ALIGN)
+#define LIBPOOL_ALLOC_ALIGN (2 * sizeof(void*))
+#endif
+
+/*
+ * If `LIBPOOL_NO_STATS' is defined, the usage counters of the pools (i.e. the
+ * number of allocations and frees, and the peak number of live chunks) are not
+ * updated by the fast paths. See `pool_get_stats'.
+ */
+
+/*
+ * Percentage of the memory limit of the cgroup of the process that is used as
+ * the default global budget, leaving the rest for the memory that is not used
+ * by the pools. See `pool_set_global_budget'.
+ */
+#if !defined(LIBPOOL_CGROUP_SHARE)
+#define LIBPOOL_CGROUP_SHARE 75
+#endif
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
-/* NOTE: Remember to change this path if you move the header */
+/* NOTE: Remember to change this path if you move the headers */
 #include "libpool.h"
+#include "libpool-internal.h"
 
 #if defined(LIBPOOL_NO_STDLIB)
 PoolAllocFuncPtr pool_ext_alloc = NULL;
 PoolFreeFuncPtr pool_ext_free   = NULL;
 #else
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 PoolAllocFuncPtr pool_ext_alloc = malloc;
 PoolFreeFuncPtr pool_ext_free   = free;
 #endif /* LIBPOOL_NO_STDLIB */
 
+#if defined(HAVE_MMAN)
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static void* default_map(size_t sz) {
+    void* result = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (result == MAP_FAILED) ? NULL : result;
+}
+
+static void default_unmap(void* ptr, size_t sz) {
+    munmap(ptr, sz);
+}
+
+static size_t page_size(void) {
+    static size_t result = 0;
+    long sz;
+
+    if (result == 0) {
+        sz     = sysconf(_SC_PAGESIZE);
+        result = (sz > 0) ? (size_t)sz : 4096;
+    }
+
+    return result;
+}
+
+PoolMapFuncPtr pool_ext_map     = default_map;
+PoolUnmapFuncPtr pool_ext_unmap = default_unmap;
+#else
+PoolMapFuncPtr pool_ext_map     = NULL;
+PoolUnmapFuncPtr pool_ext_unmap = NULL;
+
+#define page_size() 4096
+#endif /* HAVE_MMAN */
+
+#if defined(__GNUC__)
+/*
+ * The global state is protected by default with a small spin lock, built on
+ * the atomic builtins of GCC and Clang, so it can be used in ANSI C. It's only
+ * held for short periods, and never while calling user code.
+ */
+static char default_lock_flag = 0;
+
+static void default_lock(void) {
+    while (__atomic_test_and_set(&default_lock_flag, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&default_lock_flag, __ATOMIC_RELAXED)) {
+#if defined(HAVE_MMAN)
+            sched_yield();
+#endif
+        }
+    }
+}
+
+static void default_unlock(void) {
+    __atomic_clear(&default_lock_flag, __ATOMIC_RELEASE);
+}
+
+PoolLockFuncPtr pool_ext_lock   = default_lock;
+PoolLockFuncPtr pool_ext_unlock = default_unlock;
+#else
+PoolLockFuncPtr pool_ext_lock   = NULL;
+PoolLockFuncPtr pool_ext_unlock = NULL;
+#endif /* __GNUC__ */
+
+#define GLOBAL_LOCK()                \
+    do {                             \
+        if (pool_ext_lock != NULL)   \
+            pool_ext_lock();         \
+    } while (0)
+
+#define GLOBAL_UNLOCK()              \
+    do {                             \
+        if (pool_ext_unlock != NULL) \
+            pool_ext_unlock();       \
+    } while (0)
+
+#if defined(HAVE_SSE2)
+#include <emmintrin.h>
+#endif /* HAVE_SSE2 */
+
+/*
+ * ANSI C doesn't have `inline', so the helpers of the fast paths are forced
+ * inline with the extensions of GCC and Clang, when available.
+ */
+#if defined(__GNUC__)
+#define ALWAYS_INLINE __inline__ __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE
+#endif
+
 #if defined(LIBPOOL_NO_VALGRIND)
 #define VALGRIND_CREATE_MEMPOOL(a, b, c)
 #define VALGRIND_DESTROY_MEMPOOL(a)
@@ -54,12 +219,90 @@ PoolFreeFuncPtr pool_ext_free   = free;
  * number of them, one for each call to `pool_expand' plus the initial one from
  * `pool_new'. New pointers will be prepended to the linked list.
  */
-typedef struct ArrayStart ArrayStart;
 struct ArrayStart {
     ArrayStart* next;
     void* arr;
+    size_t nchunks;
+
+    /*
+     * Size of the mapping, or zero if it was allocated with `pool_ext_alloc'.
+     * In that case, `unaligned' is the pointer returned by `pool_ext_alloc',
+     * which can be before `arr' if the array was aligned.
+     */
+    size_t map_sz;
+    void* unaligned;
+
+    /*
+     * Size of the array, which can be bigger than its chunks, and number of
+     * chunks added by the granularity of the pool. See `pool_release_array'.
+     */
+    size_t bytes;
+    size_t slack;
+
+    /*
+     * Group whose budget is charged with the bytes of this array, if any. The
+     * bytes are only returned to the budgets when the array is actually freed,
+     * which can be after its pool was closed. See `pool_free_arrays'.
+     */
+    PoolGroup* group;
+};
+
+/*
+ * Linked list of runs of consecutive free chunks that are not part of the
+ * `free_chunk' list of the pool. It's used for:
+ *
+ *   - Chunk arrays that have never been used (see `pool_alloc'). In this case,
+ *     `zeroed' indicates that the whole array is filled with zeros.
+ *   - Chunks whose memory was released by `pool_scavenge'. Since the system
+ *     might have zeroed their memory, these chunks can't be part of the list
+ *     of free chunks (we can't store the `.next' pointer inside them). In this
+ *     case, `zeroed' indicates that the chunks were zeroed by `pool_free', so
+ *     only their first `sizeof(void*)' bytes might not be zero.
+ */
+typedef struct ChunkRun ChunkRun;
+struct ChunkRun {
+    ChunkRun* next;
+    char* start;
+    size_t nchunks;
+    bool zeroed;
 };
 
+/*
+ * Chunk array of a pool restored by `pool_restore', along with its address in
+ * the process that called `pool_snapshot'. See `pool_relocate'.
+ */
+typedef struct Relocation {
+    uintptr_t old_start;
+    char* start;
+    size_t bytes;
+} Relocation;
+
+/*
+ * Fields of `Pool' used by every call to `pool_alloc' and `pool_free'. They are
+ * stored in a union with a whole cache line, so the compiler adds the padding
+ * after them.
+ */
+typedef struct PoolHotFields {
+    void* free_chunk;
+    char* bump;
+    char* bump_end;
+    size_t chunk_sz;
+    size_t allocs;
+    size_t frees;
+    size_t interval_peak;
+    unsigned flags;
+    bool bump_zeroed;
+} PoolHotFields;
+
+typedef union PoolHot {
+    PoolHotFields f;
+    char line[LIBPOOL_CACHE_LINE_SZ];
+} PoolHot;
+
+/* The fast fields must fit in a single cache line */
+typedef char HotFieldsCheck
+  [(sizeof(PoolHotFields) <= LIBPOOL_CACHE_LINE_SZ) ? 1 : -1];
+
 /*
  * The actual pool structure, which contains a pointer to the first chunk, and
  * a pointer to the start of the linked list of free chunks.
@@ -67,201 +310,3156 @@ struct ArrayStart {
  * We need to store the first chunk for freeing the actual `Chunk' array once
  * the user is done with the pool.
  *
- * The user is able to allocate with O(1) time, because the `Pool.free_chunk'
- * pointer always points to a free chunk without needing to iterate anything.
+ * The user is able to allocate with O(1) time, because the `free_chunk' pointer
+ * always points to a free chunk without needing to iterate anything. The
+ * `free_tail' pointer is only maintained in `POOL_FIFO' pools, where it's used
+ * for appending chunks to the list, and it's only valid if the list is not
+ * empty. It's recomputed by `pool_set_flags' when the flag is set.
+ *
+ * The fields used by every call to `pool_alloc' and `pool_free' come first, in
+ * `hot', and the structure is aligned to a cache line (see `pool_init'), so
+ * they fill a single line. The rest of the fields are only used by the slow
+ * paths, and they start in the next line, so they don't slow down the fast
+ * paths of this pool, and the fast paths of the pool don't slow down other
+ * data either.
  */
 struct Pool {
-    void* free_chunk;
+    PoolHot hot;
+
+    void* free_tail;
     ArrayStart* array_starts;
-    size_t chunk_sz;
+
+    /*
+     * True if the chunks are page-aligned, and their size is a multiple of the
+     * page size. See `pool_new'.
+     */
+    bool large_chunks;
+
+    /*
+     * If not zero, the alignment of every chunk array, which is bigger than the
+     * alignment of `pool_ext_alloc'. See `pool_new_for'.
+     */
+    size_t array_align;
+
+    /*
+     * The `bump' and `bump_end' fields delimit the region of a chunk array that
+     * has never been used, and `bump_zeroed' indicates whether it's known to be
+     * filled with zeros. The rest of the unused arrays are stored in the
+     * `untouched' list.
+     */
+    ChunkRun* untouched;
+
+    /*
+     * Usage statistics, returned by `pool_get_stats', along with the `allocs'
+     * and `frees' fields. The number of live chunks is not stored, since it's
+     * always `allocs - frees'.
+     */
+    const char* name;
+    size_t initial_sz;
+    size_t capacity;
+    size_t peak_live;
+    size_t expansions;
+    size_t exhaustions;
+
+    /*
+     * Function called when the pool runs out of chunks, and whether it's
+     * running. See `pool_set_exhausted_handler'.
+     */
+    PoolExhaustedFuncPtr exhausted_fn;
+    void* exhausted_ctx;
+    bool in_exhausted_fn;
+
+    /*
+     * Doubly linked list of open pools, only used when the statistics are being
+     * written to the `LIBPOOL_STATS' file.
+     */
+    Pool* prev_open;
+    Pool* next_open;
+
+    /*
+     * Total size of the chunk arrays of this pool, and the maximum value it can
+     * reach, or zero if there is no limit. See `pool_set_budget'.
+     */
+    size_t array_bytes;
+    size_t budget;
+
+    /*
+     * Group of the pool, if any, and doubly linked list of the pools in that
+     * group. See `pool_group_add'.
+     */
+    PoolGroup* group;
+    Pool* group_prev;
+    Pool* group_next;
+
+    /*
+     * If not zero, the size of the arrays added by `pool_expand' is rounded up
+     * to a multiple of this value, and they are aligned to it. The number of
+     * chunks added because of this rounding is stored in `slack_chunks'. See
+     * `pool_set_granularity'.
+     */
+    size_t granularity;
+    size_t slack_chunks;
+
+    /*
+     * Chunks released by `pool_scavenge'. The highest number of live chunks
+     * since the last scavenge is stored in `interval_peak'.
+     */
+    ChunkRun* released;
+    size_t released_chunks;
+
+    /*
+     * If the pool was restored from a snapshot, the old and new addresses of
+     * its arrays, sorted by their old address. See `pool_restore'.
+     */
+    Relocation* relocations;
+    size_t nrelocations;
+
+    /* Memory returned by `pool_ext_alloc' for this structure */
+    void* unaligned;
+};
+
+/*
+ * A group of pools, which are closed together, and whose chunk arrays share a
+ * budget. The group is not protected with Valgrind, only its pools.
+ *
+ * The `narrays' field is the number of chunk arrays charged to the group. Once
+ * the group is closed, it's freed along with the last of those arrays.
+ */
+struct PoolGroup {
+    Pool* pools;
+    const char* name;
+    size_t array_bytes;
+    size_t budget;
+    size_t narrays;
+    bool closed;
 };
 
 /*----------------------------------------------------------------------------*/
 
 /*
- * We use an exteran allocation function (by default `malloc', but can be
- * overwritten by user) to allocate a `Pool' structure, and the array of
- * chunks. You can think of a chunk as the following union:
- *
- *     union Chunk {
- *         union Chunk* next_free;
- *         char user_data[CHUNK_SZ];
- *     };
- *
- * In this hypothetical union, the data in a non-free chunk will be overwritten
- * by the user, in the `user_data' array, where `CHUNK_SZ' was specified by the
- * caller of `pool_new'. However, if the chunk is free, the union uses the
- * `Chunk.next_free' pointer to build a linked list of available chunks, shown
- * below.
+ * Total size of the chunk arrays of all pools, and the maximum value it can
+ * reach, or zero if there is no limit. See `pool_set_global_budget'.
  *
- * This is explained in more detail (and with diagrams) in my blog article:
- * https://8dcc.github.io/programming/pool-allocator.html
+ * Unless the user sets the global budget explicitly, it's initialized from the
+ * memory limit of the cgroup of the process, if there is one.
  */
-Pool* pool_new(size_t pool_sz, size_t chunk_sz) {
-    Pool* pool;
-    char* arr;
-    size_t i;
+static size_t global_array_bytes       = 0;
+static size_t global_budget            = 0;
+static bool global_budget_initialized  = false;
+static PoolPressureFuncPtr pressure_fn = NULL;
+static void* pressure_ctx              = NULL;
 
-    if (pool_sz == 0 || chunk_sz < sizeof(void*))
-        return NULL;
+#if !defined(LIBPOOL_NO_STDLIB) && defined(__linux__)
+#define CGROUP_ROOT    "/sys/fs/cgroup"
+#define CGROUP_PATH_SZ 512
 
-    pool = pool_ext_alloc(sizeof(Pool));
-    if (pool == NULL)
-        return NULL;
+/*
+ * Read a `memory.max' file of a cgroup (v2), or return zero if there is no
+ * limit, or if it can't be read.
+ */
+static size_t read_memory_max(const char* path) {
+    FILE* fp;
+    char buf[32];
+    char* end;
+    unsigned long result;
 
-    pool->array_starts = pool_ext_alloc(sizeof(ArrayStart));
-    if (pool->array_starts == NULL) {
-        pool_ext_free(pool);
-        return NULL;
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return 0;
+
+    if (fgets(buf, sizeof(buf), fp) == NULL) {
+        fclose(fp);
+        return 0;
     }
+    fclose(fp);
 
-    arr = pool_ext_alloc(pool_sz * chunk_sz);
-    if (arr == NULL) {
-        pool_ext_free(pool->array_starts);
-        pool_ext_free(pool);
-        return NULL;
+    /* The file contains "max" if there is no limit */
+    result = strtoul(buf, &end, 10);
+    if (end == buf)
+        return 0;
+
+    return (size_t)result;
+}
+
+/*
+ * Return the memory limit of the cgroup of the process, which is listed in
+ * `/proc/self/cgroup', or zero if there is no limit, or if it can't be read.
+ * The limits of its ancestors also apply, so the smallest one is used.
+ */
+static size_t cgroup_memory_max(void) {
+    FILE* fp;
+    char line[CGROUP_PATH_SZ];
+    char path[sizeof(CGROUP_ROOT) + CGROUP_PATH_SZ + sizeof("/memory.max")];
+    char* dir;
+    char* slash;
+    size_t len, limit, result;
+
+    fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL)
+        return 0;
+
+    /* With cgroup v2, the line of the process is "0::/path/of/the/cgroup" */
+    dir = NULL;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "0::/", 4) == 0) {
+            dir = line + 3;
+            break;
+        }
     }
+    fclose(fp);
 
-    /*
-     * Build the linked list. Use the first N bytes of the free chunks for
-     * storing the (hypothetical) `.next' pointer. This is why `chunk_sz' must
-     * be greater or equal than `sizeof(void*)'.
-     */
-    for (i = 0; i < pool_sz - 1; i++)
-        *(void**)(arr + i * chunk_sz) = arr + (i + 1) * chunk_sz;
-    *(void**)(arr + (pool_sz - 1) * chunk_sz) = NULL;
+    if (dir == NULL)
+        return 0;
 
-    pool->free_chunk         = arr;
-    pool->array_starts->next = NULL;
-    pool->array_starts->arr  = arr;
-    pool->chunk_sz           = chunk_sz;
+    /* If the line didn't fit in the buffer, the path is not complete */
+    len = strcspn(dir, "\n");
+    if (dir[len] != '\n')
+        return 0;
+    dir[len] = '\0';
 
-    VALGRIND_MAKE_MEM_NOACCESS(arr, pool_sz * chunk_sz);
-    VALGRIND_MAKE_MEM_NOACCESS(pool->array_starts, sizeof(ArrayStart));
-    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
-    VALGRIND_CREATE_MEMPOOL(pool, 0, 0);
+    result = 0;
+    for (;;) {
+        strcpy(path, CGROUP_ROOT);
+        if (dir[1] != '\0')
+            strcat(path, dir);
+        strcat(path, "/memory.max");
 
-    return pool;
+        limit = read_memory_max(path);
+        if (limit != 0 && (result == 0 || limit < result))
+            result = limit;
+
+        if (dir[1] == '\0')
+            break;
+
+        slash = strrchr(dir, '/');
+        if (slash == dir)
+            slash++;
+        *slash = '\0';
+    }
+
+    return result;
 }
+#else
+#define cgroup_memory_max() 0
+#endif
 
 /*
- * Expanding the pool simply means allocating a new chunk array, and prepending
- * it to the `pool->free_chunk' linked list.
- *
- * 1. Allocate a new `ArrayStart' structure.
- * 2. Allocate a new chunk array with the specified size.
- * 3. Link the new array together, just like in `pool_new'.
- * 4. Prepend the new chunk array to the existing linked list of free chunks.
- * 5. Prepend the new `ArrayStart' to the existing linked list of array starts.
+ * Initialize the global budget from the memory limit of the cgroup, unless it
+ * was already set. The files are read without holding the lock.
  */
-bool pool_expand(Pool* pool, size_t extra_sz) {
-    ArrayStart* array_start;
-    char* extra_arr;
-    size_t i;
+static void init_global_budget(void) {
+    bool initialized;
+    size_t budget;
 
-    if (pool == NULL || extra_sz <= 0)
-        return false;
+    GLOBAL_LOCK();
+    initialized = global_budget_initialized;
+    GLOBAL_UNLOCK();
 
-    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    if (initialized)
+        return;
 
-    array_start = pool_ext_alloc(sizeof(ArrayStart));
-    if (array_start == NULL)
-        return false;
+    budget = cgroup_memory_max() / 100 * LIBPOOL_CGROUP_SHARE;
 
-    extra_arr = pool_ext_alloc(extra_sz * pool->chunk_sz);
-    if (extra_arr == NULL) {
-        pool_ext_free(array_start);
-        return false;
+    GLOBAL_LOCK();
+    if (!global_budget_initialized) {
+        global_budget             = budget;
+        global_budget_initialized = true;
     }
+    GLOBAL_UNLOCK();
+}
 
-    for (i = 0; i < extra_sz - 1; i++)
-        *(void**)(extra_arr + i * pool->chunk_sz) =
-          extra_arr + (i + 1) * pool->chunk_sz;
+/*
+ * Check if `bytes' more bytes of chunk arrays would fit in the budget of the
+ * specified pool (which can be NULL when creating a new pool), in the budget of
+ * its group, and in the global budget.
+ */
+static bool budget_allows(Pool* pool, size_t bytes) {
+    PoolGroup* group;
 
-    *(void**)(extra_arr + (extra_sz - 1) * pool->chunk_sz) = pool->free_chunk;
-    pool->free_chunk                                       = extra_arr;
+    if (pool != NULL && pool->budget != 0 &&
+        (bytes > pool->budget || pool->array_bytes > pool->budget - bytes))
+        return false;
 
-    array_start->arr   = extra_arr;
-    array_start->next  = pool->array_starts;
-    pool->array_starts = array_start;
+    group = (pool != NULL) ? pool->group : NULL;
+    if (group != NULL && group->budget != 0 &&
+        (bytes > group->budget || group->array_bytes > group->budget - bytes))
+        return false;
 
-    VALGRIND_MAKE_MEM_NOACCESS(extra_arr, extra_sz * pool->chunk_sz);
-    VALGRIND_MAKE_MEM_NOACCESS(array_start, sizeof(ArrayStart));
-    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    if (global_budget != 0 &&
+        (bytes > global_budget || global_array_bytes > global_budget - bytes))
+        return false;
 
     return true;
 }
 
 /*
- * When closing the pool, we traverse the list of `ArrayStart' structures, which
- * contain the base address of each chunk array. We free the array, and then the
- * `ArrayStart' structure itself. Lastly, we free the `Pool' structure.
+ * Map `sz' bytes aligned to `align' bytes, which must be a power of two. If the
+ * alignment is bigger than a page, we map more memory than needed, and unmap
+ * the excess at both sides. Both `sz' and `align' must be multiples of the page
+ * size.
  */
-void pool_close(Pool* pool) {
-    ArrayStart* array_start;
-    ArrayStart* next;
+static void* map_aligned(size_t sz, size_t align) {
+    char* raw;
+    char* result;
+    size_t head;
 
-    if (pool == NULL)
-        return;
+    if (align <= page_size())
+        return pool_ext_map(sz);
 
-    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    if (sz > (size_t)-1 - align)
+        return NULL;
 
-    array_start = pool->array_starts;
-    while (array_start != NULL) {
-        VALGRIND_MAKE_MEM_DEFINED(array_start, sizeof(ArrayStart));
+    raw = pool_ext_map(sz + align);
+    if (raw == NULL)
+        return NULL;
 
-        next = array_start->next;
-        pool_ext_free(array_start->arr);
-        pool_ext_free(array_start);
-        array_start = next;
-    }
+    result = (char*)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+    head   = result - raw;
+    if (head != 0)
+        pool_ext_unmap(raw, head);
+    pool_ext_unmap(result + sz, align - head);
 
-    VALGRIND_DESTROY_MEMPOOL(pool);
-    pool_ext_free(pool);
+    return result;
 }
 
-/*----------------------------------------------------------------------------*/
-
 /*
- * The allocation process is very simple and fast. Since the `pool' has a
- * pointer to the start of a linked list of free (hypothetical) `Chunk'
- * structures, we can just return that pointer, and set the new start of the
- * linked list to the second item of the old list.
+ * Allocate `sz' bytes with `pool_ext_alloc', aligned to `align' bytes, which
+ * must be a power of two. If the alignment is bigger than the one of
+ * `pool_ext_alloc', but not bigger than a page, we allocate more memory than
+ * needed, and skip the unaligned part. Bigger alignments are ignored. The
+ * pointer that must be passed to `pool_ext_free' is stored in `unaligned'.
  */
-void* pool_alloc(Pool* pool) {
-    void* result;
+static void* alloc_aligned(size_t sz, size_t align, void** unaligned) {
+    char* raw;
+    size_t extra;
 
-    if (pool == NULL)
-        return NULL;
-    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
-
-    if (pool->free_chunk == NULL)
+    extra = (align > LIBPOOL_ALLOC_ALIGN && align <= page_size())
+              ? align - LIBPOOL_ALLOC_ALIGN
+              : 0;
+    if (sz > (size_t)-1 - extra)
         return NULL;
-    VALGRIND_MAKE_MEM_DEFINED(pool->free_chunk, sizeof(void**));
 
-    result           = pool->free_chunk;
-    pool->free_chunk = *(void**)pool->free_chunk;
+    raw        = pool_ext_alloc(sz + extra);
+    *unaligned = raw;
+    if (raw == NULL || extra == 0)
+        return raw;
 
-    VALGRIND_MEMPOOL_ALLOC(pool, result, pool->chunk_sz);
-    VALGRIND_MAKE_MEM_NOACCESS(pool->free_chunk, sizeof(void**));
-    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    return (void*)(((uintptr_t)raw + extra) & ~(uintptr_t)(align - 1));
+}
 
-    return result;
+/*
+ * Ask the system to back the specified mapping with huge pages, if possible.
+ * Failing is not a problem, since it's only a hint.
+ */
+static void advise_huge_pages(void* start, size_t sz) {
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+    madvise(start, sz, MADV_HUGEPAGE);
+#else
+    (void)start;
+    (void)sz;
+#endif
 }
 
 /*
- * Note that, since we are using a linked list, the caller doesn't need to free
- * in the same order that used when allocating.
+ * Allocate a chunk array of `bytes' bytes for the specified pool, if the
+ * budgets allow it. If they don't, the pressure handler is called (without
+ * holding the lock) so it can release memory from other pools, and the budgets
+ * are checked once more.
+ *
+ * The bytes are charged to the global budget and to the group of the pool, if
+ * any, until the array is freed with `pool_free_arrays'.
+ *
+ * Big arrays are mapped directly from the system, if possible. In that case,
+ * the size of the mapping is stored in `map_sz', and the array is filled with
+ * zeros. Otherwise, `map_sz' is set to zero, and the pointer that must be
+ * freed is stored in `unaligned'. If `must_map' is true, the array is only
+ * allocated if it can be mapped.
+ *
+ * If `align' is not zero, the array is aligned to that many bytes. Arrays with
+ * an alignment bigger than a page are always mapped if possible, and mapped
+ * arrays with an alignment use huge pages if the system supports them. Smaller
+ * arrays with a small alignment are allocated with `alloc_aligned', so they
+ * don't need a mapping of their own.
  */
-void pool_free(Pool* pool, void* ptr) {
-    if (pool == NULL || ptr == NULL)
-        return;
+static void* array_alloc(Pool* pool, size_t bytes, bool must_map, size_t align,
+                         size_t* map_sz, void** unaligned) {
+    PoolPressureFuncPtr func;
+    void* ctx;
+    void* arr;
 
-    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    init_global_budget();
 
-    *(void**)ptr     = pool->free_chunk;
-    pool->free_chunk = ptr;
+    GLOBAL_LOCK();
 
-    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
-    VALGRIND_MEMPOOL_FREE(pool, ptr);
+    if (!budget_allows(pool, bytes)) {
+        func = pressure_fn;
+        ctx  = pressure_ctx;
+        GLOBAL_UNLOCK();
+
+        if (func == NULL || !func(pool, bytes, ctx))
+            return NULL;
+
+        GLOBAL_LOCK();
+        if (!budget_allows(pool, bytes)) {
+            GLOBAL_UNLOCK();
+            return NULL;
+        }
+    }
+
+    /* Reserve the bytes, so the array can be allocated without the lock */
+    global_array_bytes += bytes;
+    if (pool != NULL && pool->group != NULL) {
+        pool->group->array_bytes += bytes;
+        pool->group->narrays++;
+    }
+    GLOBAL_UNLOCK();
+
+    arr        = NULL;
+    *map_sz    = 0;
+    *unaligned = NULL;
+    if (pool_ext_map != NULL &&
+        (must_map || bytes >= LIBPOOL_MAP_THRESHOLD || align > page_size())) {
+        arr = (align != 0) ? map_aligned(bytes, align) : pool_ext_map(bytes);
+        if (arr != NULL) {
+            *map_sz = bytes;
+            if (align != 0)
+                advise_huge_pages(arr, bytes);
+        }
+    }
+
+    if (arr == NULL && !must_map)
+        arr = alloc_aligned(bytes, align, unaligned);
+    if (arr == NULL) {
+        GLOBAL_LOCK();
+        global_array_bytes -= bytes;
+        if (pool != NULL && pool->group != NULL) {
+            pool->group->array_bytes -= bytes;
+            pool->group->narrays--;
+        }
+        GLOBAL_UNLOCK();
+    }
+
+    return arr;
+}
+
+/*
+ * Tell the system that it can reclaim the specified pages, which must be
+ * page-aligned. Their contents become undefined until they are written again.
+ * Returns true on success.
+ */
+static bool release_pages(void* start, size_t sz) {
+#if defined(HAVE_MADVISE)
+#if defined(MADV_FREE)
+    /* Not supported before Linux 4.5 */
+    static bool madv_free_works = true;
+
+    if (madv_free_works) {
+        if (madvise(start, sz, MADV_FREE) == 0)
+            return true;
+        madv_free_works = false;
+    }
+#endif /* MADV_FREE */
+    return madvise(start, sz, MADV_DONTNEED) == 0;
+#else
+    (void)start;
+    (void)sz;
+    return false;
+#endif /* HAVE_MADVISE */
+}
+
+/*
+ * Fill `sz' bytes with zeros. Big regions are zeroed with non-temporal stores
+ * when possible, since the caller is not necessarily going to read them soon.
+ */
+static void zero_bytes(char* dst, size_t sz) {
+#if defined(HAVE_SSE2)
+    __m128i zero;
+
+    if (sz >= LIBPOOL_NT_ZERO_SZ) {
+        zero = _mm_setzero_si128();
+        for (; ((uintptr_t)dst & 15) != 0; dst++, sz--)
+            *dst = 0;
+
+        for (; sz >= 64; dst += 64, sz -= 64) {
+            _mm_stream_si128((__m128i*)dst, zero);
+            _mm_stream_si128((__m128i*)(dst + 16), zero);
+            _mm_stream_si128((__m128i*)(dst + 32), zero);
+            _mm_stream_si128((__m128i*)(dst + 48), zero);
+        }
+        _mm_sfence();
+    }
+#endif /* HAVE_SSE2 */
+
+#if defined(LIBPOOL_NO_STDLIB)
+    while (sz-- > 0)
+        *dst++ = 0;
+#else
+    memset(dst, 0, sz);
+#endif /* LIBPOOL_NO_STDLIB */
+}
+
+/*----------------------------------------------------------------------------*/
+
+#if !defined(LIBPOOL_NO_STDLIB)
+/*
+ * If the `LIBPOOL_STATS' environment variable is set, the statistics of each
+ * pool are appended to that file, as a JSON object per line, when the pool is
+ * closed. The pools that are still open when the program exits are written by
+ * an `atexit' handler.
+ *
+ * The environment is only checked once, when the first pool is created.
+ */
+static bool stats_initialized = false;
+static FILE* stats_file       = NULL;
+static Pool* stats_open_pools = NULL;
+
+/* Write a JSON string, or `null', escaping the necessary characters. */
+static void stats_write_str(const char* str) {
+    if (str == NULL) {
+        fputs("null", stats_file);
+        return;
+    }
+
+    fputc('"', stats_file);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\')
+            fprintf(stats_file, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(stats_file, "\\u%04x", (unsigned)*str);
+        else
+            fputc(*str, stats_file);
+    }
+    fputc('"', stats_file);
+}
+
+static void stats_write(Pool* pool, bool closed) {
+    fputs("{\"name\":", stats_file);
+    stats_write_str(pool->name);
+    fprintf(stats_file,
+            ",\"chunk_sz\":%lu,\"pool_sz\":%lu,\"capacity\":%lu"
+            ",\"live\":%lu,\"peak_live\":%lu,\"expansions\":%lu"
+            ",\"allocs\":%lu,\"frees\":%lu,\"exhaustions\":%lu"
+            ",\"array_bytes\":%lu,\"slack\":%lu,\"closed\":%s}\n",
+            (unsigned long)pool->hot.f.chunk_sz,
+            (unsigned long)pool->initial_sz,
+            (unsigned long)pool->capacity,
+            (unsigned long)(pool->hot.f.allocs - pool->hot.f.frees),
+            (unsigned long)pool->peak_live,
+            (unsigned long)pool->expansions,
+            (unsigned long)pool->hot.f.allocs,
+            (unsigned long)pool->hot.f.frees,
+            (unsigned long)pool->exhaustions,
+            (unsigned long)pool->array_bytes,
+            (unsigned long)pool->slack_chunks,
+            closed ? "true" : "false");
+    fflush(stats_file);
+}
+
+static void stats_atexit(void) {
+    Pool* pool;
+
+    GLOBAL_LOCK();
+
+    for (pool = stats_open_pools; pool != NULL; pool = pool->next_open) {
+        VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+        stats_write(pool, false);
+        VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    }
+
+    fclose(stats_file);
+    stats_file = NULL;
+
+    GLOBAL_UNLOCK();
+}
+
+static void stats_init(void) {
+    const char* path;
+
+    stats_initialized = true;
+
+    path = getenv("LIBPOOL_STATS");
+    if (path == NULL || *path == '\0')
+        return;
+
+    stats_file = fopen(path, "a");
+    if (stats_file == NULL)
+        return;
+
+    if (atexit(stats_atexit) != 0) {
+        fclose(stats_file);
+        stats_file = NULL;
+    }
+}
+
+/*
+ * Register a new pool in the list of open pools. The caller is responsible for
+ * making the pool memory accessible.
+ */
+static void stats_register(Pool* pool) {
+    if (!stats_initialized)
+        stats_init();
+
+    pool->prev_open = NULL;
+    pool->next_open = NULL;
+    if (stats_file == NULL)
+        return;
+
+    pool->next_open = stats_open_pools;
+    if (stats_open_pools != NULL) {
+        VALGRIND_MAKE_MEM_DEFINED(stats_open_pools, sizeof(Pool));
+        stats_open_pools->prev_open = pool;
+        VALGRIND_MAKE_MEM_NOACCESS(stats_open_pools, sizeof(Pool));
+    }
+    stats_open_pools = pool;
+}
+
+/*
+ * Write the statistics of a pool that is being closed, and remove it from the
+ * list of open pools.
+ */
+static void stats_unregister(Pool* pool) {
+    if (stats_file == NULL)
+        return;
+
+    stats_write(pool, true);
+
+    if (pool->prev_open != NULL) {
+        VALGRIND_MAKE_MEM_DEFINED(pool->prev_open, sizeof(Pool));
+        pool->prev_open->next_open = pool->next_open;
+        VALGRIND_MAKE_MEM_NOACCESS(pool->prev_open, sizeof(Pool));
+    } else {
+        stats_open_pools = pool->next_open;
+    }
+
+    if (pool->next_open != NULL) {
+        VALGRIND_MAKE_MEM_DEFINED(pool->next_open, sizeof(Pool));
+        pool->next_open->prev_open = pool->prev_open;
+        VALGRIND_MAKE_MEM_NOACCESS(pool->next_open, sizeof(Pool));
+    }
+}
+#else
+#define stats_register(POOL)
+#define stats_unregister(POOL)
+#endif /* LIBPOOL_NO_STDLIB */
+
+/*
+ * Remove a pool from the list of its group, if any. Its arrays are still
+ * charged to the group, see `charge_arrays'. The caller is responsible for
+ * making the pool memory accessible, and for holding the global lock.
+ */
+static void group_unlink(Pool* pool) {
+    if (pool->group == NULL)
+        return;
+
+    if (pool->group_prev != NULL) {
+        VALGRIND_MAKE_MEM_DEFINED(pool->group_prev, sizeof(Pool));
+        pool->group_prev->group_next = pool->group_next;
+        VALGRIND_MAKE_MEM_NOACCESS(pool->group_prev, sizeof(Pool));
+    } else {
+        pool->group->pools = pool->group_next;
+    }
+
+    if (pool->group_next != NULL) {
+        VALGRIND_MAKE_MEM_DEFINED(pool->group_next, sizeof(Pool));
+        pool->group_next->group_prev = pool->group_prev;
+        VALGRIND_MAKE_MEM_NOACCESS(pool->group_next, sizeof(Pool));
+    }
+
+    pool->group      = NULL;
+    pool->group_prev = NULL;
+    pool->group_next = NULL;
+}
+
+/*
+ * Charge the chunk arrays of the specified pool to `group', which can be NULL,
+ * instead of the group they were charged to. The caller is responsible for
+ * making the pool memory accessible, and for holding the global lock.
+ */
+static void charge_arrays(Pool* pool, PoolGroup* group) {
+    ArrayStart* array;
+    ArrayStart* next;
+
+    for (array = pool->array_starts; array != NULL; array = next) {
+        VALGRIND_MAKE_MEM_DEFINED(array, sizeof(ArrayStart));
+
+        if (array->group != NULL) {
+            array->group->array_bytes -= array->bytes;
+            array->group->narrays--;
+        }
+
+        array->group = group;
+        if (group != NULL) {
+            group->array_bytes += array->bytes;
+            group->narrays++;
+        }
+
+        next = array->next;
+        VALGRIND_MAKE_MEM_NOACCESS(array, sizeof(ArrayStart));
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * Add a new chunk array with `nchunks' chunks to the specified pool.
+ *
+ * The chunks are not linked together when the array is added. If the current
+ * region of untouched chunks (i.e. from `bump' to `bump_end') is
+ * empty, the new array becomes that region. Otherwise, it's stored in the
+ * `Pool.untouched' list, so it can be used later.
+ *
+ * If the pool has a granularity, the arrays added after the first one are
+ * rounded up to it, and the array gets as many extra chunks as fit in the
+ * rounded size.
+ */
+static bool add_array(Pool* pool, size_t nchunks) {
+    ArrayStart* array_start;
+    ChunkRun* run;
+    char* arr;
+    size_t bytes, align, slack;
+    size_t map_sz;
+    void* unaligned;
+
+    if (nchunks > (size_t)-1 / pool->hot.f.chunk_sz)
+        return false;
+
+    bytes = nchunks * pool->hot.f.chunk_sz;
+    align = pool->array_align;
+    slack = 0;
+    if (pool->granularity != 0 && pool->array_starts != NULL) {
+        if (bytes > (size_t)-1 - (pool->granularity - 1))
+            return false;
+
+        if (pool->granularity > align)
+            align = pool->granularity;
+        bytes   = (bytes + pool->granularity - 1) & ~(pool->granularity - 1);
+        slack   = bytes / pool->hot.f.chunk_sz - nchunks;
+        nchunks = bytes / pool->hot.f.chunk_sz;
+    }
+
+    array_start = pool_ext_alloc(sizeof(ArrayStart));
+    if (array_start == NULL)
+        return false;
+
+    run = NULL;
+    if (pool->hot.f.bump != pool->hot.f.bump_end) {
+        run = pool_ext_alloc(sizeof(ChunkRun));
+        if (run == NULL) {
+            pool_ext_free(array_start);
+            return false;
+        }
+    }
+
+    /* If the pool has no arrays, it's being created by `pool_new' */
+    arr = array_alloc((pool->array_starts == NULL) ? NULL : pool,
+                      bytes,
+                      pool->large_chunks,
+                      align,
+                      &map_sz,
+                      &unaligned);
+    if (arr == NULL) {
+        pool_ext_free(run);
+        pool_ext_free(array_start);
+        return false;
+    }
+
+    if (run == NULL) {
+        pool->hot.f.bump        = arr;
+        pool->hot.f.bump_end    = arr + nchunks * pool->hot.f.chunk_sz;
+        pool->hot.f.bump_zeroed = (map_sz != 0);
+    } else {
+        run->start      = arr;
+        run->nchunks    = nchunks;
+        run->zeroed     = (map_sz != 0);
+        run->next       = pool->untouched;
+        pool->untouched = run;
+    }
+
+    array_start->arr       = arr;
+    array_start->nchunks   = nchunks;
+    array_start->map_sz    = map_sz;
+    array_start->unaligned = unaligned;
+    array_start->bytes     = bytes;
+    array_start->slack     = slack;
+    array_start->group     = (pool->array_starts == NULL) ? NULL : pool->group;
+    array_start->next      = pool->array_starts;
+    pool->array_starts     = array_start;
+
+    pool->capacity += nchunks;
+    pool->slack_chunks += slack;
+    pool->array_bytes += bytes;
+
+    VALGRIND_MAKE_MEM_NOACCESS(arr, bytes);
+    VALGRIND_MAKE_MEM_NOACCESS(array_start, sizeof(ArrayStart));
+
+    return true;
+}
+
+/*
+ * Allocate a `Pool' structure without any chunk arrays, and initialize its
+ * fields. Used by `pool_create' and `pool_restore'.
+ */
+static Pool* pool_init(size_t chunk_sz, bool large_chunks, size_t array_align) {
+    Pool* pool;
+    void* raw;
+
+    /* Align the structure to a cache line, see `Pool' */
+    pool = alloc_aligned(sizeof(Pool), LIBPOOL_CACHE_LINE_SZ, &raw);
+    if (pool == NULL)
+        return NULL;
+
+    pool->hot.f.free_chunk    = NULL;
+    pool->hot.f.chunk_sz      = chunk_sz;
+    pool->hot.f.flags         = 0;
+    pool->hot.f.bump          = NULL;
+    pool->hot.f.bump_end      = NULL;
+    pool->hot.f.bump_zeroed   = false;
+    pool->hot.f.allocs        = 0;
+    pool->hot.f.frees         = 0;
+    pool->hot.f.interval_peak = 0;
+
+    pool->unaligned    = raw;
+    pool->free_tail    = NULL;
+    pool->array_starts = NULL;
+    pool->large_chunks = large_chunks;
+    pool->array_align  = (array_align > LIBPOOL_ALLOC_ALIGN) ? array_align : 0;
+    pool->untouched    = NULL;
+
+    pool->name        = NULL;
+    pool->initial_sz  = 0;
+    pool->capacity    = 0;
+    pool->peak_live   = 0;
+    pool->expansions  = 0;
+    pool->exhaustions = 0;
+
+    pool->exhausted_fn    = NULL;
+    pool->exhausted_ctx   = NULL;
+    pool->in_exhausted_fn = false;
+
+    pool->array_bytes = 0;
+    pool->budget      = 0;
+
+    pool->group      = NULL;
+    pool->group_prev = NULL;
+    pool->group_next = NULL;
+
+    pool->granularity  = 0;
+    pool->slack_chunks = 0;
+
+    pool->released        = NULL;
+    pool->released_chunks = 0;
+
+    pool->relocations  = NULL;
+    pool->nrelocations = 0;
+
+    return pool;
+}
+
+/*
+ * We use an exteran allocation function (by default `malloc', but can be
+ * overwritten by user) to allocate a `Pool' structure, and the array of
+ * chunks. You can think of a chunk as the following union:
+ *
+ *     union Chunk {
+ *         union Chunk* next_free;
+ *         char user_data[CHUNK_SZ];
+ *     };
+ *
+ * In this hypothetical union, the data in a non-free chunk will be overwritten
+ * by the user, in the `user_data' array, where `CHUNK_SZ' was specified by the
+ * caller of `pool_new'. However, if the chunk is free, the union uses the
+ * `Chunk.next_free' pointer to build a linked list of available chunks, shown
+ * below. This is why `chunk_sz' must be greater or equal than `sizeof(void*)'.
+ *
+ * If the chunks are big enough, their size is rounded up to a multiple of the
+ * page size, and the arrays are always mapped directly from the system, so
+ * every chunk starts at a page boundary. This allows releasing the memory of
+ * each free chunk individually, see `POOL_RELEASE_ON_FREE'.
+ *
+ * If `array_align' is bigger than the alignment of `pool_ext_alloc', the arrays
+ * are aligned to it, either by over-allocating them or by mapping them (see
+ * `array_alloc' and `pool_new_for').
+ *
+ * This is explained in more detail (and with diagrams) in my blog article:
+ * https://8dcc.github.io/programming/pool-allocator.html
+ */
+static Pool* pool_create(size_t pool_sz, size_t chunk_sz, size_t array_align) {
+    Pool* pool;
+    bool large_chunks;
+
+    if (pool_sz == 0 || chunk_sz < sizeof(void*))
+        return NULL;
+
+    large_chunks = (chunk_sz >= LIBPOOL_LARGE_CHUNK_SZ && pool_ext_map != NULL);
+    if (large_chunks) {
+        if (chunk_sz > (size_t)-1 - page_size())
+            return NULL;
+        chunk_sz = (chunk_sz + page_size() - 1) & ~(page_size() - 1);
+    }
+
+    pool = pool_init(chunk_sz, large_chunks, array_align);
+    if (pool == NULL)
+        return NULL;
+
+    pool->initial_sz = pool_sz;
+
+    if (!add_array(pool, pool_sz)) {
+        pool_ext_free(pool->unaligned);
+        return NULL;
+    }
+
+    GLOBAL_LOCK();
+    stats_register(pool);
+    GLOBAL_UNLOCK();
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    VALGRIND_CREATE_MEMPOOL(pool, 0, 0);
+
+    return pool;
+}
+
+Pool* pool_new(size_t pool_sz, size_t chunk_sz) {
+    return pool_create(pool_sz, chunk_sz, 0);
+}
+
+/*
+ * Round `n' up to a multiple of `align', which must be a power of two. Returns
+ * zero on overflow.
+ */
+static size_t round_up(size_t n, size_t align) {
+    if (n > (size_t)-1 - (align - 1))
+        return 0;
+
+    return (n + align - 1) & ~(align - 1);
+}
+
+/* Round `n' up to a power of two. Returns zero on overflow. */
+static size_t round_up_pow2(size_t n) {
+    size_t result;
+
+    for (result = 1; result < n; result *= 2)
+        if (result > (size_t)-1 / 2)
+            return 0;
+
+    return result;
+}
+
+/*
+ * The possible strides are:
+ *
+ *   - Packed: the size rounded up to the alignment, so there is no padding
+ *     other than the one required by the alignment, but objects can straddle
+ *     two cache lines.
+ *   - Cache line: if the object fits in a cache line, the stride is a power of
+ *     two; otherwise, it's a multiple of the cache line size. In both cases,
+ *     the arrays are aligned so no object straddles more cache lines than
+ *     necessary.
+ *   - Power of two: the size rounded up to a power of two, and aligned to it
+ *     (up to the page size).
+ *
+ * The automatic layout uses the cache line stride if it adds at most 25%
+ * padding, and the packed stride otherwise. Then, the number of chunks is
+ * increased so the array fills its last page.
+ */
+bool pool_layout(size_t pool_sz, size_t size, size_t align, int kind,
+                 PoolLayout* layout) {
+    size_t packed, line, pow2, stride, bytes, total;
+
+    if (pool_sz == 0 || size == 0 || layout == NULL ||
+        (align & (align - 1)) != 0)
+        return false;
+
+    /* Free chunks store a pointer at their start */
+    if (align < sizeof(void*))
+        align = sizeof(void*);
+
+    packed = round_up((size < sizeof(void*)) ? sizeof(void*) : size, align);
+    if (packed == 0)
+        return false;
+
+    line = (packed <= LIBPOOL_CACHE_LINE_SZ)
+             ? round_up_pow2(packed)
+             : round_up(packed, LIBPOOL_CACHE_LINE_SZ);
+    pow2 = round_up_pow2(packed);
+
+    if (kind == POOL_LAYOUT_AUTO)
+        kind = (line != 0 && line - size <= size / 4) ? POOL_LAYOUT_CACHE_LINE
+                                                      : POOL_LAYOUT_PACKED;
+
+    switch (kind) {
+        case POOL_LAYOUT_PACKED:
+            stride = packed;
+            break;
+        case POOL_LAYOUT_CACHE_LINE:
+            stride = line;
+            if (align < stride && align < LIBPOOL_CACHE_LINE_SZ)
+                align = (stride < LIBPOOL_CACHE_LINE_SZ) ? stride
+                                                         : LIBPOOL_CACHE_LINE_SZ;
+            break;
+        case POOL_LAYOUT_POW2:
+            stride = pow2;
+            if (align < stride && align < page_size())
+                align = (stride < page_size()) ? stride : page_size();
+            break;
+        default:
+            return false;
+    }
+    if (stride == 0)
+        return false;
+
+    /* Same as `pool_create' */
+    if (stride >= LIBPOOL_LARGE_CHUNK_SZ && pool_ext_map != NULL) {
+        stride = round_up(stride, page_size());
+        if (stride == 0)
+            return false;
+        if (align < page_size())
+            align = page_size();
+    }
+
+    if (pool_sz > (size_t)-1 / stride)
+        return false;
+
+    total = round_up(pool_sz * stride, page_size());
+    if (total == 0)
+        return false;
+    pool_sz = total / stride;
+    bytes   = pool_sz * stride;
+
+    layout->kind        = kind;
+    layout->stride      = stride;
+    layout->align       = align;
+    layout->pool_sz     = pool_sz;
+    layout->array_bytes = bytes;
+    layout->waste       = (total - bytes) + pool_sz * (stride - size);
+
+    return true;
+}
+
+Pool* pool_new_for(size_t pool_sz, size_t size, size_t align, int kind,
+                   PoolLayout* layout) {
+    PoolLayout tmp;
+
+    if (layout == NULL)
+        layout = &tmp;
+
+    if (!pool_layout(pool_sz, size, align, kind, layout))
+        return NULL;
+
+    return pool_create(layout->pool_sz, layout->stride, layout->align);
+}
+
+/*
+ * Expanding the pool simply means adding a new chunk array, which will be used
+ * once the free chunks of the pool run out. The new array is always the first
+ * one of the list, so its `ArrayStart' is also the handle returned by
+ * `pool_expand_array', which is never dereferenced by the caller.
+ */
+PoolArray* pool_expand_array(Pool* pool, size_t extra_sz) {
+    PoolArray* result;
+
+    if (pool == NULL || extra_sz <= 0)
+        return NULL;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    result = NULL;
+    if (add_array(pool, extra_sz)) {
+        pool->expansions++;
+        result = (PoolArray*)pool->array_starts;
+    }
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+
+    return result;
+}
+
+bool pool_expand(Pool* pool, size_t extra_sz) {
+    return pool_expand_array(pool, extra_sz) != NULL;
+}
+
+/*
+ * Remove the chunks between `start' and `end' from the list of free chunks,
+ * returning how many were removed. The links are only written when the next
+ * chunk of the list was removed.
+ */
+static size_t drop_free_chunks(Pool* pool, char* start, char* end) {
+    char* chunk;
+    char* next;
+    char* prev;
+    char* prev_next;
+    size_t n;
+
+    prev      = NULL;
+    prev_next = NULL;
+    n         = 0;
+    for (chunk = pool->hot.f.free_chunk; chunk != NULL; chunk = next) {
+        VALGRIND_MAKE_MEM_DEFINED(chunk, sizeof(void*));
+        next = *(void**)chunk;
+        VALGRIND_MAKE_MEM_NOACCESS(chunk, sizeof(void*));
+
+        if (chunk >= start && chunk < end) {
+            /* Registered, so it can be unregistered with the live chunks */
+            VALGRIND_MEMPOOL_ALLOC(pool, chunk, pool->hot.f.chunk_sz);
+            n++;
+            continue;
+        }
+
+        if (prev == NULL) {
+            pool->hot.f.free_chunk = chunk;
+        } else if (prev_next != chunk) {
+            VALGRIND_MAKE_MEM_DEFINED(prev, sizeof(void*));
+            *(void**)prev = chunk;
+            VALGRIND_MAKE_MEM_NOACCESS(prev, sizeof(void*));
+        }
+        prev      = chunk;
+        prev_next = next;
+    }
+
+    if (prev == NULL) {
+        pool->hot.f.free_chunk = NULL;
+    } else if (prev_next != NULL) {
+        VALGRIND_MAKE_MEM_DEFINED(prev, sizeof(void*));
+        *(void**)prev = NULL;
+        VALGRIND_MAKE_MEM_NOACCESS(prev, sizeof(void*));
+    }
+    pool->free_tail = prev;
+
+    return n;
+}
+
+/*
+ * Remove the runs between `start' and `end' from the specified list, returning
+ * the number of chunks in them. A run never spans more than one array.
+ */
+static size_t drop_runs(Pool* pool, ChunkRun** link, char* start, char* end) {
+    ChunkRun* run;
+    size_t n;
+
+    n = 0;
+    while (*link != NULL) {
+        run = *link;
+        if (run->start < start || run->start >= end) {
+            link = &run->next;
+            continue;
+        }
+
+#if !defined(LIBPOOL_NO_VALGRIND)
+        if (RUNNING_ON_VALGRIND) {
+            size_t i;
+            for (i = 0; i < run->nchunks; i++)
+                VALGRIND_MEMPOOL_ALLOC(pool,
+                                       run->start + i * pool->hot.f.chunk_sz,
+                                       pool->hot.f.chunk_sz);
+        }
+#endif
+
+        n += run->nchunks;
+        *link = run->next;
+        pool_ext_free(run);
+    }
+
+    (void)pool;
+    return n;
+}
+
+/*
+ * Update the usage counters after allocating or freeing `n' chunks, unless
+ * `LIBPOOL_NO_STATS' is defined.
+ */
+static void count_alloc(Pool* pool, size_t n) {
+#if defined(LIBPOOL_NO_STATS)
+    (void)pool;
+    (void)n;
+#else
+    /*
+     * The peak since the last scavenge can't be higher than the global peak,
+     * so the second check is only needed when the first one succeeds.
+     */
+    pool->hot.f.allocs += n;
+    if (pool->hot.f.allocs - pool->hot.f.frees > pool->hot.f.interval_peak) {
+        pool->hot.f.interval_peak = pool->hot.f.allocs - pool->hot.f.frees;
+        if (pool->hot.f.interval_peak > pool->peak_live)
+            pool->peak_live = pool->hot.f.interval_peak;
+    }
+#endif /* LIBPOOL_NO_STATS */
+}
+
+static void count_free(Pool* pool, size_t n) {
+#if defined(LIBPOOL_NO_STATS)
+    (void)pool;
+    (void)n;
+#else
+    pool->hot.f.frees += n;
+#endif /* LIBPOOL_NO_STATS */
+}
+
+/*
+ * Releasing an array removes all of its free chunks from the pool: the ones in
+ * the list of free chunks, the untouched and released runs, and the current
+ * untouched region. The rest of its chunks are live, and they are counted as
+ * freed. Then, the memory of the array is freed, just like when closing the
+ * pool.
+ *
+ * When running in Valgrind, the free chunks of the array are registered while
+ * they are removed, so every chunk of the array can be unregistered at the end
+ * without knowing which ones were live.
+ */
+void pool_release_array(Pool* pool, PoolArray* handle) {
+    ArrayStart* array;
+    ArrayStart* prev;
+    ArrayStart* cur;
+    ArrayStart* next;
+    char* start;
+    char* end;
+    size_t nfree, i;
+
+    if (pool == NULL || handle == NULL)
+        return;
+
+    array = (ArrayStart*)handle;
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    /* Ignore the arrays of other pools */
+    prev = NULL;
+    for (cur = pool->array_starts; cur != array; cur = next) {
+        if (cur == NULL) {
+            VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+            return;
+        }
+
+        VALGRIND_MAKE_MEM_DEFINED(cur, sizeof(ArrayStart));
+        next = cur->next;
+        VALGRIND_MAKE_MEM_NOACCESS(cur, sizeof(ArrayStart));
+        prev = cur;
+    }
+
+    VALGRIND_MAKE_MEM_DEFINED(array, sizeof(ArrayStart));
+    if (prev == NULL) {
+        pool->array_starts = array->next;
+    } else {
+        VALGRIND_MAKE_MEM_DEFINED(prev, sizeof(ArrayStart));
+        prev->next = array->next;
+        VALGRIND_MAKE_MEM_NOACCESS(prev, sizeof(ArrayStart));
+    }
+
+    start = array->arr;
+    end   = start + array->nchunks * pool->hot.f.chunk_sz;
+
+    nfree = drop_free_chunks(pool, start, end);
+    nfree += drop_runs(pool, &pool->untouched, start, end);
+    i = drop_runs(pool, &pool->released, start, end);
+    pool->released_chunks -= i;
+    nfree += i;
+
+    if (pool->hot.f.bump >= start && pool->hot.f.bump < end) {
+#if !defined(LIBPOOL_NO_VALGRIND)
+        if (RUNNING_ON_VALGRIND) {
+            char* chunk;
+            for (chunk = pool->hot.f.bump; chunk < pool->hot.f.bump_end;
+                 chunk += pool->hot.f.chunk_sz)
+                VALGRIND_MEMPOOL_ALLOC(pool, chunk, pool->hot.f.chunk_sz);
+        }
+#endif
+        nfree += (size_t)(pool->hot.f.bump_end - pool->hot.f.bump) /
+                 pool->hot.f.chunk_sz;
+        pool->hot.f.bump     = NULL;
+        pool->hot.f.bump_end = NULL;
+    }
+
+#if !defined(LIBPOOL_NO_VALGRIND)
+    if (RUNNING_ON_VALGRIND)
+        for (i = 0; i < array->nchunks; i++)
+            VALGRIND_MEMPOOL_FREE(pool, start + i * pool->hot.f.chunk_sz);
+#endif
+
+    /* The pointers into the array can't be relocated anymore */
+    for (i = 0; i < pool->nrelocations; i++) {
+        if (pool->relocations[i].start == start) {
+            pool->nrelocations--;
+            for (; i < pool->nrelocations; i++)
+                pool->relocations[i] = pool->relocations[i + 1];
+            break;
+        }
+    }
+
+    count_free(pool, array->nchunks - nfree);
+    pool->capacity -= array->nchunks;
+    pool->slack_chunks -= (array->slack < pool->slack_chunks)
+                            ? array->slack
+                            : pool->slack_chunks;
+    pool->array_bytes -= array->bytes;
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+
+    array->next = NULL;
+    pool_free_arrays(array, 1);
+}
+
+/*
+ * When closing the pool, we detach it, and then free each of its chunk arrays
+ * along with their `ArrayStart' structures.
+ */
+void pool_close(Pool* pool) {
+    ArrayStart* arrays;
+
+    if (pool == NULL)
+        return;
+
+    arrays = pool_detach(pool);
+    while (arrays != NULL)
+        arrays = pool_free_arrays(arrays, (size_t)-1);
+}
+
+/*
+ * Detaching the pool means removing it from the global lists and its group, and
+ * freeing the `Pool' structure itself. The linked list of `ArrayStart'
+ * structures is returned, so the caller can free the actual memory whenever it
+ * wants. The arrays are still charged to the budgets until then.
+ */
+ArrayStart* pool_detach(Pool* pool) {
+    ArrayStart* arrays;
+    ChunkRun* run;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    GLOBAL_LOCK();
+    stats_unregister(pool);
+    group_unlink(pool);
+    GLOBAL_UNLOCK();
+
+    while (pool->untouched != NULL) {
+        run             = pool->untouched;
+        pool->untouched = run->next;
+        pool_ext_free(run);
+    }
+
+    while (pool->released != NULL) {
+        run            = pool->released;
+        pool->released = run->next;
+        pool_ext_free(run);
+    }
+
+    pool_ext_free(pool->relocations);
+    arrays = pool->array_starts;
+
+    VALGRIND_DESTROY_MEMPOOL(pool);
+    pool_ext_free(pool->unaligned);
+
+    return arrays;
+}
+
+/*
+ * We traverse the list of `ArrayStart' structures, which contain the base
+ * address of each chunk array. We return its bytes to the budgets, free the
+ * array, and then the `ArrayStart' structure itself. The rest of the list is
+ * returned.
+ *
+ * If the array was the last one charged to a closed group, the group is freed
+ * as well.
+ */
+ArrayStart* pool_free_arrays(ArrayStart* arrays, size_t max) {
+    ArrayStart* next;
+    PoolGroup* group;
+
+    while (arrays != NULL && max-- > 0) {
+        VALGRIND_MAKE_MEM_DEFINED(arrays, sizeof(ArrayStart));
+
+        group = arrays->group;
+        GLOBAL_LOCK();
+        global_array_bytes -= arrays->bytes;
+        if (group != NULL) {
+            group->array_bytes -= arrays->bytes;
+            group->narrays--;
+            if (!group->closed || group->narrays != 0)
+                group = NULL;
+        }
+        GLOBAL_UNLOCK();
+        pool_ext_free(group);
+
+        next = arrays->next;
+        if (arrays->map_sz != 0)
+            pool_ext_unmap(arrays->arr, arrays->map_sz);
+        else
+            pool_ext_free(arrays->unaligned);
+        pool_ext_free(arrays);
+        arrays = next;
+    }
+
+    return arrays;
+}
+
+/*
+ * Used for building a single list from the arrays of different pools. Note that
+ * the `dst' list needs to be traversed.
+ */
+ArrayStart* pool_concat_arrays(ArrayStart* dst, ArrayStart* src) {
+    ArrayStart* last;
+    ArrayStart* next;
+
+    if (dst == NULL)
+        return src;
+
+    last = dst;
+    for (;;) {
+        VALGRIND_MAKE_MEM_DEFINED(last, sizeof(ArrayStart));
+        next = last->next;
+        if (next == NULL)
+            break;
+        VALGRIND_MAKE_MEM_NOACCESS(last, sizeof(ArrayStart));
+        last = next;
+    }
+
+    last->next = src;
+    VALGRIND_MAKE_MEM_NOACCESS(last, sizeof(ArrayStart));
+
+    return dst;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * When there are no free chunks left, the chunks released by `pool_scavenge'
+ * are reused before failing. One run of chunks is linked again, writing the
+ * `.next' pointers into the (possibly zeroed) memory. If the pool zeroes its
+ * free chunks, but this run was released before, its chunks are zeroed now.
+ */
+static void reuse_released(Pool* pool) {
+    ChunkRun* run;
+    char* chunk;
+    size_t i;
+
+    run = pool->released;
+    VALGRIND_MAKE_MEM_DEFINED(run->start, run->nchunks * pool->hot.f.chunk_sz);
+
+    for (i = 0; i < run->nchunks; i++) {
+        chunk = run->start + i * pool->hot.f.chunk_sz;
+        if ((pool->hot.f.flags & POOL_ZERO_ON_FREE) && !run->zeroed)
+            zero_bytes(chunk, pool->hot.f.chunk_sz);
+
+        *(void**)chunk = (i + 1 < run->nchunks) ? chunk + pool->hot.f.chunk_sz
+                                                : NULL;
+    }
+
+    VALGRIND_MAKE_MEM_NOACCESS(run->start, run->nchunks * pool->hot.f.chunk_sz);
+
+    pool->hot.f.free_chunk = run->start;
+    pool->released         = run->next;
+    pool->released_chunks -= run->nchunks;
+
+    pool->free_tail = run->start + (run->nchunks - 1) * pool->hot.f.chunk_sz;
+    pool_ext_free(run);
+}
+
+/*
+ * Called when both the list of free chunks and the current untouched region
+ * are empty. If there are more untouched arrays, the next one becomes the
+ * current region. Otherwise, the released chunks are linked into the list of
+ * free chunks. Returns false if there are no chunks left.
+ */
+static bool refill(Pool* pool) {
+    ChunkRun* run;
+
+    run = pool->untouched;
+    if (run != NULL) {
+        pool->hot.f.bump        = run->start;
+        pool->hot.f.bump_end    = run->start +
+                                  run->nchunks * pool->hot.f.chunk_sz;
+        pool->hot.f.bump_zeroed = run->zeroed;
+        pool->untouched         = run->next;
+        pool_ext_free(run);
+        return true;
+    }
+
+    if (pool->released != NULL) {
+        reuse_released(pool);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Called when `refill' fails. If the pool has an exhaustion handler, it's
+ * called, and the pool is refilled again. Returns false if there are still no
+ * chunks left, which is counted in the statistics.
+ */
+static bool handle_exhaustion(Pool* pool) {
+    PoolExhaustedFuncPtr func;
+    void* ctx;
+
+    func = pool->exhausted_fn;
+    ctx  = pool->exhausted_ctx;
+    if (func != NULL && !pool->in_exhausted_fn) {
+        /* The handler can call any function of the pool */
+        pool->in_exhausted_fn = true;
+        VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+        func(pool, ctx);
+        VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+        pool->in_exhausted_fn = false;
+
+        if (pool->hot.f.free_chunk != NULL ||
+            pool->hot.f.bump != pool->hot.f.bump_end || refill(pool))
+            return true;
+    }
+
+    pool->exhaustions++;
+    return false;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/*
+ * The allocation process is very simple and fast. Since the `pool' has a
+ * pointer to the start of a linked list of free (hypothetical) `Chunk'
+ * structures, we can just return that pointer, and set the new start of the
+ * linked list to the second item of the old list.
+ *
+ * However, the chunk arrays are not linked when they are added to the pool. If
+ * the list of free chunks is empty, the chunk is taken from the untouched
+ * region of an array, by just incrementing the `bump' pointer. This way,
+ * creating or expanding a pool doesn't need to write to all of its memory, and
+ * chunks are only linked once they are freed.
+ *
+ * This function takes the chunk for `pool_alloc', `pool_calloc' and
+ * `pool_alloc_n', which are responsible for making the pool accessible, and for
+ * counting the allocation. Returns NULL if the pool has no chunks left, after
+ * calling its exhaustion handler if `handle' is true. The number of bytes at
+ * the start of the chunk that might not be zero is stored in `dirty', see
+ * `pool_calloc'.
+ */
+static ALWAYS_INLINE char* take_chunk(Pool* pool, bool handle, size_t* dirty) {
+    char* result;
+
+    result = pool->hot.f.free_chunk;
+    if (result == NULL && pool->hot.f.bump == pool->hot.f.bump_end) {
+        if (!refill(pool) && !(handle && handle_exhaustion(pool)))
+            return NULL;
+        result = pool->hot.f.free_chunk;
+    }
+
+    if (result != NULL) {
+        VALGRIND_MAKE_MEM_DEFINED(result, sizeof(void**));
+        pool->hot.f.free_chunk = *(void**)result;
+        *dirty = (pool->hot.f.flags & POOL_ZERO_ON_FREE) ? sizeof(void*)
+                                                         : pool->hot.f.chunk_sz;
+    } else {
+        result = pool->hot.f.bump;
+        pool->hot.f.bump += pool->hot.f.chunk_sz;
+        *dirty = (pool->hot.f.bump_zeroed) ? 0 : pool->hot.f.chunk_sz;
+    }
+
+    VALGRIND_MEMPOOL_ALLOC(pool, result, pool->hot.f.chunk_sz);
+    return result;
+}
+
+void* pool_alloc(Pool* pool) {
+    void* result;
+    size_t dirty;
+
+    if (pool == NULL)
+        return NULL;
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    result = take_chunk(pool, true, &dirty);
+    if (result != NULL)
+        count_alloc(pool, 1);
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    return result;
+}
+
+void* pool_try_alloc(Pool* pool) {
+    void* result;
+    size_t dirty;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    result = take_chunk(pool, false, &dirty);
+    if (result != NULL)
+        count_alloc(pool, 1);
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    return result;
+}
+
+/*
+ * Allocating a zeroed chunk works just like `pool_alloc', but we keep track of
+ * how many bytes of the chunk might not be zero:
+ *
+ *   - Untouched chunks are already zeroed if their array was mapped directly
+ *     from the system, which is the case for big arrays.
+ *   - If the pool zeroes the chunks when freeing them, only the `.next'
+ *     pointer of the free chunks needs to be zeroed.
+ *   - Otherwise, the whole chunk needs to be zeroed.
+ */
+void* pool_calloc(Pool* pool) {
+    char* result;
+    size_t dirty;
+
+    if (pool == NULL)
+        return NULL;
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    result = take_chunk(pool, true, &dirty);
+    if (result == NULL) {
+        VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+        return NULL;
+    }
+
+    count_alloc(pool, 1);
+
+    zero_bytes(result, dirty);
+    VALGRIND_MAKE_MEM_DEFINED(result, pool->hot.f.chunk_sz);
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+
+    return result;
+}
+
+/*
+ * Note that, since we are using a linked list, the caller doesn't need to free
+ * in the same order that used when allocating.
+ *
+ * Usually, the chunk is pushed to the start of the list, so it's the first one
+ * to be reused. In `POOL_FIFO' pools, it's appended to the end of the list
+ * instead, so the chunks are reused in the same order they were freed.
+ */
+void pool_free(Pool* pool, void* ptr) {
+    if (pool == NULL || ptr == NULL)
+        return;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    if (pool->hot.f.flags & POOL_ZERO_ON_FREE)
+        zero_bytes((char*)ptr + sizeof(void*),
+                   pool->hot.f.chunk_sz - sizeof(void*));
+
+    if (!(pool->hot.f.flags & POOL_FIFO)) {
+        *(void**)ptr           = pool->hot.f.free_chunk;
+        pool->hot.f.free_chunk = ptr;
+    } else {
+        *(void**)ptr = NULL;
+        if (pool->hot.f.free_chunk == NULL) {
+            pool->hot.f.free_chunk = ptr;
+        } else {
+            VALGRIND_MAKE_MEM_DEFINED(pool->free_tail, sizeof(void*));
+            *(void**)pool->free_tail = ptr;
+            VALGRIND_MAKE_MEM_NOACCESS(pool->free_tail, sizeof(void*));
+        }
+        pool->free_tail = ptr;
+    }
+    count_free(pool, 1);
+
+    /* The first page is kept, since it contains the `.next' pointer */
+    if (pool->hot.f.flags & POOL_RELEASE_ON_FREE)
+        release_pages((char*)ptr + page_size(),
+                      pool->hot.f.chunk_sz - page_size());
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    VALGRIND_MEMPOOL_FREE(pool, ptr);
+}
+
+/*
+ * Allocating many chunks at once works just like `pool_alloc', but the pool is
+ * only made accessible once, and the statistics are updated at the end.
+ */
+static size_t alloc_n(Pool* pool, void** ptrs, size_t n, bool handle) {
+    char* chunk;
+    size_t dirty;
+    size_t i;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    for (i = 0; i < n; i++) {
+        chunk = take_chunk(pool, handle, &dirty);
+        if (chunk == NULL)
+            break;
+
+        ptrs[i] = chunk;
+    }
+
+    count_alloc(pool, i);
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    return i;
+}
+
+size_t pool_alloc_n(Pool* pool, void** ptrs, size_t n) {
+    if (pool == NULL)
+        return 0;
+
+    return alloc_n(pool, ptrs, n, true);
+}
+
+size_t pool_try_alloc_n(Pool* pool, void** ptrs, size_t n) {
+    return alloc_n(pool, ptrs, n, false);
+}
+
+/*
+ * The chunks are linked in the order they are taken, so the untouched ones keep
+ * their order in memory.
+ */
+void* pool_take_free(Pool* pool, void** last) {
+    char* first;
+    char* tail;
+    char* chunk;
+    size_t dirty;
+    size_t n;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    first = NULL;
+    tail  = NULL;
+    for (n = 0; (chunk = take_chunk(pool, false, &dirty)) != NULL; n++) {
+        *(void**)chunk = NULL;
+        if (tail != NULL)
+            *(void**)tail = chunk;
+        else
+            first = chunk;
+        tail = chunk;
+    }
+
+    count_alloc(pool, n);
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+
+    *last = tail;
+    return first;
+}
+
+/*
+ * The chunks are linked together first, in the order of the array, and then the
+ * whole chain is prepended (or appended, in `POOL_FIFO' pools) to the list of
+ * free chunks.
+ */
+void pool_free_n(Pool* pool, void** ptrs, size_t n) {
+    void* first;
+    void* last;
+    size_t i, nfreed;
+
+    if (pool == NULL)
+        return;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    first  = NULL;
+    last   = NULL;
+    nfreed = 0;
+    for (i = 0; i < n; i++) {
+        if (ptrs[i] == NULL)
+            continue;
+
+        if (pool->hot.f.flags & POOL_ZERO_ON_FREE)
+            zero_bytes((char*)ptrs[i] + sizeof(void*),
+                       pool->hot.f.chunk_sz - sizeof(void*));
+        if (pool->hot.f.flags & POOL_RELEASE_ON_FREE)
+            release_pages((char*)ptrs[i] + page_size(),
+                          pool->hot.f.chunk_sz - page_size());
+
+        if (last != NULL)
+            *(void**)last = ptrs[i];
+        else
+            first = ptrs[i];
+        last = ptrs[i];
+        nfreed++;
+    }
+
+    if (first == NULL) {
+        VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+        return;
+    }
+
+    if (!(pool->hot.f.flags & POOL_FIFO)) {
+        *(void**)last          = pool->hot.f.free_chunk;
+        pool->hot.f.free_chunk = first;
+    } else {
+        *(void**)last = NULL;
+        if (pool->hot.f.free_chunk == NULL) {
+            pool->hot.f.free_chunk = first;
+        } else {
+            VALGRIND_MAKE_MEM_DEFINED(pool->free_tail, sizeof(void*));
+            *(void**)pool->free_tail = first;
+            VALGRIND_MAKE_MEM_NOACCESS(pool->free_tail, sizeof(void*));
+        }
+        pool->free_tail = last;
+    }
+    count_free(pool, nfreed);
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+#if !defined(LIBPOOL_NO_VALGRIND)
+    for (i = 0; i < n; i++)
+        if (ptrs[i] != NULL)
+            VALGRIND_MEMPOOL_FREE(pool, ptrs[i]);
+#endif
+}
+
+/*
+ * The chunk arrays are searched linearly, which is fine for checking a pointer
+ * now and then, but not for finding the pool of each freed chunk.
+ */
+bool pool_contains(Pool* pool, const void* ptr) {
+    ArrayStart* array_start;
+    ArrayStart* next;
+    uintptr_t start, offset;
+    bool result;
+
+    if (pool == NULL || ptr == NULL)
+        return false;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    result = false;
+    for (array_start = pool->array_starts; array_start != NULL;
+         array_start = next) {
+        VALGRIND_MAKE_MEM_DEFINED(array_start, sizeof(ArrayStart));
+        start  = (uintptr_t)array_start->arr;
+        offset = (uintptr_t)ptr - start;
+        if ((uintptr_t)ptr >= start &&
+            offset < array_start->nchunks * pool->hot.f.chunk_sz)
+            result = (offset % pool->hot.f.chunk_sz == 0);
+        next = array_start->next;
+        VALGRIND_MAKE_MEM_NOACCESS(array_start, sizeof(ArrayStart));
+
+        if (result)
+            break;
+    }
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    return result;
+}
+
+void pool_set_exhausted_handler(Pool* pool, PoolExhaustedFuncPtr func,
+                                void* ctx) {
+    if (pool == NULL)
+        return;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    pool->exhausted_fn  = func;
+    pool->exhausted_ctx = ctx;
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+}
+
+/*
+ * When enabling `POOL_ZERO_ON_FREE', the chunks that are already in the list of
+ * free chunks need to be zeroed. The released chunks are zeroed once they are
+ * reused.
+ *
+ * The `POOL_RELEASE_ON_FREE' flag is ignored unless the pool has large chunks,
+ * since the chunks need to be page-aligned.
+ */
+void pool_set_flags(Pool* pool, unsigned flags) {
+    char* chunk;
+    char* next;
+
+    if (pool == NULL)
+        return;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    if ((flags & POOL_ZERO_ON_FREE) &&
+        !(pool->hot.f.flags & POOL_ZERO_ON_FREE)) {
+        for (chunk = pool->hot.f.free_chunk; chunk != NULL; chunk = next) {
+            VALGRIND_MAKE_MEM_DEFINED(chunk, pool->hot.f.chunk_sz);
+            zero_bytes(chunk + sizeof(void*),
+                       pool->hot.f.chunk_sz - sizeof(void*));
+            next = *(void**)chunk;
+            VALGRIND_MAKE_MEM_NOACCESS(chunk, pool->hot.f.chunk_sz);
+        }
+    }
+
+    /* The tail of the list is only maintained in `POOL_FIFO' pools */
+    if ((flags & POOL_FIFO) && !(pool->hot.f.flags & POOL_FIFO)) {
+        for (chunk = pool->hot.f.free_chunk; chunk != NULL; chunk = next) {
+            VALGRIND_MAKE_MEM_DEFINED(chunk, sizeof(void*));
+            next = *(void**)chunk;
+            VALGRIND_MAKE_MEM_NOACCESS(chunk, sizeof(void*));
+            pool->free_tail = chunk;
+        }
+    }
+
+#if defined(HAVE_MADVISE)
+    if (!pool->large_chunks)
+        flags &= ~(unsigned)POOL_RELEASE_ON_FREE;
+#else
+    flags &= ~(unsigned)POOL_RELEASE_ON_FREE;
+#endif
+
+    pool->hot.f.flags = flags;
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+}
+
+unsigned pool_get_flags(Pool* pool) {
+    unsigned result;
+
+    if (pool == NULL)
+        return 0;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    result = pool->hot.f.flags;
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+void pool_set_name(Pool* pool, const char* name) {
+    if (pool == NULL)
+        return;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    pool->name = name;
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+}
+
+void pool_get_stats(Pool* pool, PoolStats* stats) {
+    if (pool == NULL || stats == NULL)
+        return;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    stats->name        = pool->name;
+    stats->chunk_sz    = pool->hot.f.chunk_sz;
+    stats->initial_sz  = pool->initial_sz;
+    stats->capacity    = pool->capacity;
+    stats->live        = pool->hot.f.allocs - pool->hot.f.frees;
+    stats->peak_live   = pool->peak_live;
+    stats->expansions  = pool->expansions;
+    stats->allocs      = pool->hot.f.allocs;
+    stats->frees       = pool->hot.f.frees;
+    stats->exhaustions = pool->exhaustions;
+    stats->array_bytes = pool->array_bytes;
+    stats->released    = pool->released_chunks;
+    stats->slack       = pool->slack_chunks;
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+}
+
+/*----------------------------------------------------------------------------*/
+
+void pool_set_granularity(Pool* pool, size_t bytes) {
+    size_t granularity;
+
+    if (pool == NULL)
+        return;
+
+    /* Round up to a power of two, so it can be used as an alignment */
+    for (granularity = 1; granularity < bytes; granularity *= 2)
+        if (granularity > (size_t)-1 / 2)
+            return;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    pool->granularity = (bytes == 0) ? 0 : granularity;
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+}
+
+/*----------------------------------------------------------------------------*/
+
+void pool_set_budget(Pool* pool, size_t max_bytes) {
+    if (pool == NULL)
+        return;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    pool->budget = max_bytes;
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+}
+
+void pool_set_global_budget(size_t max_bytes) {
+    GLOBAL_LOCK();
+    global_budget             = max_bytes;
+    global_budget_initialized = true;
+    GLOBAL_UNLOCK();
+}
+
+size_t pool_get_global_bytes(void) {
+    size_t result;
+
+    GLOBAL_LOCK();
+    result = global_array_bytes;
+    GLOBAL_UNLOCK();
+
+    return result;
+}
+
+void pool_set_pressure_handler(PoolPressureFuncPtr func, void* ctx) {
+    GLOBAL_LOCK();
+    pressure_fn  = func;
+    pressure_ctx = ctx;
+    GLOBAL_UNLOCK();
+}
+
+/*----------------------------------------------------------------------------*/
+
+PoolGroup* pool_group_new(void) {
+    PoolGroup* group;
+
+    group = pool_ext_alloc(sizeof(PoolGroup));
+    if (group == NULL)
+        return NULL;
+
+    group->pools       = NULL;
+    group->name        = NULL;
+    group->array_bytes = 0;
+    group->budget      = 0;
+    group->narrays     = 0;
+    group->closed      = false;
+
+    return group;
+}
+
+void pool_group_close(PoolGroup* group) {
+    ArrayStart* arrays;
+
+    if (group == NULL)
+        return;
+
+    arrays = pool_group_detach(group);
+    while (arrays != NULL)
+        arrays = pool_free_arrays(arrays, (size_t)-1);
+}
+
+/*
+ * Each pool is taken from the group and unlinked in the same critical section,
+ * so it can't be unlinked (e.g. by `pool_group_remove') between reading it and
+ * detaching it. Then it's detached, and its arrays are prepended to the
+ * resulting list, so only the arrays of the new pool are traversed.
+ */
+ArrayStart* pool_group_detach(PoolGroup* group) {
+    ArrayStart* arrays;
+    Pool* pool;
+
+    arrays = NULL;
+    for (;;) {
+        GLOBAL_LOCK();
+        pool = group->pools;
+        if (pool != NULL) {
+            VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+            group_unlink(pool);
+            VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+        }
+        GLOBAL_UNLOCK();
+
+        if (pool == NULL)
+            break;
+
+        arrays = pool_concat_arrays(pool_detach(pool), arrays);
+    }
+
+    /* The group is freed along with the last array charged to it */
+    GLOBAL_LOCK();
+    group->closed = true;
+    if (group->narrays != 0)
+        group = NULL;
+    GLOBAL_UNLOCK();
+
+    pool_ext_free(group);
+    return arrays;
+}
+
+void pool_group_add(PoolGroup* group, Pool* pool) {
+    if (group == NULL || pool == NULL)
+        return;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    GLOBAL_LOCK();
+
+    group_unlink(pool);
+
+    pool->group      = group;
+    pool->group_prev = NULL;
+    pool->group_next = group->pools;
+    if (group->pools != NULL) {
+        VALGRIND_MAKE_MEM_DEFINED(group->pools, sizeof(Pool));
+        group->pools->group_prev = pool;
+        VALGRIND_MAKE_MEM_NOACCESS(group->pools, sizeof(Pool));
+    }
+    group->pools = pool;
+    charge_arrays(pool, group);
+
+    GLOBAL_UNLOCK();
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+}
+
+void pool_group_remove(Pool* pool) {
+    if (pool == NULL)
+        return;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    GLOBAL_LOCK();
+    group_unlink(pool);
+    charge_arrays(pool, NULL);
+    GLOBAL_UNLOCK();
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+}
+
+void pool_group_set_name(PoolGroup* group, const char* name) {
+    if (group != NULL)
+        group->name = name;
+}
+
+void pool_group_set_budget(PoolGroup* group, size_t max_bytes) {
+    if (group == NULL)
+        return;
+
+    GLOBAL_LOCK();
+    group->budget = max_bytes;
+    GLOBAL_UNLOCK();
+}
+
+/*
+ * The statistics of the pools are added together. The chunk size is only set
+ * if all the pools have the same one.
+ */
+void pool_group_get_stats(PoolGroup* group, PoolStats* stats) {
+    Pool* pool;
+    Pool* next;
+
+    if (group == NULL || stats == NULL)
+        return;
+
+    stats->name        = group->name;
+    stats->chunk_sz    = 0;
+    stats->initial_sz  = 0;
+    stats->capacity    = 0;
+    stats->live        = 0;
+    stats->peak_live   = 0;
+    stats->expansions  = 0;
+    stats->allocs      = 0;
+    stats->frees       = 0;
+    stats->exhaustions = 0;
+    stats->array_bytes = 0;
+    stats->released    = 0;
+    stats->slack       = 0;
+
+    GLOBAL_LOCK();
+
+    for (pool = group->pools; pool != NULL; pool = next) {
+        VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+        if (pool == group->pools)
+            stats->chunk_sz = pool->hot.f.chunk_sz;
+        else if (stats->chunk_sz != pool->hot.f.chunk_sz)
+            stats->chunk_sz = 0;
+
+        stats->initial_sz += pool->initial_sz;
+        stats->capacity += pool->capacity;
+        stats->live += pool->hot.f.allocs - pool->hot.f.frees;
+        stats->peak_live += pool->peak_live;
+        stats->expansions += pool->expansions;
+        stats->allocs += pool->hot.f.allocs;
+        stats->frees += pool->hot.f.frees;
+        stats->exhaustions += pool->exhaustions;
+        stats->array_bytes += pool->array_bytes;
+        stats->released += pool->released_chunks;
+        stats->slack += pool->slack_chunks;
+
+        next = pool->group_next;
+        VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    }
+
+    GLOBAL_UNLOCK();
+}
+
+/*----------------------------------------------------------------------------*/
+
+#if defined(HAVE_MADVISE)
+/*
+ * Information about a chunk array, used while scavenging. The `first_bit' is
+ * the index, in the bitmap of free chunks, of the first chunk of the array.
+ */
+typedef struct ScavengeArray {
+    char* start;
+    char* end;
+    size_t nchunks;
+    size_t first_bit;
+} ScavengeArray;
+
+#define BIT_GET(BITMAP, I) (((BITMAP)[(I) / 8] >> ((I) % 8)) & 1)
+#define BIT_SET(BITMAP, I) ((BITMAP)[(I) / 8] |= (1 << ((I) % 8)))
+#define BIT_CLR(BITMAP, I) ((BITMAP)[(I) / 8] &= ~(1 << ((I) % 8)))
+
+static int compare_arrays(const void* a, const void* b) {
+    const char* start_a = ((const ScavengeArray*)a)->start;
+    const char* start_b = ((const ScavengeArray*)b)->start;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+/*
+ * Find the array that contains the specified chunk, using a binary search,
+ * since the arrays are sorted by address.
+ */
+static ScavengeArray* find_array(ScavengeArray* arrays, size_t narrays,
+                                 char* chunk) {
+    size_t low  = 0;
+    size_t high = narrays;
+    size_t mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (chunk < arrays[mid].start)
+            high = mid;
+        else if (chunk >= arrays[mid].end)
+            low = mid + 1;
+        else
+            return &arrays[mid];
+    }
+
+    return NULL;
+}
+
+/*
+ * Return the index, in the bitmap, of the specified free chunk.
+ */
+static size_t chunk_bit(Pool* pool, ScavengeArray* arrays, size_t narrays,
+                        char* chunk) {
+    ScavengeArray* array = find_array(arrays, narrays, chunk);
+    return array->first_bit +
+           (size_t)(chunk - array->start) / pool->hot.f.chunk_sz;
+}
+
+/*
+ * Tell the system that it can reclaim the pages of a released run. Only the
+ * pages that are fully covered by the run are released.
+ */
+static size_t release_run(Pool* pool, ChunkRun* run) {
+    const uintptr_t page_mask = page_size() - 1;
+    uintptr_t start, end;
+
+    start = ((uintptr_t)run->start + page_mask) & ~page_mask;
+    end   = ((uintptr_t)run->start + run->nchunks * pool->hot.f.chunk_sz) &
+          ~page_mask;
+    if (end <= start || !release_pages((void*)start, end - start))
+        return 0;
+
+    return end - start;
+}
+
+/*
+ * Decide which chunks of the specified run of free chunks (from `first' to
+ * `last', exclusive) will be released, without exceeding `max_bytes' bytes of
+ * full pages. The chunks whose `.next' pointer overlaps one of those pages
+ * can't stay in the free list, so they are the ones that are released.
+ *
+ * Returns a new `ChunkRun' structure, or NULL if no pages can be released.
+ */
+static ChunkRun* plan_run(Pool* pool, ScavengeArray* array, size_t first,
+                             size_t last, size_t max_bytes) {
+    const size_t page = page_size();
+    ChunkRun* run;
+    uintptr_t base, start, end;
+    size_t first_chunk, last_chunk;
+
+    base  = (uintptr_t)array->start;
+    start = (base + first * pool->hot.f.chunk_sz + page - 1) &
+            ~(uintptr_t)(page - 1);
+    end   = (base + last * pool->hot.f.chunk_sz) & ~(uintptr_t)(page - 1);
+    if (end <= start || max_bytes < page)
+        return NULL;
+
+    if (end - start > max_bytes)
+        end = start + (max_bytes & ~(page - 1));
+
+    /* First chunk whose `.next' pointer ends after `start' */
+    first_chunk = (start - base >= sizeof(void*))
+                    ? (start - base - sizeof(void*)) / pool->hot.f.chunk_sz + 1
+                    : 0;
+    if (first_chunk < first)
+        first_chunk = first;
+
+    /* Last chunk (exclusive) that starts before `end' */
+    last_chunk = (end - base + pool->hot.f.chunk_sz - 1) / pool->hot.f.chunk_sz;
+    if (last_chunk > last)
+        last_chunk = last;
+
+    run = pool_ext_alloc(sizeof(ChunkRun));
+    if (run == NULL)
+        return NULL;
+
+    run->start   = array->start + first_chunk * pool->hot.f.chunk_sz;
+    run->nchunks = last_chunk - first_chunk;
+    run->zeroed  = (pool->hot.f.flags & POOL_ZERO_ON_FREE) != 0;
+    return run;
+}
+
+/*
+ * Scavenging the pool consists of the following steps:
+ *
+ * 1. Skip the free chunks that were used since the last scavenge. Since the
+ *    free list works as a stack, the chunks that were not used are the ones at
+ *    the end of the list; the list never got shorter than the current number
+ *    of free chunks minus the ones used since then. This is the hysteresis that
+ *    prevents releasing the memory of the chunks that are in use. In
+ *    `POOL_FIFO' pools, the same number of chunks is skipped, but at the end of
+ *    the list, so the ring of reused chunks shrinks to the size that was
+ *    actually needed.
+ * 2. Mark the rest of the free chunks in a bitmap, which is allocated outside
+ *    of the pool.
+ * 3. Look for runs of consecutive free chunks that fully cover at least one
+ *    page, and remove them from the free list.
+ * 4. Tell the system that it can reclaim those pages, and store the runs in
+ *    the `Pool.released' list, so they can be reused later.
+ */
+static size_t scavenge(Pool* pool, size_t max_bytes) {
+    ScavengeArray* arrays;
+    ArrayStart* array_start;
+    ChunkRun* new_runs;
+    ChunkRun* run;
+    unsigned char* bitmap;
+    void** link;
+    char* chunk;
+    size_t narrays, nbits, hot, cold, planned, released, first, last;
+    size_t i, j, k;
+
+    /* Without the usage counters, every free chunk is considered cold */
+#if defined(LIBPOOL_NO_STATS)
+    hot = 0;
+#else
+    hot = pool->hot.f.interval_peak - (pool->hot.f.allocs - pool->hot.f.frees);
+    pool->hot.f.interval_peak = pool->hot.f.allocs - pool->hot.f.frees;
+#endif /* LIBPOOL_NO_STATS */
+
+    narrays = 0;
+    nbits   = 0;
+    for (array_start = pool->array_starts; array_start != NULL;
+         array_start = array_start->next) {
+        VALGRIND_MAKE_MEM_DEFINED(array_start, sizeof(ArrayStart));
+        narrays++;
+        nbits += array_start->nchunks;
+    }
+
+    arrays = pool_ext_alloc(narrays * sizeof(ScavengeArray));
+    bitmap = pool_ext_alloc((nbits + 7) / 8);
+    if (arrays == NULL || bitmap == NULL) {
+        pool_ext_free(arrays);
+        pool_ext_free(bitmap);
+        return 0;
+    }
+    memset(bitmap, 0, (nbits + 7) / 8);
+
+    nbits = 0;
+    i     = 0;
+    for (array_start = pool->array_starts; array_start != NULL;
+         array_start = array_start->next) {
+        arrays[i].start     = array_start->arr;
+        arrays[i].end       = arrays[i].start +
+                        array_start->nchunks * pool->hot.f.chunk_sz;
+        arrays[i].nchunks   = array_start->nchunks;
+        arrays[i].first_bit = nbits;
+        nbits += array_start->nchunks;
+        i++;
+    }
+    qsort(arrays, narrays, sizeof(ScavengeArray), compare_arrays);
+
+    /* Step 1: skip the hot part of the free list */
+    link = &pool->hot.f.free_chunk;
+    cold = (size_t)-1;
+    if (pool->hot.f.flags & POOL_FIFO) {
+        for (i = 0, chunk = *link; chunk != NULL; i++) {
+            VALGRIND_MAKE_MEM_DEFINED(chunk, sizeof(void*));
+            chunk = *(void**)chunk;
+        }
+        cold = (i > hot) ? i - hot : 0;
+    } else {
+        for (i = 0; i < hot && *link != NULL; i++) {
+            VALGRIND_MAKE_MEM_DEFINED(*link, sizeof(void*));
+            link = (void**)*link;
+        }
+    }
+
+    /* Step 2: mark the cold part in the bitmap */
+    for (i = 0, chunk = *link; i < cold && chunk != NULL; i++) {
+        VALGRIND_MAKE_MEM_DEFINED(chunk, sizeof(void*));
+        BIT_SET(bitmap, chunk_bit(pool, arrays, narrays, chunk));
+        chunk = *(void**)chunk;
+    }
+
+    /* Step 3: plan the runs, and clear their bits */
+    new_runs = NULL;
+    planned  = 0;
+    for (i = 0; i < narrays && planned < max_bytes; i++) {
+        first = 0;
+        while (first < arrays[i].nchunks && planned < max_bytes) {
+            if (!BIT_GET(bitmap, arrays[i].first_bit + first)) {
+                first++;
+                continue;
+            }
+
+            last = first;
+            while (last < arrays[i].nchunks &&
+                   BIT_GET(bitmap, arrays[i].first_bit + last))
+                last++;
+
+            run = plan_run(pool, &arrays[i], first, last, max_bytes - planned);
+            if (run != NULL) {
+                j = arrays[i].first_bit +
+                    (size_t)(run->start - arrays[i].start) /
+                      pool->hot.f.chunk_sz;
+                for (k = j + run->nchunks; j < k; j++)
+                    BIT_CLR(bitmap, j);
+
+                planned += run->nchunks * pool->hot.f.chunk_sz;
+                run->next = new_runs;
+                new_runs  = run;
+            }
+
+            first = last;
+        }
+    }
+
+    /* Remove the planned runs from the free list, before releasing them */
+    for (i = 0; i < cold && (chunk = *link) != NULL; i++) {
+        if (BIT_GET(bitmap, chunk_bit(pool, arrays, narrays, chunk)))
+            link = (void**)chunk;
+        else
+            *link = *(void**)chunk;
+    }
+
+    /* The last chunk might have been removed */
+    while (*link != NULL)
+        link = (void**)*link;
+    pool->free_tail = (link == &pool->hot.f.free_chunk) ? NULL : (void*)link;
+
+#if !defined(LIBPOOL_NO_VALGRIND)
+    chunk = pool->hot.f.free_chunk;
+    while (chunk != NULL) {
+        char* next = *(void**)chunk;
+        VALGRIND_MAKE_MEM_NOACCESS(chunk, sizeof(void*));
+        chunk = next;
+    }
+#endif
+
+    /* Step 4: release the pages, and store the runs */
+    released = 0;
+    while (new_runs != NULL) {
+        run      = new_runs;
+        new_runs = run->next;
+
+        released += release_run(pool, run);
+        VALGRIND_MAKE_MEM_NOACCESS(run->start,
+                                   run->nchunks * pool->hot.f.chunk_sz);
+
+        run->next      = pool->released;
+        pool->released = run;
+        pool->released_chunks += run->nchunks;
+    }
+
+    pool_ext_free(bitmap);
+    pool_ext_free(arrays);
+    return released;
+}
+#else
+static size_t scavenge(Pool* pool, size_t max_bytes) {
+    (void)pool;
+    (void)max_bytes;
+    return 0;
+}
+#endif /* HAVE_MADVISE */
+
+size_t pool_scavenge(Pool* pool, size_t max_bytes) {
+    size_t result;
+
+    if (pool == NULL)
+        return 0;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+    result = scavenge(pool, max_bytes);
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+#if defined(HAVE_MMAN)
+/*
+ * Header of the snapshots written by `pool_snapshot'. It's followed by one
+ * `SnapshotArray' for each chunk array (the relocation table), one
+ * `SnapshotRun' for each untouched run and each released run, and finally the
+ * contents of the arrays, in the same order as the relocation table. The
+ * untouched region and the runs are skipped when writing the contents, since
+ * they don't contain anything that needs to be restored.
+ *
+ * Every address is stored as it was in the process that wrote the snapshot.
+ * The `header_sz' and `byte_order' fields are used for rejecting snapshots
+ * written by an incompatible build.
+ */
+typedef struct SnapshotHeader {
+    char magic[8];
+    size_t header_sz;
+    size_t byte_order;
+    size_t chunk_sz;
+    size_t flags;
+    size_t large_chunks;
+    size_t array_align;
+    size_t granularity;
+    size_t budget;
+    size_t initial_sz;
+    size_t peak_live;
+    size_t expansions;
+    size_t allocs;
+    size_t frees;
+    size_t exhaustions;
+    size_t released_chunks;
+    size_t narrays;
+    size_t nuntouched;
+    size_t nreleased;
+    uintptr_t free_chunk;
+    uintptr_t bump;
+    uintptr_t bump_end;
+    size_t bump_zeroed;
+} SnapshotHeader;
+
+typedef struct SnapshotArray {
+    uintptr_t start;
+    size_t nchunks;
+    size_t slack;
+} SnapshotArray;
+
+typedef struct SnapshotRun {
+    uintptr_t start;
+    size_t nchunks;
+    size_t zeroed;
+} SnapshotRun;
+
+#define SNAPSHOT_MAGIC      "LPSNAP2"
+#define SNAPSHOT_BYTE_ORDER ((size_t)0x01020304)
+
+static bool write_all(int fd, const void* buf, size_t sz) {
+    const char* ptr = buf;
+    ssize_t written;
+
+    while (sz > 0) {
+        written = write(fd, ptr, sz);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+
+        ptr += written;
+        sz -= (size_t)written;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void* buf, size_t sz) {
+    char* ptr = buf;
+    ssize_t result;
+
+    while (sz > 0) {
+        result = read(fd, ptr, sz);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+
+        ptr += result;
+        sz -= (size_t)result;
+    }
+
+    return true;
+}
+
+static bool write_runs(int fd, ChunkRun* run) {
+    SnapshotRun saved;
+
+    for (; run != NULL; run = run->next) {
+        saved.start   = (uintptr_t)run->start;
+        saved.nchunks = run->nchunks;
+        saved.zeroed  = run->zeroed;
+        if (!write_all(fd, &saved, sizeof(saved)))
+            return false;
+    }
+
+    return true;
+}
+
+static size_t count_runs(ChunkRun* run) {
+    size_t result;
+
+    for (result = 0; run != NULL; run = run->next)
+        result++;
+
+    return result;
+}
+
+/*
+ * Find the first range of the array that is not written to the snapshot (the
+ * untouched region, an untouched run or a released run) starting between `pos'
+ * and `end'. Its size is stored in `sz', and whether it must be filled with
+ * zeros in `zeroed'. If there is none, `end' is returned.
+ */
+static char* next_skipped(Pool* pool, char* pos, char* end, size_t* sz,
+                          bool* zeroed) {
+    ChunkRun* lists[2];
+    ChunkRun* run;
+    char* result;
+    size_t i;
+
+    result = end;
+    if (pool->hot.f.bump != pool->hot.f.bump_end && pool->hot.f.bump >= pos &&
+        pool->hot.f.bump < result) {
+        result  = pool->hot.f.bump;
+        *sz     = (size_t)(pool->hot.f.bump_end - pool->hot.f.bump);
+        *zeroed = pool->hot.f.bump_zeroed;
+    }
+
+    lists[0] = pool->untouched;
+    lists[1] = pool->released;
+    for (i = 0; i < 2; i++) {
+        for (run = lists[i]; run != NULL; run = run->next) {
+            if (run->start >= pos && run->start < result) {
+                result  = run->start;
+                *sz     = run->nchunks * pool->hot.f.chunk_sz;
+                *zeroed = run->zeroed;
+            }
+        }
+    }
+
+    return result;
+}
+
+/*
+ * Write the contents of an array to the snapshot, or read them if `restore' is
+ * true, skipping the ranges returned by `next_skipped'. When restoring, the
+ * skipped ranges that should contain zeros are cleared, unless the array was
+ * mapped (in which case it's already filled with zeros, and clearing it would
+ * commit its memory).
+ */
+static bool transfer_array(Pool* pool, int fd, ArrayStart* array_start,
+                           bool restore) {
+    char* pos;
+    char* end;
+    char* skip;
+    size_t skip_sz;
+    bool zeroed;
+
+    pos     = array_start->arr;
+    end     = pos + array_start->nchunks * pool->hot.f.chunk_sz;
+    skip_sz = 0;
+    zeroed  = false;
+    while (pos < end) {
+        skip = next_skipped(pool, pos, end, &skip_sz, &zeroed);
+        if (restore ? !read_all(fd, pos, (size_t)(skip - pos))
+                    : !write_all(fd, pos, (size_t)(skip - pos)))
+            return false;
+
+        if (skip == end)
+            break;
+
+        if (restore && zeroed && array_start->map_sz == 0)
+            memset(skip, 0, skip_sz);
+        pos = skip + skip_sz;
+    }
+
+    return true;
+}
+
+#if !defined(LIBPOOL_NO_VALGRIND)
+/*
+ * Make the chunks of a run inaccessible, or remove them from the Valgrind pool
+ * if `unregister' is true.
+ */
+static void hide_run(Pool* pool, char* start, size_t nchunks,
+                     bool unregister) {
+    size_t i;
+
+    if (!unregister) {
+        VALGRIND_MAKE_MEM_NOACCESS(start, nchunks * pool->hot.f.chunk_sz);
+        return;
+    }
+
+    for (i = 0; i < nchunks; i++)
+        VALGRIND_MEMPOOL_FREE(pool, start + i * pool->hot.f.chunk_sz);
+}
+
+/*
+ * Hide the chunks that are not in use, after `pool_snapshot' or `pool_restore'
+ * made the whole arrays defined.
+ */
+static void hide_free_chunks(Pool* pool, bool unregister) {
+    ChunkRun* run;
+    char* chunk;
+    char* next;
+
+    for (chunk = pool->hot.f.free_chunk; chunk != NULL; chunk = next) {
+        next = *(void**)chunk;
+        hide_run(pool, chunk, 1, unregister);
+    }
+
+    hide_run(pool,
+             pool->hot.f.bump,
+             (size_t)(pool->hot.f.bump_end - pool->hot.f.bump) /
+               pool->hot.f.chunk_sz,
+             unregister);
+
+    for (run = pool->untouched; run != NULL; run = run->next)
+        hide_run(pool, run->start, run->nchunks, unregister);
+    for (run = pool->released; run != NULL; run = run->next)
+        hide_run(pool, run->start, run->nchunks, unregister);
+}
+#endif /* !LIBPOOL_NO_VALGRIND */
+
+/*
+ * The snapshot is written sequentially, so `fd' can also be a pipe or a
+ * socket. The arrays are written as they are, including the `.next' pointers
+ * of the free chunks; they are only translated by `pool_restore'. The chunks
+ * that were never used or whose memory was released are not written, so they
+ * are not faulted in either.
+ */
+bool pool_snapshot(Pool* pool, int fd) {
+    SnapshotHeader header;
+    SnapshotArray saved;
+    ArrayStart* array_start;
+    ArrayStart* next;
+    bool result;
+
+    if (pool == NULL)
+        return false;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.header_sz       = sizeof(header);
+    header.byte_order      = SNAPSHOT_BYTE_ORDER;
+    header.chunk_sz        = pool->hot.f.chunk_sz;
+    header.flags           = pool->hot.f.flags;
+    header.large_chunks    = pool->large_chunks;
+    header.array_align     = pool->array_align;
+    header.granularity     = pool->granularity;
+    header.budget          = pool->budget;
+    header.initial_sz      = pool->initial_sz;
+    header.peak_live       = pool->peak_live;
+    header.expansions      = pool->expansions;
+    header.allocs          = pool->hot.f.allocs;
+    header.frees           = pool->hot.f.frees;
+    header.exhaustions     = pool->exhaustions;
+    header.released_chunks = pool->released_chunks;
+    header.nuntouched      = count_runs(pool->untouched);
+    header.nreleased       = count_runs(pool->released);
+    header.free_chunk      = (uintptr_t)pool->hot.f.free_chunk;
+    header.bump            = (uintptr_t)pool->hot.f.bump;
+    header.bump_end        = (uintptr_t)pool->hot.f.bump_end;
+    header.bump_zeroed     = pool->hot.f.bump_zeroed;
+
+    header.narrays = 0;
+    for (array_start = pool->array_starts; array_start != NULL;
+         array_start = next) {
+        VALGRIND_MAKE_MEM_DEFINED(array_start, sizeof(ArrayStart));
+        next = array_start->next;
+        VALGRIND_MAKE_MEM_NOACCESS(array_start, sizeof(ArrayStart));
+        header.narrays++;
+    }
+
+    result = write_all(fd, &header, sizeof(header));
+
+    /* The relocation table */
+    for (array_start = pool->array_starts; result && array_start != NULL;
+         array_start = next) {
+        VALGRIND_MAKE_MEM_DEFINED(array_start, sizeof(ArrayStart));
+        saved.start   = (uintptr_t)array_start->arr;
+        saved.nchunks = array_start->nchunks;
+        saved.slack   = array_start->slack;
+        next          = array_start->next;
+        VALGRIND_MAKE_MEM_NOACCESS(array_start, sizeof(ArrayStart));
+
+        result = write_all(fd, &saved, sizeof(saved));
+    }
+
+    result = result && write_runs(fd, pool->untouched) &&
+             write_runs(fd, pool->released);
+
+    /*
+     * The whole arrays are made accessible, even if writing fails, and the
+     * unused chunks are hidden again once everything is written.
+     */
+    for (array_start = pool->array_starts; array_start != NULL;
+         array_start = next) {
+        VALGRIND_MAKE_MEM_DEFINED(array_start, sizeof(ArrayStart));
+        VALGRIND_MAKE_MEM_DEFINED(array_start->arr,
+                                  array_start->nchunks * pool->hot.f.chunk_sz);
+        result = result && transfer_array(pool, fd, array_start, false);
+        next = array_start->next;
+        VALGRIND_MAKE_MEM_NOACCESS(array_start, sizeof(ArrayStart));
+    }
+
+#if !defined(LIBPOOL_NO_VALGRIND)
+    if (RUNNING_ON_VALGRIND)
+        hide_free_chunks(pool, false);
+#endif
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    return result;
+}
+
+static int compare_relocations(const void* a, const void* b) {
+    uintptr_t start_a = ((const Relocation*)a)->old_start;
+    uintptr_t start_b = ((const Relocation*)b)->old_start;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+/*
+ * Find the restored array that contained the specified old address, using a
+ * binary search over the relocation table.
+ */
+static Relocation* find_relocation(Pool* pool, uintptr_t old) {
+    size_t low  = 0;
+    size_t high = pool->nrelocations;
+    size_t mid;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (old < pool->relocations[mid].old_start)
+            high = mid;
+        else if (old - pool->relocations[mid].old_start >=
+                 pool->relocations[mid].bytes)
+            low = mid + 1;
+        else
+            return &pool->relocations[mid];
+    }
+
+    return NULL;
+}
+
+/*
+ * Translate the old address of a run of `nchunks' chunks. Returns NULL if the
+ * run was not fully inside an array, or if it didn't start at a chunk.
+ */
+static char* relocate_chunks(Pool* pool, uintptr_t old, size_t nchunks) {
+    Relocation* relocation;
+    size_t offset;
+
+    relocation = find_relocation(pool, old);
+    if (relocation == NULL)
+        return NULL;
+
+    offset = old - relocation->old_start;
+    if (offset % pool->hot.f.chunk_sz != 0 ||
+        nchunks > (relocation->bytes - offset) / pool->hot.f.chunk_sz)
+        return NULL;
+
+    return relocation->start + offset;
+}
+
+static bool read_runs(Pool* pool, int fd, ChunkRun** list, size_t nruns) {
+    SnapshotRun saved;
+    ChunkRun* run;
+
+    while (nruns-- > 0) {
+        if (!read_all(fd, &saved, sizeof(saved)) || saved.nchunks == 0)
+            return false;
+
+        run = pool_ext_alloc(sizeof(ChunkRun));
+        if (run == NULL)
+            return false;
+
+        run->start   = relocate_chunks(pool, saved.start, saved.nchunks);
+        run->nchunks = saved.nchunks;
+        run->zeroed  = (saved.zeroed != 0);
+        run->next    = NULL;
+
+        /* Keep the order of the list, by appending to it */
+        *list = run;
+        list  = &run->next;
+
+        if (run->start == NULL)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Rewrite the `.next' pointers of the free chunks, which were read from the
+ * snapshot, along with the pointer to the first one. The list is walked at most
+ * once per chunk, in case the snapshot is corrupted.
+ */
+static bool relocate_free_list(Pool* pool) {
+    void** link;
+    size_t remaining;
+
+    link      = &pool->hot.f.free_chunk;
+    remaining = pool->capacity;
+    while (*link != NULL) {
+        if (remaining-- == 0)
+            return false;
+
+        *link = relocate_chunks(pool, (uintptr_t)*link, 1);
+        if (*link == NULL)
+            return false;
+
+        pool->free_tail = *link;
+        link            = (void**)*link;
+    }
+
+    return true;
+}
+
+/*
+ * Translate the untouched region of the pool, which must be known before
+ * reading the contents of the arrays, since it's not part of them.
+ */
+static bool relocate_bump(Pool* pool, const SnapshotHeader* header) {
+    if (header->bump != header->bump_end) {
+        if (header->bump_end < header->bump ||
+            (header->bump_end - header->bump) % pool->hot.f.chunk_sz != 0)
+            return false;
+
+        pool->hot.f.bump = relocate_chunks(pool,
+                                           header->bump,
+                                           (header->bump_end - header->bump) /
+                                             pool->hot.f.chunk_sz);
+        if (pool->hot.f.bump == NULL)
+            return false;
+
+        pool->hot.f.bump_end    = pool->hot.f.bump +
+                                  (header->bump_end - header->bump);
+        pool->hot.f.bump_zeroed = (header->bump_zeroed != 0);
+    }
+
+    return true;
+}
+
+/*
+ * Undo a partial `pool_restore'. The pool was not registered anywhere yet, so
+ * it can't be closed with `pool_close'.
+ */
+static void restore_fail(Pool* pool) {
+    ChunkRun* run;
+    ArrayStart* arrays;
+
+    while (pool->untouched != NULL) {
+        run             = pool->untouched;
+        pool->untouched = run->next;
+        pool_ext_free(run);
+    }
+
+    while (pool->released != NULL) {
+        run            = pool->released;
+        pool->released = run->next;
+        pool_ext_free(run);
+    }
+
+    arrays = pool->array_starts;
+    while (arrays != NULL)
+        arrays = pool_free_arrays(arrays, (size_t)-1);
+
+    pool_ext_free(pool->relocations);
+    pool_ext_free(pool->unaligned);
+}
+
+/*
+ * Restoring a pool reads the snapshot in a single pass. First, the chunk
+ * arrays are allocated from the relocation table, with the same alignment that
+ * `add_array' would use, and the untouched and released runs are translated
+ * from the old address of their array to the new one, along with the untouched
+ * region. Then, the contents of the arrays are read directly into them, except
+ * for those ranges, and finally the list of free chunks is translated.
+ */
+Pool* pool_restore(int fd) {
+    SnapshotHeader header;
+    SnapshotArray saved;
+    Pool* pool;
+    ArrayStart** tail;
+    ArrayStart* array_start;
+    ArrayStart* next;
+    char* arr;
+    size_t i, bytes, align, map_sz;
+    void* unaligned;
+    bool base;
+
+    if (!read_all(fd, &header, sizeof(header)) ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header.header_sz != sizeof(header) ||
+        header.byte_order != SNAPSHOT_BYTE_ORDER ||
+        header.chunk_sz < sizeof(void*) || header.narrays == 0 ||
+        header.narrays > (size_t)-1 / sizeof(Relocation))
+        return NULL;
+
+    if (header.large_chunks && pool_ext_map == NULL)
+        return NULL;
+
+    pool = pool_init(header.chunk_sz,
+                     header.large_chunks != 0,
+                     header.array_align);
+    if (pool == NULL)
+        return NULL;
+
+    pool->hot.f.flags         = (unsigned)header.flags;
+    pool->granularity         = header.granularity;
+    pool->budget              = header.budget;
+    pool->initial_sz          = header.initial_sz;
+    pool->peak_live           = header.peak_live;
+    pool->expansions          = header.expansions;
+    pool->hot.f.allocs        = header.allocs;
+    pool->hot.f.frees         = header.frees;
+    pool->exhaustions         = header.exhaustions;
+    pool->released_chunks     = header.released_chunks;
+    pool->hot.f.interval_peak = header.allocs - header.frees;
+
+    pool->relocations = pool_ext_alloc(header.narrays * sizeof(Relocation));
+    if (pool->relocations == NULL) {
+        restore_fail(pool);
+        return NULL;
+    }
+
+    /* Allocate the arrays, keeping the order of the relocation table */
+    tail = &pool->array_starts;
+    for (i = 0; i < header.narrays; i++) {
+        if (!read_all(fd, &saved, sizeof(saved)) || saved.nchunks == 0 ||
+            saved.nchunks > (size_t)-1 / pool->hot.f.chunk_sz ||
+            saved.slack > saved.nchunks) {
+            restore_fail(pool);
+            return NULL;
+        }
+
+        array_start = pool_ext_alloc(sizeof(ArrayStart));
+        if (array_start == NULL) {
+            restore_fail(pool);
+            return NULL;
+        }
+
+        /*
+         * The table is ordered like `array_starts', from the newest array to
+         * the oldest, so the last entry is the array allocated by `pool_new'.
+         * Only the arrays after that one are rounded, see `add_array'.
+         */
+        base  = (i == header.narrays - 1);
+        align = pool->array_align;
+        if (!base && pool->granularity > align)
+            align = pool->granularity;
+
+        bytes = saved.nchunks * pool->hot.f.chunk_sz;
+        arr   = array_alloc(base ? NULL : pool,
+                          bytes,
+                          pool->large_chunks,
+                          align,
+                          &map_sz,
+                          &unaligned);
+        if (arr == NULL) {
+            pool_ext_free(array_start);
+            restore_fail(pool);
+            return NULL;
+        }
+
+        array_start->arr       = arr;
+        array_start->nchunks   = saved.nchunks;
+        array_start->map_sz    = map_sz;
+        array_start->unaligned = unaligned;
+        array_start->bytes     = bytes;
+        array_start->slack     = saved.slack;
+        array_start->group     = NULL;
+        array_start->next      = NULL;
+        *tail                  = array_start;
+        tail                   = &array_start->next;
+
+        pool->relocations[i].old_start = saved.start;
+        pool->relocations[i].start     = arr;
+        pool->relocations[i].bytes     = bytes;
+        pool->nrelocations++;
+
+        pool->capacity += saved.nchunks;
+        pool->slack_chunks += saved.slack;
+        pool->array_bytes += bytes;
+    }
+
+    qsort(pool->relocations,
+          pool->nrelocations,
+          sizeof(Relocation),
+          compare_relocations);
+
+    if (!read_runs(pool, fd, &pool->untouched, header.nuntouched) ||
+        !read_runs(pool, fd, &pool->released, header.nreleased) ||
+        !relocate_bump(pool, &header)) {
+        restore_fail(pool);
+        return NULL;
+    }
+
+    for (array_start = pool->array_starts; array_start != NULL;
+         array_start = array_start->next) {
+        if (!transfer_array(pool, fd, array_start, true)) {
+            restore_fail(pool);
+            return NULL;
+        }
+    }
+
+    pool->hot.f.free_chunk = (void*)header.free_chunk;
+    if (!relocate_free_list(pool)) {
+        restore_fail(pool);
+        return NULL;
+    }
+
+    GLOBAL_LOCK();
+    stats_register(pool);
+    GLOBAL_UNLOCK();
+
+    VALGRIND_CREATE_MEMPOOL(pool, 0, 0);
+#if !defined(LIBPOOL_NO_VALGRIND)
+    /* Every chunk is registered, and then the unused ones are removed */
+    if (RUNNING_ON_VALGRIND) {
+        for (array_start = pool->array_starts; array_start != NULL;
+             array_start = array_start->next) {
+            for (i = 0; i < array_start->nchunks; i++)
+                VALGRIND_MEMPOOL_ALLOC(pool,
+                                       (char*)array_start->arr +
+                                         i * pool->hot.f.chunk_sz,
+                                       pool->hot.f.chunk_sz);
+            VALGRIND_MAKE_MEM_DEFINED(array_start->arr,
+                                      array_start->nchunks *
+                                        pool->hot.f.chunk_sz);
+        }
+        hide_free_chunks(pool, true);
+    }
+#endif
+
+    for (array_start = pool->array_starts; array_start != NULL;
+         array_start = next) {
+        next = array_start->next;
+        VALGRIND_MAKE_MEM_NOACCESS(array_start, sizeof(ArrayStart));
+    }
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    return pool;
+}
+
+/*
+ * The old address is compared as an integer, since it doesn't point to valid
+ * memory in this process.
+ */
+void* pool_relocate(Pool* pool, const void* old_ptr) {
+    Relocation* relocation;
+    void* result;
+
+    if (pool == NULL)
+        return NULL;
+
+    VALGRIND_MAKE_MEM_DEFINED(pool, sizeof(Pool));
+
+    result     = NULL;
+    relocation = find_relocation(pool, (uintptr_t)old_ptr);
+    if (relocation != NULL)
+        result = relocation->start +
+                 ((uintptr_t)old_ptr - relocation->old_start);
+
+    VALGRIND_MAKE_MEM_NOACCESS(pool, sizeof(Pool));
+    return result;
+}
+#else
+bool pool_snapshot(Pool* pool, int fd) {
+    (void)pool;
+    (void)fd;
+    return false;
+}
+
+Pool* pool_restore(int fd) {
+    (void)fd;
+    return NULL;
+}
+
+void* pool_relocate(Pool* pool, const void* old_ptr) {
+    (void)pool;
+    (void)old_ptr;
+    return NULL;
 }
+#endif /* HAVE_MMAN */
@@ -23,6 +23,40 @@
 #include <stdbool.h>
 
 typedef struct Pool Pool;
+typedef struct PoolGroup PoolGroup;
+
+/*
+ * Opaque handle of a chunk array added by `pool_expand_array'.
+ */
+typedef struct PoolArray PoolArray;
+
+/*
+ * Usage statistics of a pool, filled by `pool_get_stats'.
+ *
+ * The `initial_sz' is the number of chunks specified when calling `pool_new',
+ * and the `capacity' is the current total number of chunks, including the ones
+ * added by `pool_expand'. The `exhaustions' member counts how many times
+ * `pool_alloc' returned NULL because there were no free chunks. The
+ * `array_bytes' member is the total size of the chunk arrays of the pool,
+ * `released' is the number of free chunks whose memory was released by
+ * `pool_scavenge', and `slack' is the number of chunks that were added to the
+ * capacity by rounding up the expansions (see `pool_set_granularity').
+ */
+typedef struct PoolStats {
+    const char* name;
+    size_t chunk_sz;
+    size_t initial_sz;
+    size_t capacity;
+    size_t live;
+    size_t peak_live;
+    size_t expansions;
+    size_t allocs;
+    size_t frees;
+    size_t exhaustions;
+    size_t array_bytes;
+    size_t released;
+    size_t slack;
+} PoolStats;
 
 /*
  * External functions for allocating and freeing system memory. Used by
@@ -37,6 +71,108 @@ typedef void (*PoolFreeFuncPtr)(void*);
 extern PoolAllocFuncPtr pool_ext_alloc;
 extern PoolFreeFuncPtr pool_ext_free;
 
+/*
+ * External functions for mapping and unmapping memory directly from the system.
+ * Used for chunk arrays of at least `LIBPOOL_MAP_THRESHOLD' bytes (by default,
+ * 128 KiB). The memory returned by `pool_ext_map' must be filled with zeros.
+ *
+ * On Unix-like systems, their default value are wrappers for `mmap' and
+ * `munmap'. Otherwise, or if `LIBPOOL_NO_STDLIB' is defined, they are set to
+ * NULL, and `pool_ext_alloc' is used instead.
+ *
+ * The `pool_ext_unmap' function must support unmapping part of a mapping,
+ * which is used for aligning arrays (see `pool_set_granularity').
+ */
+typedef void* (*PoolMapFuncPtr)(size_t);
+typedef void (*PoolUnmapFuncPtr)(void*, size_t);
+extern PoolMapFuncPtr pool_ext_map;
+extern PoolUnmapFuncPtr pool_ext_unmap;
+
+/*
+ * External functions for locking and unlocking the global state of the library
+ * (i.e. the budgets and the list of open pools), used when creating, expanding
+ * and closing pools. The lock is never held while calling user code, like the
+ * pressure handler, so it doesn't need to be recursive.
+ *
+ * When compiling with GCC or Clang, they default to a spin lock, so the global
+ * state is always thread-safe. Otherwise, their default value is NULL, and the
+ * `libpool-thread' module sets them when calling `pool_thread_init'. If they
+ * are changed, it must be done before creating any pool.
+ */
+typedef void (*PoolLockFuncPtr)(void);
+extern PoolLockFuncPtr pool_ext_lock;
+extern PoolLockFuncPtr pool_ext_unlock;
+
+/*
+ * Function called when allocating a chunk array of `bytes' bytes for `pool'
+ * would exceed its budget, or the global budget. The `pool' is NULL if the
+ * array is for a pool that is being created with `pool_new'.
+ *
+ * The function can release memory (e.g. by closing other pools), and it should
+ * return true if the budgets should be checked again. It must not close the
+ * `pool' that is being expanded.
+ */
+typedef bool (*PoolPressureFuncPtr)(Pool* pool, size_t bytes, void* ctx);
+
+/*
+ * Function called when `pool' has no free chunks left, along with the `ctx'
+ * argument of `pool_set_exhausted_handler'. See that function.
+ */
+typedef void (*PoolExhaustedFuncPtr)(Pool* pool, void* ctx);
+
+/*
+ * Flags that change the behavior of a pool, see `pool_set_flags'.
+ *
+ *   - POOL_ZERO_ON_FREE: Zero the chunks when they are freed, so `pool_calloc'
+ *     doesn't have to.
+ *   - POOL_RELEASE_ON_FREE: When a chunk is freed, tell the system that it can
+ *     reclaim its memory, except for the first page. Only supported for pools
+ *     with large chunks (see `pool_new'), and ignored otherwise.
+ *   - POOL_FIFO: Reuse the free chunks in the same order they were freed,
+ *     instead of reusing the most recently freed chunk first. Useful when the
+ *     chunks are freed in roughly the same order they were allocated (e.g. in
+ *     queues), since the allocations go through memory sequentially.
+ */
+enum PoolFlags {
+    POOL_ZERO_ON_FREE    = (1 << 0),
+    POOL_RELEASE_ON_FREE = (1 << 1),
+    POOL_FIFO            = (1 << 2)
+};
+
+/*
+ * Strategies for choosing the stride of the chunks in `pool_new_for'.
+ *
+ *   - POOL_LAYOUT_AUTO: Choose one of the following, depending on the size.
+ *   - POOL_LAYOUT_PACKED: The size rounded up to the alignment.
+ *   - POOL_LAYOUT_CACHE_LINE: Avoid objects that straddle cache lines without
+ *     need, by using a power of two for objects smaller than a cache line, or
+ *     a multiple of the cache line size for bigger objects.
+ *   - POOL_LAYOUT_POW2: The size rounded up to a power of two.
+ */
+enum PoolLayoutKind {
+    POOL_LAYOUT_AUTO = 0,
+    POOL_LAYOUT_PACKED,
+    POOL_LAYOUT_CACHE_LINE,
+    POOL_LAYOUT_POW2
+};
+
+/*
+ * Layout chosen by `pool_layout' and `pool_new_for'. The `stride' is the size
+ * of each chunk, `align' is the alignment of each chunk, `pool_sz' is the
+ * number of chunks of the first array, and `array_bytes' is its size. The
+ * `waste' is the number of bytes of that array that are not used by the
+ * objects, including the padding of each chunk and the unused part of the
+ * last page.
+ */
+typedef struct PoolLayout {
+    int kind;
+    size_t stride;
+    size_t align;
+    size_t pool_sz;
+    size_t array_bytes;
+    size_t waste;
+} PoolLayout;
+
 /*
  * Allocate and initialize a new `Pool' structure, with the specified number of
  * chunks, each with the specified size.
@@ -47,9 +183,43 @@ extern PoolFreeFuncPtr pool_ext_free;
  *   - The `chunk_sz' must be greater or equal than `sizeof(void*)'.
  *   - The pool size can be updated with `pool_expand', but the chunk size
  *     cannot be changed.
+ *   - If `chunk_sz' is at least `LIBPOOL_LARGE_CHUNK_SZ' (by default, 64 KiB)
+ *     and `pool_ext_map' is not NULL, it's rounded up to a multiple of the page
+ *     size, and the chunk arrays are always mapped with `pool_ext_map', so each
+ *     chunk is page-aligned.
+ *   - In that case, the rounded size is the real size of each chunk: the
+ *     arrays use `pool_sz' times the rounded size, and it's the `chunk_sz'
+ *     reported by `pool_get_stats'. For example, with 4 KiB pages, a pool of
+ *     65537-byte chunks uses 69632 bytes for each of them.
  */
 Pool* pool_new(size_t pool_sz, size_t chunk_sz);
 
+/*
+ * Fill the `layout' structure with the layout of a pool for at least `pool_sz'
+ * objects of `size' bytes, aligned to `align' bytes (which can be zero), with
+ * the specified `kind' of layout (see `enum PoolLayoutKind'). The number of
+ * chunks is increased so the first array fills its last page.
+ *
+ * Returns false if the arguments are not valid (e.g. the alignment is not a
+ * power of two), or if the sizes overflow.
+ */
+bool pool_layout(size_t pool_sz, size_t size, size_t align, int kind,
+                 PoolLayout* layout);
+
+/*
+ * Create a new pool with the layout chosen by `pool_layout', which is also
+ * stored in `layout' if it's not NULL. The pool is closed with `pool_close'.
+ *
+ * If the alignment of the chunks is bigger than the alignment of
+ * `pool_ext_alloc' (`LIBPOOL_ALLOC_ALIGN', by default twice the size of a
+ * pointer), small arrays are over-allocated with `pool_ext_alloc' and aligned,
+ * and big arrays are mapped with `pool_ext_map', aligned to it. Alignments
+ * bigger than a page always need `pool_ext_map'; if it's NULL, the arrays are
+ * not aligned.
+ */
+Pool* pool_new_for(size_t pool_sz, size_t size, size_t align, int kind,
+                   PoolLayout* layout);
+
 /*
  * Expand the specified `pool', adding `extra_sz' free chunks.
  *
@@ -58,6 +228,26 @@ Pool* pool_new(size_t pool_sz, size_t chunk_sz);
  */
 bool pool_expand(Pool* pool, size_t extra_sz);
 
+/*
+ * Expand the specified `pool' just like `pool_expand', but return a handle of
+ * the new array of `extra_sz' chunks, or NULL on failure. The handle can be
+ * used for releasing the whole array with `pool_release_array'.
+ */
+PoolArray* pool_expand_array(Pool* pool, size_t extra_sz);
+
+/*
+ * Release the specified `array' of the `pool', which was returned by
+ * `pool_expand_array', freeing its memory. All of its chunks are removed from
+ * the pool, whether they are free or not, so the chunks of the array that were
+ * allocated must not be used or freed after this call. The live chunks are
+ * counted as freed in the statistics of the pool.
+ *
+ * The free chunks of the array are removed from the list of free chunks by
+ * their address, so this traverses the whole list. Arrays that don't belong to
+ * the pool are ignored, and `array' can be NULL.
+ */
+void pool_release_array(Pool* pool, PoolArray* array);
+
 /*
  * Free all data in a `Pool' structure, along with the structure itself. All
  * data allocated from this the pool becomes unusable. Allows NULL as the
@@ -71,10 +261,258 @@ void pool_close(Pool* pool);
  */
 void* pool_alloc(Pool* pool);
 
+/*
+ * Allocate a fixed-size chunk from the specified pool, filled with zeros. If no
+ * chunks are available, NULL is returned.
+ *
+ * The chunks that are known to be zeroed (e.g. untouched chunks from arrays
+ * mapped directly from the system) are not zeroed again.
+ */
+void* pool_calloc(Pool* pool);
+
 /*
  * Free a fixed-size chunk from the specified pool. Allows NULL as both
  * arguments.
  */
 void pool_free(Pool* pool, void* ptr);
 
+/*
+ * Allocate up to `n' chunks from the specified pool, storing them in the `ptrs'
+ * array. Returns the number of chunks that were allocated, which is only lower
+ * than `n' if the pool ran out of chunks.
+ */
+size_t pool_alloc_n(Pool* pool, void** ptrs, size_t n);
+
+/*
+ * Free the `n' chunks in the `ptrs' array, just like calling `pool_free' for
+ * each of them, but linking them into the list of free chunks at once. Allows
+ * NULL pointers in the array.
+ */
+void pool_free_n(Pool* pool, void** ptrs, size_t n);
+
+/*
+ * Check if `ptr' points to the start of a chunk of the specified `pool', either
+ * allocated or free. The time depends on the number of chunk arrays, so it's
+ * meant for debugging checks. Allows NULL as both arguments.
+ */
+bool pool_contains(Pool* pool, const void* ptr);
+
+/*
+ * Set the function that will be called, along with the `ctx' argument, when
+ * allocating from the specified `pool' finds no free chunks. After the function
+ * returns, the allocation is tried once more, and it only fails if there are
+ * still no free chunks. Can be NULL, which is the default.
+ *
+ * The function can add chunks to the pool (e.g. with `pool_expand'), release
+ * memory elsewhere, or abort the program. It must not close the `pool'. While
+ * it runs, allocations from the same `pool' don't call it again.
+ */
+void pool_set_exhausted_handler(Pool* pool, PoolExhaustedFuncPtr func,
+                                void* ctx);
+
+/*
+ * Set the flags of the specified `pool', which are a combination of the values
+ * in `enum PoolFlags'. By default, no flags are set.
+ */
+void pool_set_flags(Pool* pool, unsigned flags);
+
+/*
+ * Get the flags of the specified `pool'.
+ */
+unsigned pool_get_flags(Pool* pool);
+
+/*
+ * Set the label of the specified `pool', used when reporting its statistics.
+ * The string is not copied, so it must be valid for as long as the pool is
+ * open (e.g. a string literal).
+ */
+void pool_set_name(Pool* pool, const char* name);
+
+/*
+ * Fill the `stats' structure with the usage statistics of the specified `pool'.
+ *
+ * Notes:
+ *   - If the `LIBPOOL_STATS' environment variable contains a path when the
+ *     first pool is created, the statistics of each pool are appended to that
+ *     file as JSON lines when the pool is closed, or when the program exits.
+ *   - The environment variable is ignored if `LIBPOOL_NO_STDLIB' is defined.
+ *   - If `LIBPOOL_NO_STATS' is defined, the allocations and frees are not
+ *     counted, so the `allocs', `frees', `live' and `peak_live' members are
+ *     always zero.
+ */
+void pool_get_stats(Pool* pool, PoolStats* stats);
+
+/*
+ * Round up the size of the chunk arrays added by `pool_expand' to a multiple of
+ * `bytes' bytes, which is rounded up to a power of two, and align them to it.
+ * The remaining space is filled with extra chunks, which are counted in the
+ * `slack' member of `PoolStats'. If `bytes' is zero, which is the default, the
+ * arrays are not rounded.
+ *
+ * Notes:
+ *   - Using the size of huge pages (e.g. 2 MiB on x86-64) allows the system to
+ *     back the arrays with huge pages, which is requested with `MADV_HUGEPAGE'
+ *     when possible.
+ *   - Arrays that are mapped are aligned by mapping more memory with
+ *     `pool_ext_map', and unmapping the excess at both sides with
+ *     `pool_ext_unmap'. Small arrays with a granularity of at most a page are
+ *     aligned by allocating some extra bytes with `pool_ext_alloc'. If
+ *     `pool_ext_map' is NULL, bigger granularities are rounded up but not
+ *     aligned.
+ */
+void pool_set_granularity(Pool* pool, size_t bytes);
+
+/*
+ * Limit the total size of the chunk arrays of the specified `pool' to
+ * `max_bytes' bytes. If `max_bytes' is zero, the pool is not limited, which is
+ * the default.
+ *
+ * Once the limit is reached, `pool_expand' calls the pressure handler (see
+ * `pool_set_pressure_handler'), and fails if it doesn't release enough memory.
+ */
+void pool_set_budget(Pool* pool, size_t max_bytes);
+
+/*
+ * Limit the total size of the chunk arrays of all pools to `max_bytes' bytes.
+ * If `max_bytes' is zero, the pools are not limited.
+ *
+ * If this function is not called, the global budget is initialized from
+ * the memory limit of the cgroup of the process (the smallest `memory.max' of
+ * the cgroup listed in `/proc/self/cgroup' and its ancestors), if any. Since
+ * that limit also applies to the memory that is not used by the pools, only
+ * `LIBPOOL_CGROUP_SHARE' percent of it is used (by default, 75%). This is only
+ * done on Linux, and if `LIBPOOL_NO_STDLIB' is not defined.
+ */
+void pool_set_global_budget(size_t max_bytes);
+
+/*
+ * Return the total size of the chunk arrays of all open pools.
+ */
+size_t pool_get_global_bytes(void);
+
+/*
+ * Set the function that will be called, along with the `ctx' argument, when
+ * creating or expanding a pool would exceed a budget. Can be NULL.
+ */
+void pool_set_pressure_handler(PoolPressureFuncPtr func, void* ctx);
+
+/*
+ * Release the memory of the free chunks of the specified `pool' that have not
+ * been used since the last call to this function, up to `max_bytes' bytes.
+ * Returns the number of bytes that were released.
+ *
+ * Notes:
+ *   - The pool is never scavenged automatically, since it walks the free
+ *     chunks of the whole pool. To follow the load, call this function
+ *     periodically from a point where the latency doesn't matter (e.g. a timer
+ *     or an idle loop).
+ *   - Only whole pages covered by consecutive free chunks can be released, and
+ *     the system reclaims them lazily (with `MADV_FREE').
+ *   - The released chunks are still part of the pool. They are only reused
+ *     when there are no other free chunks left.
+ *   - If `LIBPOOL_NO_STATS' is defined, the pool can't tell which free chunks
+ *     were used recently, so all of them can be released.
+ *   - This is only supported on Unix-like systems, and if `LIBPOOL_NO_STDLIB'
+ *     and `LIBPOOL_NO_MADVISE' are not defined. Otherwise, it returns zero.
+ */
+size_t pool_scavenge(Pool* pool, size_t max_bytes);
+
+/*
+ * Write a snapshot of the specified `pool' to the file descriptor `fd': its
+ * settings and statistics, the address of each chunk array (the relocation
+ * table), and the contents of the arrays. Returns true on success.
+ *
+ * Notes:
+ *   - The snapshot is written sequentially, so `fd' can be a pipe.
+ *   - The snapshot can only be restored by a build of libpool with the same
+ *     pointer size and byte order.
+ *   - The name of the pool and its group are not part of the snapshot.
+ *   - This is only supported on Unix-like systems, and if `LIBPOOL_NO_STDLIB'
+ *     is not defined. Otherwise, it returns false.
+ */
+bool pool_snapshot(Pool* pool, int fd);
+
+/*
+ * Read a snapshot written by `pool_snapshot' from the file descriptor `fd', and
+ * create a new pool from it, with the same settings, statistics, chunks and
+ * contents.
+ *
+ * The chunk arrays are allocated again, so they will probably be at different
+ * addresses. The pointers used by the pool itself (e.g. the `.next' pointers
+ * of the free chunks) are translated, but the contents of the live chunks are
+ * not modified: pointers stored by the user must be translated with
+ * `pool_relocate', or the data must not contain absolute addresses.
+ *
+ * Notes:
+ *   - If the snapshot can't be read or is not valid, NULL is returned.
+ *   - The caller must free the returned pointer using `pool_close'.
+ *   - The released chunks (see `pool_scavenge') are part of the snapshot, so
+ *     their memory is not released in the new pool.
+ */
+Pool* pool_restore(int fd);
+
+/*
+ * Translate an address `old_ptr' from the process that wrote the snapshot of
+ * the specified `pool' to its address in the restored pool. Returns NULL if
+ * the address was not inside the chunk arrays, or if the pool was not created
+ * by `pool_restore'.
+ */
+void* pool_relocate(Pool* pool, const void* old_ptr);
+
+/*
+ * Allocate a new, empty group of pools. Pools are added to the group with
+ * `pool_group_add', and they can be closed and measured together.
+ *
+ * Notes:
+ *   - If the initialization fails, NULL is returned.
+ *   - The caller must free the returned pointer using `pool_group_close'.
+ */
+PoolGroup* pool_group_new(void);
+
+/*
+ * Close all the pools in the specified `group', along with the group itself.
+ * Allows NULL as the `group' parameter.
+ */
+void pool_group_close(PoolGroup* group);
+
+/*
+ * Add the specified `pool' to a `group', removing it from its previous group,
+ * if any. A pool that is closed with `pool_close' is removed from its group
+ * automatically.
+ *
+ * Note that the pool is added even if its arrays exceed the budget of the
+ * group. The budget only applies to the following expansions.
+ */
+void pool_group_add(PoolGroup* group, Pool* pool);
+
+/*
+ * Remove the specified `pool' from its group, if any, without closing it.
+ */
+void pool_group_remove(Pool* pool);
+
+/*
+ * Set the label of the specified `group', used in its statistics. The string
+ * is not copied, just like in `pool_set_name'.
+ */
+void pool_group_set_name(PoolGroup* group, const char* name);
+
+/*
+ * Limit the total size of the chunk arrays of the pools in the specified
+ * `group' to `max_bytes' bytes, in addition to their own budgets. If
+ * `max_bytes' is zero, which is the default, the group is not limited.
+ */
+void pool_group_set_budget(PoolGroup* group, size_t max_bytes);
+
+/*
+ * Fill the `stats' structure with the sum of the statistics of the pools in the
+ * specified `group'. The `chunk_sz' member is zero if the pools have different
+ * chunk sizes, and `peak_live' is the sum of the peaks of each pool, so it's
+ * only an upper bound.
+ *
+ * The list of pools is traversed while holding the lock, but the counters of
+ * each pool are not protected by it, so this must not be called while other
+ * threads use the pools of the group, just like `pool_get_stats'.
+ */
+void pool_group_get_stats(PoolGroup* group, PoolStats* stats);
+
 #endif /* POOL_H_ */